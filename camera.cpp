@@ -128,3 +128,27 @@ void Camera::ComputeViewFrustum()
 	m_frustum[FRUSTUM_Bottom] = {n, pt};
 }
 
+
+bool Camera::IsBoxVisible(const mat4& model, const vec3& boxMin, const vec3& boxMax) const
+{
+	// the planes are in view space
+	const mat4 modelView = m_view * model;
+	vec3 corners[8];
+	for(int i = 0; i < 8; ++i)
+	{
+		const vec3 corner(i & 1 ? boxMax.x : boxMin.x, i & 2 ? boxMax.y : boxMin.y, 
+			i & 4 ? boxMax.z : boxMin.z);
+		corners[i] = TransformPoint(modelView, corner);
+	}
+
+	// outside if all of the corners are behind one of the planes
+	for(const Plane& plane : m_frustum)
+	{
+		int numBehind = 0;
+		for(const vec3& corner : corners)
+			numBehind += PlaneDist(plane, corner) < 0.f;
+		if(numBehind == 8)
+			return false;
+	}
+	return true;
+}
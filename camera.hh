@@ -70,6 +70,8 @@ public:
 	void SetAspect(float a) { m_aspect = a; }
 
 	void ComputeViewFrustum();
+	// true if any part of the box from boxMin to boxMax, placed with model, is in the frustum
+	bool IsBoxVisible(const mat4& model, const vec3& boxMin, const vec3& boxMax) const;
 private:
 
 	Viewframe m_vf;
@@ -0,0 +1,427 @@
+#include <GL/glew.h>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture.hh"
+#include "render.hh"
+#include "mathhelpers.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+// A frame that's been read back, waiting to be written.
+class CaptureFrame
+{
+public:
+	CaptureFrame() : m_stream(false), m_width(0), m_height(0), m_bgra(nullptr), m_buffer(-1) {}
+	std::string m_filename;
+	bool m_stream; // goes to the stream instead of the file
+	int m_width;
+	int m_height;
+	unsigned char* m_bgra; // rows bottom up, in the mapped buffer or m_copy
+	int m_buffer; // the capture buffer that's mapped, -1 if the pixels are in m_copy
+	std::vector<unsigned char> m_copy;
+};
+
+class CaptureBuffer
+{
+public:
+	CaptureBuffer() : m_buffer(0), m_size(0), m_pending(false), m_mapped(false),
+		m_written(false), m_frame(0), m_stream(false), m_width(0), m_height(0) {}
+	GLuint m_buffer;
+	size_t m_size; // what's allocated
+	bool m_pending; // read into and not mapped yet
+	bool m_mapped; // the writer has it, it's unmapped once it's written
+	bool m_written; // set by the writer, under g_mutex
+	int m_frame; // when it was read
+	std::string m_filename;
+	bool m_stream;
+	int m_width;
+	int m_height;
+};
+
+// a save more often than once a frame takes the next buffer, and the writer keeps the ones
+// it's writing mapped
+static constexpr int kNumCaptureBuffers = kCaptureLatency + 4;
+// at 1080p that's 64 MB waiting to be written, for the frames that are copied
+static constexpr int kMaxQueuedFrames = 8;
+
+static CaptureBuffer g_buffers[kNumCaptureBuffers];
+static int g_nextBuffer; // the oldest one
+static int g_frame;
+
+// The writer has its own thread so writing doesn't hold up the volume updates on the worker
+// threads while recording.
+static std::thread g_writer;
+static std::mutex g_mutex;
+static std::condition_variable g_queueCond; // signalled when a frame is queued or on quit
+static std::condition_variable g_writtenCond; // signalled when a frame is written
+static std::deque<std::shared_ptr<CaptureFrame>> g_queue;
+static int g_numWriting;
+static bool g_quit;
+
+// Only the writer touches the stream between capture_BeginStream and capture_EndStream, which
+// both wait for it to finish first.
+static FILE* g_stream;
+static int g_streamFormat;
+static int g_streamFps;
+static bool g_streamStarted; // the header's written
+static bool g_streamFailed; // the reader went away, the rest is dropped
+static std::vector<unsigned char> g_streamBuffer;
+
+////////////////////////////////////////////////////////////////////////////////
+// BT.601 limited range, what players assume for Y4M without a colorspace tag
+static inline int capture_Luma(int r, int g, int b)
+	{ return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16; }
+static inline int capture_ChromaU(int r, int g, int b)
+	{ return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128; }
+static inline int capture_ChromaV(int r, int g, int b)
+	{ return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128; }
+
+// Y, U and V planes, top down. Chroma is the average of each 2x2 block.
+static void capture_ConvertYuv420(const CaptureFrame& frame, unsigned char* out)
+{
+	const int width = frame.m_width, height = frame.m_height;
+	const int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+	unsigned char* yPlane = out;
+	unsigned char* uPlane = yPlane + size_t(width) * height;
+	unsigned char* vPlane = uPlane + size_t(chromaWidth) * chromaHeight;
+
+	auto getPixel = [&](int x, int y) {
+		return &frame.m_bgra[(size_t(height - 1 - y) * width + x) * 4];
+	};
+	for(int y = 0; y < height; ++y)
+	{
+		unsigned char* dst = yPlane + size_t(y) * width;
+		const unsigned char* src = getPixel(0, y);
+		for(int x = 0; x < width; ++x, src += 4)
+			dst[x] = capture_Luma(src[2], src[1], src[0]);
+	}
+	for(int cy = 0; cy < chromaHeight; ++cy)
+	{
+		const int y0 = cy * 2, y1 = Min(y0 + 1, height - 1);
+		for(int cx = 0; cx < chromaWidth; ++cx)
+		{
+			const int x0 = cx * 2, x1 = Min(x0 + 1, width - 1);
+			const unsigned char* p[4] = { getPixel(x0, y0), getPixel(x1, y0),
+				getPixel(x0, y1), getPixel(x1, y1) };
+			int r = 2, g = 2, b = 2;
+			for(const unsigned char* src : p)
+			{
+				r += src[2];
+				g += src[1];
+				b += src[0];
+			}
+			r >>= 2; g >>= 2; b >>= 2;
+			uPlane[size_t(cy) * chromaWidth + cx] = capture_ChromaU(r, g, b);
+			vPlane[size_t(cy) * chromaWidth + cx] = capture_ChromaV(r, g, b);
+		}
+	}
+}
+
+static void capture_ConvertRgb(const CaptureFrame& frame, unsigned char* out)
+{
+	const int width = frame.m_width, height = frame.m_height;
+	for(int y = 0; y < height; ++y)
+	{
+		const unsigned char* src = &frame.m_bgra[size_t(height - 1 - y) * width * 4];
+		unsigned char* dst = out + size_t(y) * width * 3;
+		for(int x = 0; x < width; ++x, src += 4, dst += 3)
+		{
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+		}
+	}
+}
+
+static void capture_WriteStream(const CaptureFrame& frame)
+{
+	if(!g_stream || g_streamFailed)
+		return;
+
+	// the size isn't known until the first frame
+	if(!g_streamStarted && g_streamFormat == CAPTURE_Y4M)
+		fprintf(g_stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+			frame.m_width, frame.m_height, g_streamFps);
+	g_streamStarted = true;
+
+	size_t size;
+	if(g_streamFormat == CAPTURE_Y4M)
+	{
+		static const char kFrameHeader[] = "FRAME\n";
+		const size_t headerSize = sizeof(kFrameHeader) - 1;
+		const size_t chromaSize = size_t((frame.m_width + 1) / 2) * ((frame.m_height + 1) / 2);
+		size = headerSize + size_t(frame.m_width) * frame.m_height + chromaSize * 2;
+		g_streamBuffer.resize(size);
+		memcpy(&g_streamBuffer[0], kFrameHeader, headerSize);
+		capture_ConvertYuv420(frame, &g_streamBuffer[headerSize]);
+	}
+	else
+	{
+		size = size_t(frame.m_width) * frame.m_height * 3;
+		g_streamBuffer.resize(size);
+		capture_ConvertRgb(frame, &g_streamBuffer[0]);
+	}
+
+	// flushed so an encoder reading a pipe gets every frame as it's made
+	if(fwrite(&g_streamBuffer[0], 1, size, g_stream) != size || fflush(g_stream) != 0)
+	{
+		std::cerr << "Capture stream closed, dropping the rest of the frames." << std::endl;
+		g_streamFailed = true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void capture_RunWriter()
+{
+	for(;;)
+	{
+		std::shared_ptr<CaptureFrame> frame;
+		{
+			std::unique_lock<std::mutex> lock(g_mutex);
+			g_queueCond.wait(lock, [](){ return g_quit || !g_queue.empty(); });
+			if(g_queue.empty())
+				return;
+			frame = std::move(g_queue.front());
+			g_queue.pop_front();
+			++g_numWriting;
+		}
+
+		if(frame->m_stream)
+			capture_WriteStream(*frame);
+		else
+		{
+			// the back buffer's alpha is whatever was blended into it
+			unsigned char* bgra = frame->m_bgra;
+			for(size_t i = 3, size = size_t(frame->m_width) * frame->m_height * 4; i < size; i += 4)
+				bgra[i] = 0xff;
+			render_SaveTGA32(frame->m_filename.c_str(), frame->m_width, frame->m_height, bgra);
+		}
+
+		std::unique_lock<std::mutex> lock(g_mutex);
+		if(frame->m_buffer >= 0)
+			g_buffers[frame->m_buffer].m_written = true;
+		--g_numWriting;
+		g_writtenCond.notify_all();
+	}
+}
+
+static void capture_Enqueue(const std::shared_ptr<CaptureFrame>& frame)
+{
+	std::unique_lock<std::mutex> lock(g_mutex);
+	g_writtenCond.wait(lock, [](){ return int(g_queue.size()) < kMaxQueuedFrames; });
+	g_queue.push_back(frame);
+	g_queueCond.notify_one();
+}
+
+// The writer gets the mapping itself, read-write since it sets the alpha before saving.
+static void capture_FinishBuffer(CaptureBuffer& buffer)
+{
+	buffer.m_pending = false;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.m_buffer);
+	unsigned char* mapped = static_cast<unsigned char*>(
+		glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_WRITE));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	checkGlError("capture_FinishBuffer");
+	if(!mapped)
+		return;
+
+	auto frame = std::make_shared<CaptureFrame>();
+	frame->m_filename = std::move(buffer.m_filename);
+	frame->m_stream = buffer.m_stream;
+	frame->m_width = buffer.m_width;
+	frame->m_height = buffer.m_height;
+	frame->m_bgra = mapped;
+	frame->m_buffer = int(&buffer - g_buffers);
+	buffer.m_mapped = true;
+	buffer.m_written = false;
+	capture_Enqueue(frame);
+}
+
+// unmaps the buffers the writer's done with, they can be read into again after
+static void capture_UnmapWritten()
+{
+	for(CaptureBuffer& buffer : g_buffers)
+	{
+		if(!buffer.m_mapped)
+			continue;
+		{
+			std::unique_lock<std::mutex> lock(g_mutex);
+			if(!buffer.m_written)
+				continue;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.m_buffer);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		buffer.m_mapped = false;
+	}
+	checkGlError("capture_UnmapWritten");
+}
+
+// finishes the pending buffers read at least minAge frames ago, oldest first
+static void capture_FinishPending(int minAge)
+{
+	capture_UnmapWritten();
+	for(int i = 0; i < kNumCaptureBuffers; ++i)
+	{
+		CaptureBuffer& buffer = g_buffers[(g_nextBuffer + i) % kNumCaptureBuffers];
+		if(buffer.m_pending && g_frame - buffer.m_frame >= minAge)
+			capture_FinishBuffer(buffer);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void capture_Init()
+{
+	for(CaptureBuffer& buffer : g_buffers)
+		glGenBuffers(1, &buffer.m_buffer);
+	g_quit = false;
+	g_writer = std::thread(capture_RunWriter);
+}
+
+void capture_Shutdown()
+{
+	capture_EndStream();
+	capture_Flush();
+	{
+		std::unique_lock<std::mutex> lock(g_mutex);
+		g_quit = true;
+		g_queueCond.notify_one();
+	}
+	g_writer.join();
+	for(CaptureBuffer& buffer : g_buffers)
+	{
+		glDeleteBuffers(1, &buffer.m_buffer);
+		buffer = CaptureBuffer();
+	}
+}
+
+static void capture_ReadScreen(const char* filename, bool stream)
+{
+	CaptureBuffer& buffer = g_buffers[g_nextBuffer];
+	if(buffer.m_pending)
+		capture_FinishBuffer(buffer);
+	if(buffer.m_mapped)
+	{
+		// the writer's that far behind
+		{
+			std::unique_lock<std::mutex> lock(g_mutex);
+			g_writtenCond.wait(lock, [&buffer](){ return buffer.m_written; });
+		}
+		capture_UnmapWritten();
+	}
+	g_nextBuffer = (g_nextBuffer + 1) % kNumCaptureBuffers;
+
+	GLint readFramebuffer = 0;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFramebuffer);
+	if(readFramebuffer == 0)
+		glReadBuffer(GL_BACK);
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	buffer.m_pending = true;
+	buffer.m_frame = g_frame;
+	buffer.m_filename = filename;
+	buffer.m_stream = stream;
+	buffer.m_width = viewport[2];
+	buffer.m_height = viewport[3];
+
+	// BGRA is what TGA stores, and what drivers read back fastest
+	const size_t size = size_t(buffer.m_width) * buffer.m_height * 4;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.m_buffer);
+	if(buffer.m_size != size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+		buffer.m_size = size;
+	}
+	glReadPixels(viewport[0], viewport[1], buffer.m_width, buffer.m_height, GL_BGRA,
+		GL_UNSIGNED_BYTE, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	checkGlError("capture_ReadScreen");
+}
+
+void capture_SaveScreen(const char* filename)
+{
+	capture_ReadScreen(filename, false);
+}
+
+void capture_Update()
+{
+	++g_frame;
+	capture_FinishPending(kCaptureLatency);
+}
+
+void capture_Flush()
+{
+	capture_FinishPending(0);
+	{
+		std::unique_lock<std::mutex> lock(g_mutex);
+		g_writtenCond.wait(lock, [](){ return g_queue.empty() && g_numWriting == 0; });
+	}
+	capture_UnmapWritten();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool capture_BeginStream(const char* path, int format, int fps)
+{
+	capture_EndStream();
+	capture_Flush();
+
+	// a reader going away should fail the write rather than kill the process
+	signal(SIGPIPE, SIG_IGN);
+	g_stream = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+	if(!g_stream)
+	{
+		std::cerr << "Failed to open " << path << " for streaming." << std::endl;
+		return false;
+	}
+	g_streamFormat = format;
+	g_streamFps = Max(1, fps);
+	g_streamStarted = false;
+	g_streamFailed = false;
+	return true;
+}
+
+void capture_StreamScreen()
+{
+	if(g_stream)
+		capture_ReadScreen("", true);
+}
+
+void capture_StreamPixels(int width, int height, const unsigned char* bgra)
+{
+	if(!g_stream)
+		return;
+	auto frame = std::make_shared<CaptureFrame>();
+	frame->m_stream = true;
+	frame->m_width = width;
+	frame->m_height = height;
+	frame->m_copy.assign(bgra, bgra + size_t(width) * height * 4);
+	frame->m_bgra = &frame->m_copy[0];
+	capture_Enqueue(frame);
+}
+
+void capture_EndStream()
+{
+	if(!g_stream)
+		return;
+	capture_Flush();
+	if(g_stream == stdout)
+		fflush(stdout);
+	else
+		fclose(g_stream);
+	g_stream = nullptr;
+	g_streamBuffer = std::vector<unsigned char>();
+}
+
+bool capture_IsStreaming()
+{
+	return g_stream != nullptr;
+}
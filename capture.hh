@@ -0,0 +1,37 @@
+#pragma once
+
+// Saving what's drawn without waiting for it. The pixels are read into a ring of pixel pack
+// buffers and only mapped kCaptureLatency frames later, when the GPU is long done with them.
+// A writer thread then writes each frame's file in one go straight out of the mapping, and the
+// buffer's unmapped on the main thread once it's written.
+constexpr int kCaptureLatency = 2;
+
+void capture_Init();
+// Writes out everything still pending and stops the writer thread.
+void capture_Shutdown();
+// Starts reading the viewport of the current read framebuffer, the back buffer if it's the
+// default one. It's saved as a TGA file at filename once it's been read back.
+void capture_SaveScreen(const char* filename);
+// Once per frame. Hands what was read kCaptureLatency frames ago to the writer, and waits for
+// the writer if it's too far behind.
+void capture_Update();
+// Hands everything read so far to the writer and waits until it's all written.
+void capture_Flush();
+
+// Instead of a file per frame, frames can be streamed one after another to stdout or a named
+// pipe, for piping into an encoder like ffmpeg.
+enum CaptureStreamFormat
+{
+	CAPTURE_Y4M, // YUV4MPEG2, 4:2:0 limited range, which ffmpeg reads without being told the size
+	CAPTURE_RawRGB, // rgb24 top down with no header
+};
+
+// path "-" is stdout. Opening a named pipe waits until something opens the other end.
+bool capture_BeginStream(const char* path, int format, int fps);
+// Like capture_SaveScreen, except the frame goes to the stream.
+void capture_StreamScreen();
+// For frames that weren't drawn, rows bottom up like glReadPixels.
+void capture_StreamPixels(int width, int height, const unsigned char* bgra);
+// Writes out what's still pending and closes the stream.
+void capture_EndStream();
+bool capture_IsStreaming();
@@ -0,0 +1,464 @@
+#include <cmath>
+#include <cstring>
+#include "density.hh"
+#include "common.hh"
+#include "noise.hh"
+#include "vec.hh"
+#include "commonmath.hh"
+#include "task.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+// GLSL builtins the gen shaders use. Note that smoothstep is the cubic version, not SmoothStep
+// from commonmath.
+static inline float GlslSmoothStep(float edge0, float edge1, float x)
+{
+	float t = Clamp((x - edge0) / (edge1 - edge0), 0.f, 1.f);
+	return t * t * (3.f - 2.f * t);
+}
+
+static inline float GlslMix(float x, float y, float a)
+{
+	return x * (1.f - a) + y * a;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Each density function is split into the fbm lookups and the shape that uses them, so the
+// lookups can be done 8 at a time. The fbm point is (pt + m_offset0) + m_offset1, which keeps
+// the additions in the same order as the shaders.
+class FbmInput
+{
+public:
+	vec3 m_offset0;
+	vec3 m_offset1;
+	float m_h;
+	float m_lacunarity;
+	float m_octaves;
+};
+
+static constexpr int kMaxFbmInputs = 2;
+
+static int GetFbmInputs(const DensityParams& params, FbmInput* inputs)
+{
+	switch(params.m_type)
+	{
+		case DENSITY_SphereNoise: 
+			inputs[0] = { vec3(0.f), vec3(0.f), 0.6f, 2.f, 11.f };
+			inputs[1] = { vec3(3.33f), vec3(0.f), 0.9f, 2.f, 11.f };
+			return 2;
+		case DENSITY_PlaneNoise:
+			inputs[0] = { params.m_time * vec3(0.2f, 0.f, 0.f), vec3(0.f), 0.79f, 1.9f, 9.f };
+			return 1;
+		case DENSITY_FlameNoise:
+			{
+				vec3 velocity = vec3(0.f, 0.f, -0.3f) * params.m_time;
+				inputs[0] = { velocity, vec3(0.f), 0.64f, 2.f, 11.f };
+				inputs[1] = { vec3(3.33f), 1.3f * velocity, 0.7f, 2.f, 11.f };
+			}
+			return 2;
+		default: ASSERT(false); break;
+	}
+	return 0;
+}
+
+// shaders/gen/spherenoise.glsl
+static float SphereNoiseShape(const DensityParams& params, const vec3& pt, const float* fbm)
+{
+	const vec3 center(0.5f);
+	float len = Length(pt - center);
+
+	float n = 0.2f * params.m_time * fabsf(fbm[0]);
+	float n2 = 0.1f * params.m_time * fabsf(fbm[1]);
+
+	float r = Max(params.m_radius + n, 0.f);
+	float ir = Max(params.m_innerRadius + n2, 0.f);
+
+	float outerDensity = 1.f - GlslSmoothStep(r - 0.01f, r + 0.01f, len);
+	float innerDensity = GlslSmoothStep(ir - 0.01f, ir + 0.01f, len);
+
+	float invdiff = 1.f / (r - ir);
+	float t = Clamp((len - ir) * invdiff, 0.f, 1.f);
+
+	return GlslMix(innerDensity, outerDensity, t);
+}
+
+// shaders/gen/planenoise.glsl
+static float PlaneNoiseShape(const DensityParams& params, const vec3& pt, const float* fbm)
+{
+	const vec3 normal(0.f, 0.f, 1.f);
+	const vec3 center(0.5f);
+
+	float n = 0.3f * fabsf(fbm[0]);
+	vec3 p = pt + n * normal;
+
+	float dist = Dot(p - center, normal);
+	float len = fabsf(dist);
+
+	return 1.f - GlslSmoothStep(params.m_width - 0.01f, params.m_width + 0.01f, len);
+}
+
+// shaders/gen/flamenoise.glsl
+static float FlameNoiseShape(const DensityParams& params, const vec3& pt, const float* fbm)
+{
+	const vec3 startpt(0.5f, 0.5f, 0.f);
+	const vec3 dir(0.f, 0.f, 1.f);
+	vec3 toPt = pt - startpt;
+	vec3 closestVec = toPt - dir * Dot(dir, toPt);
+	float len = Length(closestVec);
+
+	float n = 0.3f * fabsf(fbm[0]);
+	float n2 = 0.1f * fabsf(fbm[1]);
+
+	float falloff = expf(-3.f * Max(pt.z - 0.1f, 0.f));
+
+	float r = Max(params.m_radius * falloff + n, 0.f);
+	float ir = Max(params.m_innerRadius * falloff + n2, 0.f);
+
+	float outerDensity = 1.f - GlslSmoothStep(r - 0.01f, r + 0.01f, len);
+	float innerDensity = 1.f - GlslSmoothStep(ir - 0.01f, ir + 0.01f, len);
+
+	return Max(0.f, outerDensity - innerDensity);
+}
+
+static float DensityShape(const DensityParams& params, const vec3& pt, const float* fbm)
+{
+	switch(params.m_type)
+	{
+		case DENSITY_SphereNoise: return SphereNoiseShape(params, pt, fbm);
+		case DENSITY_PlaneNoise: return PlaneNoiseShape(params, pt, fbm);
+		case DENSITY_FlameNoise: return FlameNoiseShape(params, pt, fbm);
+		default: ASSERT(false); break;
+	}
+	return 0.f;
+}
+
+static inline unsigned char DensityToTexel(float density)
+{
+	return static_cast<unsigned char>(Clamp(density, 0.f, 1.f) * 255.f + 0.5f);
+}
+
+// evaluates count texels of row (y, z), starting at x0
+static void FillRow(const DensityParams& params, const FbmInput* inputs, int numInputs,
+	int numCells, int x0, int count, int y, int z, unsigned char* out)
+{
+	// The gen shaders are drawn as a fullscreen quad per layer, so x and y are sampled at texel
+	// centers, but the layer z coordinate in GpuHypertexture::Update is z/numCells.
+	const float invCells = 1.f / numCells;
+	vec3 pt;
+	pt.y = (y + 0.5f) * invCells;
+	pt.z = z * invCells;
+
+	const int xEnd = x0 + count;
+	int x = x0;
+	for(; x + kNoiseBatchSize <= xEnd; x += kNoiseBatchSize)
+	{
+		float fbm[kMaxFbmInputs][kNoiseBatchSize];
+		for(int i = 0; i < numInputs; ++i)
+		{
+			const FbmInput& in = inputs[i];
+			float px[kNoiseBatchSize], py[kNoiseBatchSize], pz[kNoiseBatchSize];
+			for(int lane = 0; lane < kNoiseBatchSize; ++lane)
+			{
+				vec3 p((x + lane + 0.5f) * invCells, pt.y, pt.z);
+				p = (p + in.m_offset0) + in.m_offset1;
+				px[lane] = p.x; py[lane] = p.y; pz[lane] = p.z;
+			}
+			FbmNoise8(px, py, pz, in.m_h, in.m_lacunarity, in.m_octaves, fbm[i]);
+		}
+
+		for(int lane = 0; lane < kNoiseBatchSize; ++lane)
+		{
+			pt.x = (x + lane + 0.5f) * invCells;
+			float laneFbm[kMaxFbmInputs] = { fbm[0][lane], fbm[1][lane] };
+			*out++ = DensityToTexel(DensityShape(params, pt, laneFbm));
+		}
+	}
+
+	// rows shorter than a batch
+	for(; x < xEnd; ++x)
+	{
+		pt.x = (x + 0.5f) * invCells;
+		*out++ = DensityToTexel(density_Sample(params, pt));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Brick classification. The density functions are evaluated on ranges instead of values, 
+// using the fbm bounds over the brick and the fact that each step is monotonic in its inputs.
+typedef Limits<float> Range;
+
+// texels round to 0 below 0.5/255, so this leaves some slack for rounding
+static constexpr float kBrickThreshold = 0.25f / 255.f;
+
+static inline Range AbsRange(const Range& r)
+{
+	if(r.m_min >= 0.f) return r;
+	if(r.m_max <= 0.f) return Range(-r.m_max, -r.m_min);
+	return Range(0.f, Max(-r.m_min, r.m_max));
+}
+
+static inline Range ScaleRange(float s, const Range& r)
+{
+	return s >= 0.f ? Range(s * r.m_min, s * r.m_max) : Range(s * r.m_max, s * r.m_min);
+}
+
+// max(base + n, 0)
+static inline Range RadiusRange(const Range& base, const Range& n)
+{
+	return Range(Max(base.m_min + n.m_min, 0.f), Max(base.m_max + n.m_max, 0.f));
+}
+
+// 1 - smoothstep(r - 0.01, r + 0.01, len), which goes down with len and up with r
+static inline Range OutsideEdgeRange(const Range& r, const Range& len)
+{
+	return Range(1.f - GlslSmoothStep(r.m_min - 0.01f, r.m_min + 0.01f, len.m_max),
+		1.f - GlslSmoothStep(r.m_max - 0.01f, r.m_max + 0.01f, len.m_min));
+}
+
+static inline void AxisDistance(float lo, float hi, float c, float& outNear, float& outFar)
+{
+	outNear = c < lo ? lo - c : (c > hi ? c - hi : 0.f);
+	outFar = Max(fabsf(lo - c), fabsf(hi - c));
+}
+
+// distance from c to the nearest and farthest points of the box, ignoring z if !useZ
+static Range DistanceRange(const vec3& lo, const vec3& hi, const vec3& c, bool useZ)
+{
+	float nx, fx, ny, fy, nz = 0.f, fz = 0.f;
+	AxisDistance(lo.x, hi.x, c.x, nx, fx);
+	AxisDistance(lo.y, hi.y, c.y, ny, fy);
+	if(useZ) 
+		AxisDistance(lo.z, hi.z, c.z, nz, fz);
+	return Range(sqrtf(nx*nx + ny*ny + nz*nz), sqrtf(fx*fx + fy*fy + fz*fz));
+}
+
+static Range SphereNoiseRange(const DensityParams& params, const vec3& lo, const vec3& hi,
+	const Range* fbm)
+{
+	Range len = DistanceRange(lo, hi, vec3(0.5f), true);
+	Range n = ScaleRange(0.2f * params.m_time, AbsRange(fbm[0]));
+	Range n2 = ScaleRange(0.1f * params.m_time, AbsRange(fbm[1]));
+
+	Range r = RadiusRange(Range(params.m_radius, params.m_radius), n);
+	Range ir = RadiusRange(Range(params.m_innerRadius, params.m_innerRadius), n2);
+
+	Range outer = OutsideEdgeRange(r, len);
+	Range inner = OutsideEdgeRange(ir, len);
+	inner = Range(1.f - inner.m_max, 1.f - inner.m_min);
+
+	// (len - ir) / (r - ir) is monotonic in each input as long as r - ir keeps its sign, so 
+	// its range is at the corners. Otherwise any mix of the two densities is possible.
+	Range t(0.f, 1.f);
+	if(r.m_min > ir.m_max)
+	{
+		t = Range(1.f, 0.f);
+		for(int i = 0; i < 8; ++i)
+		{
+			float l = (i & 1) ? len.m_max : len.m_min;
+			float outerR = (i & 2) ? r.m_max : r.m_min;
+			float innerR = (i & 4) ? ir.m_max : ir.m_min;
+			float corner = Clamp((l - innerR) / (outerR - innerR), 0.f, 1.f);
+			t = Range(Min(t.m_min, corner), Max(t.m_max, corner));
+		}
+	}
+
+	// mix(inner, outer, t) goes up with inner and outer and is linear in t
+	return Range(Min(GlslMix(inner.m_min, outer.m_min, t.m_min), 
+			GlslMix(inner.m_min, outer.m_min, t.m_max)),
+		Max(GlslMix(inner.m_max, outer.m_max, t.m_min),
+			GlslMix(inner.m_max, outer.m_max, t.m_max)));
+}
+
+static Range PlaneNoiseRange(const DensityParams& params, const vec3& lo, const vec3& hi,
+	const Range* fbm)
+{
+	Range n = ScaleRange(0.3f, AbsRange(fbm[0]));
+	Range len = AbsRange(Range(lo.z + n.m_min - 0.5f, hi.z + n.m_max - 0.5f));
+	return OutsideEdgeRange(Range(params.m_width, params.m_width), len);
+}
+
+static Range FlameNoiseRange(const DensityParams& params, const vec3& lo, const vec3& hi,
+	const Range* fbm)
+{
+	Range len = DistanceRange(lo, hi, vec3(0.5f, 0.5f, 0.f), false);
+	Range n = ScaleRange(0.3f, AbsRange(fbm[0]));
+	Range n2 = ScaleRange(0.1f, AbsRange(fbm[1]));
+
+	Range falloff(expf(-3.f * Max(hi.z - 0.1f, 0.f)), expf(-3.f * Max(lo.z - 0.1f, 0.f)));
+	Range r = RadiusRange(ScaleRange(params.m_radius, falloff), n);
+	Range ir = RadiusRange(ScaleRange(params.m_innerRadius, falloff), n2);
+
+	Range outer = OutsideEdgeRange(r, len);
+	Range inner = OutsideEdgeRange(ir, len);
+	return Range(Max(0.f, outer.m_min - inner.m_max), Max(0.f, outer.m_max - inner.m_min));
+}
+
+static Range DensityShapeRange(const DensityParams& params, const vec3& lo, const vec3& hi,
+	const Range* fbm)
+{
+	switch(params.m_type)
+	{
+		case DENSITY_SphereNoise: return SphereNoiseRange(params, lo, hi, fbm);
+		case DENSITY_PlaneNoise: return PlaneNoiseRange(params, lo, hi, fbm);
+		case DENSITY_FlameNoise: return FlameNoiseRange(params, lo, hi, fbm);
+		default: ASSERT(false); break;
+	}
+	return Range(0.f, 1.f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int density_TypeFromName(const char* name)
+{
+	if(strcasecmp(name, "spherenoise") == 0)
+		return DENSITY_SphereNoise;
+	else if(strcasecmp(name, "planenoise") == 0)
+		return DENSITY_PlaneNoise;
+	else if(strcasecmp(name, "flamenoise") == 0)
+		return DENSITY_FlameNoise;
+	return -1;
+}
+
+float density_Sample(const DensityParams& params, const vec3& pt)
+{
+	FbmInput inputs[kMaxFbmInputs];
+	float fbm[kMaxFbmInputs];
+	for(int i = 0, c = GetFbmInputs(params, inputs); i < c; ++i)
+	{
+		const FbmInput& in = inputs[i];
+		fbm[i] = FbmNoise((pt + in.m_offset0) + in.m_offset1, in.m_h, in.m_lacunarity, in.m_octaves);
+	}
+	return DensityShape(params, pt, fbm);
+}
+
+int density_ClassifyBrick(const DensityParams& params, int numCells, int bx, int by, int bz)
+{
+	// box around the texel sample points in the brick, see FillRow
+	const float invCells = 1.f / numCells;
+	const int x0 = bx * kBrickSize, x1 = Min(x0 + kBrickSize, numCells) - 1;
+	const int y0 = by * kBrickSize, y1 = Min(y0 + kBrickSize, numCells) - 1;
+	const int z0 = bz * kBrickSize, z1 = Min(z0 + kBrickSize, numCells) - 1;
+	const vec3 lo((x0 + 0.5f) * invCells, (y0 + 0.5f) * invCells, z0 * invCells);
+	const vec3 hi((x1 + 0.5f) * invCells, (y1 + 0.5f) * invCells, z1 * invCells);
+
+	FbmInput inputs[kMaxFbmInputs];
+	Range fbm[kMaxFbmInputs];
+	for(int i = 0, c = GetFbmInputs(params, inputs); i < c; ++i)
+	{
+		const FbmInput& in = inputs[i];
+		FbmNoiseBounds((lo + in.m_offset0) + in.m_offset1, (hi + in.m_offset0) + in.m_offset1,
+			in.m_h, in.m_lacunarity, in.m_octaves, fbm[i].m_min, fbm[i].m_max);
+	}
+
+	Range density = DensityShapeRange(params, lo, hi, fbm);
+	if(density.m_max < kBrickThreshold)
+		return BRICK_Empty;
+	else if(density.m_min > 1.f - kBrickThreshold)
+		return BRICK_Full;
+	return BRICK_Mixed;
+}
+
+void density_ClassifyBricks(const DensityParams& params, int bzBegin, int bzEnd, 
+	DensityBricks& bricks)
+{
+	const int numBricks = bricks.m_numBricks;
+	for(int bz = bzBegin; bz < bzEnd; ++bz)
+	for(int by = 0; by < numBricks; ++by)
+	for(int bx = 0; bx < numBricks; ++bx)
+	{
+		bricks.m_types[bricks.GetIndex(bx, by, bz)] = 
+			density_ClassifyBrick(params, bricks.m_numCells, bx, by, bz);
+	}
+}
+
+void density_FillSlab(const DensityParams& params, int zBegin, int zEnd, DensityVolume& volume)
+{
+	const int numCells = volume.m_numCells;
+	DensityBricks& bricks = volume.m_bricks;
+
+	FbmInput inputs[kMaxFbmInputs];
+	const int numInputs = GetFbmInputs(params, inputs);
+
+	for(int bz = zBegin / kBrickSize; bz * kBrickSize < zEnd; ++bz)
+	{
+		const int z0 = Max(bz * kBrickSize, zBegin);
+		const int z1 = Min((bz + 1) * kBrickSize, zEnd);
+		// a slab that starts partway into a brick leaves storing its type to the other slab
+		const bool ownsBrick = bz * kBrickSize >= zBegin;
+
+		for(int by = 0; by < bricks.m_numBricks; ++by)
+		for(int bx = 0; bx < bricks.m_numBricks; ++bx)
+		{
+			const int type = density_ClassifyBrick(params, numCells, bx, by, bz);
+			if(ownsBrick)
+				bricks.m_types[bricks.GetIndex(bx, by, bz)] = type;
+
+			const int x0 = bx * kBrickSize;
+			const int width = Min(kBrickSize, numCells - x0);
+			const int y0 = by * kBrickSize;
+			const int y1 = Min(y0 + kBrickSize, numCells);
+			for(int z = z0; z < z1; ++z)
+			{
+				for(int y = y0; y < y1; ++y)
+				{
+					unsigned char* out = volume.GetSlice(z) + y * numCells + x0;
+					if(type == BRICK_Mixed)
+						FillRow(params, inputs, numInputs, numCells, x0, width, y, z, out);
+					else
+						memset(out, type == BRICK_Full ? 255 : 0, width);
+				}
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::vector<std::shared_ptr<Task>> density_RunSlabTasks(int numCells,
+	const std::function<void(int, int)>& work, const std::function<void()>& done)
+{
+	// a few more slabs than workers so uneven slabs don't leave threads idle at the end, and 
+	// whole bricks per slab so slabs don't share any
+	constexpr int kMaxSlabs = 16;
+	const int slabDepth = Max(kBrickSize, 
+		(numCells / kMaxSlabs + kBrickSize - 1) / kBrickSize * kBrickSize);
+	const int numSlabs = (numCells + slabDepth - 1) / slabDepth;
+
+	std::vector<std::shared_ptr<Task>> tasks;
+	tasks.reserve(numSlabs);
+	for(int z = 0; z < numCells; z += slabDepth)
+	{
+		const int zEnd = Min(z + slabDepth, numCells);
+		tasks.push_back(std::make_shared<Task>([work, z, zEnd]() {
+			work(z, zEnd);
+		}));
+		task_AppendTask(tasks.back());
+	}
+	task_AppendContinuation(tasks, nullptr, done);
+	return tasks;
+}
+
+std::vector<std::shared_ptr<Task>> density_Generate(const DensityParams& params,
+	const std::shared_ptr<DensityVolume>& volume, std::function<void()> onComplete)
+{
+	return density_RunSlabTasks(volume->m_numCells, 
+		[params, volume](int zBegin, int zEnd) {
+			density_FillSlab(params, zBegin, zEnd, *volume);
+		},
+		[volume, onComplete]() {
+			if(onComplete)
+				onComplete();
+		});
+}
+
+void density_ClassifyAsync(const DensityParams& params, int numCells,
+	std::function<void(const std::shared_ptr<DensityBricks>&)> onComplete)
+{
+	auto bricks = std::make_shared<DensityBricks>(numCells);
+	density_RunSlabTasks(numCells, 
+		[params, bricks](int zBegin, int zEnd) {
+			density_ClassifyBricks(params, zBegin / kBrickSize, 
+				(zEnd + kBrickSize - 1) / kBrickSize, *bricks);
+		},
+		[bricks, onComplete]() {
+			if(onComplete)
+				onComplete(bricks);
+		});
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+
+class vec3;
+class Task;
+
+// CPU versions of the density functions in shaders/gen/*.glsl.
+enum DensityFuncType {
+	DENSITY_SphereNoise,
+	DENSITY_PlaneNoise,
+	DENSITY_FlameNoise,
+	DENSITY_NUM,
+};
+
+// the same values the gen shaders get as uniforms
+class DensityParams
+{
+public:
+	DensityParams()
+		: m_type(-1), m_time(0.f), m_radius(0.5f), m_innerRadius(0.3f), m_width(0.2f) {}
+	int m_type;
+	float m_time;
+	float m_radius;
+	float m_innerRadius;
+	float m_width;
+};
+
+// Volumes are split into kBrickSize^3 bricks which are classified from bounds on the density
+// before generating, so the noise only has to be evaluated where the surface is.
+constexpr int kBrickSize = 8;
+enum BrickType {
+	BRICK_Empty, // every texel is 0
+	BRICK_Full, // every texel is 255
+	BRICK_Mixed,
+};
+
+class DensityBricks
+{
+public:
+	DensityBricks(int numCells)
+		: m_numCells(numCells)
+		, m_numBricks((numCells + kBrickSize - 1) / kBrickSize)
+		, m_types(m_numBricks * m_numBricks * m_numBricks, BRICK_Mixed) {}
+	int GetIndex(int bx, int by, int bz) const { return (bz * m_numBricks + by) * m_numBricks + bx; }
+	int GetType(int bx, int by, int bz) const { return m_types[GetIndex(bx, by, bz)]; }
+
+	int m_numCells;
+	int m_numBricks; // per axis
+	std::vector<unsigned char> m_types; // BrickType, x varies fastest like the texels
+};
+
+// numCells^3 R8 texels, x varies fastest, then y, then z. Same layout as the 3D texture.
+class DensityVolume
+{
+public:
+	DensityVolume(int numCells)
+		: m_numCells(numCells), m_data(numCells * numCells * numCells), m_bricks(numCells) {}
+	unsigned char* GetSlice(int z) { return &m_data[z * m_numCells * m_numCells]; }
+	const unsigned char* GetSlice(int z) const { return &m_data[z * m_numCells * m_numCells]; }
+
+	int m_numCells;
+	std::vector<unsigned char> m_data;
+	DensityBricks m_bricks;
+};
+
+// returns -1 if the name isn't one of the gen shaders
+int density_TypeFromName(const char* name);
+float density_Sample(const DensityParams& params, const vec3& pt);
+// Conservative classification of a brick, BRICK_Mixed unless every texel is known to round to
+// 0 or 255.
+int density_ClassifyBrick(const DensityParams& params, int numCells, int bx, int by, int bz);
+// classifies brick layers [bzBegin, bzEnd)
+void density_ClassifyBricks(const DensityParams& params, int bzBegin, int bzEnd, 
+	DensityBricks& bricks);
+// Fills slices [zBegin, zEnd) of the volume, only evaluating the mixed bricks. Also fills in
+// the types of the bricks that start in the range.
+void density_FillSlab(const DensityParams& params, int zBegin, int zEnd, DensityVolume& volume);
+
+// Runs work(zBegin, zEnd) over slabs of whole bricks on the worker threads, then calls done on
+// the main thread once all of them have finished. Returns the slab tasks, for tasks that need
+// what they make to wait for.
+std::vector<std::shared_ptr<Task>> density_RunSlabTasks(int numCells,
+	const std::function<void(int, int)>& work, const std::function<void()>& done);
+// Splits volume into slabs and generates them on the worker threads. onComplete is called from
+// task_Update on the main thread once every slab is done. Returns the slab tasks.
+std::vector<std::shared_ptr<Task>> density_Generate(const DensityParams& params,
+	const std::shared_ptr<DensityVolume>& volume, std::function<void()> onComplete);
+// Same as above but only classifies the bricks, for when the GPU generates the density.
+void density_ClassifyAsync(const DensityParams& params, int numCells,
+	std::function<void(const std::shared_ptr<DensityBricks>&)> onComplete);
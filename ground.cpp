@@ -0,0 +1,69 @@
+#include "ground.hh"
+#include "render.hh"
+#include "camera.hh"
+#include "matrix.hh"
+#include "hyper.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+static std::shared_ptr<Geom> g_groundGeom;
+static std::shared_ptr<ShaderInfo> g_groundShader;
+
+enum GroundUniformLocType {
+	GRNDBIND_ShadowMatrix,
+	GRNDBIND_ShadowMap,
+};
+
+static std::vector<CustomShaderAttr> g_groundUniforms =
+{
+	{ GRNDBIND_ShadowMatrix, "matShadow" },
+	{ GRNDBIND_ShadowMap, "shadowMap" },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+void ground_Init()
+{
+	if(!g_groundGeom)
+		g_groundGeom = render_GeneratePlaneGeom();
+	if(!g_groundShader)
+		g_groundShader = render_CompileShader("shaders/ground.glsl", g_groundUniforms);
+}
+
+void ground_Draw(const Camera& camera, const vec3& sundir, const Color& sunColor,
+	const GpuHypertexture* shadowCaster)
+{
+	mat4 projview = camera.GetProj() * camera.GetView();
+	mat4 model = MakeTranslation(0,0,-100) * MakeScale(vec3(500));
+	mat4 modelIT = TransposeOfInverse(model);
+	mat4 mvp = projview * model;
+
+	const ShaderInfo* shader = g_groundShader.get();
+	GLint mvpLoc = shader->m_uniforms[BIND_Mvp];
+	GLint modelLoc = shader->m_uniforms[BIND_Model];
+	GLint modelITLoc = shader->m_uniforms[BIND_ModelIT];
+	GLint sundirLoc = shader->m_uniforms[BIND_Sundir];
+	GLint sunColorLoc = shader->m_uniforms[BIND_SunColor];
+	GLint eyePosLoc = shader->m_uniforms[BIND_Eyepos];
+	GLint matShadowLoc = shader->m_custom[GRNDBIND_ShadowMatrix];
+	GLint shadowMapLoc = shader->m_custom[GRNDBIND_ShadowMap];
+
+	glUseProgram(shader->m_program);
+	
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, shadowCaster ? shadowCaster->GetShadowTexture() : 0);
+	glUniform1i(shadowMapLoc, 0);
+	
+	mat4 htexShadowMat = shadowCaster ? shadowCaster->GetShadowMatrix() : (mat4::identity_t());
+	mat4 matShadow = 
+		MakeCoordinateScale(0.5f, 0.5f) *
+		htexShadowMat * model;
+
+	glUniformMatrix4fv(matShadowLoc, 1, 0, matShadow.m);
+	glUniformMatrix4fv(mvpLoc, 1, 0, mvp.m);
+	glUniformMatrix4fv(modelLoc, 1, 0, model.m);
+	glUniformMatrix4fv(modelITLoc, 1, 0, modelIT.m);
+	glUniform3fv(sundirLoc, 1, &sundir.x);
+	glUniform3fv(sunColorLoc, 1, &sunColor.r);
+	glUniform3fv(eyePosLoc, 1, &camera.GetPos().x);
+
+	g_groundGeom->Render(*shader);
+}
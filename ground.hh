@@ -0,0 +1,12 @@
+#pragma once
+
+class Camera;
+class Color;
+class vec3;
+class GpuHypertexture;
+
+// The ground plane under the volumes, with the projection shadow of one of them
+void ground_Init();
+// shadowCaster can be null for no shadow
+void ground_Draw(const Camera& camera, const vec3& sundir, const Color& sunColor,
+	const GpuHypertexture* shadowCaster);
@@ -38,6 +38,22 @@ inline unsigned int MakeHash(const std::string& str)
 	return MakeHash(str.c_str());
 }
 
+// 64 bit FNV-1a, for when collisions matter. Pass the previous result as the seed to hash
+// several pieces as one.
+constexpr unsigned long long kHash64Seed = 0xcbf29ce484222325ull;
+inline unsigned long long MakeHash64(const void* data, size_t len, 
+	unsigned long long seed = kHash64Seed)
+{
+	unsigned long long result = seed;
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	while(len--)
+	{
+		result ^= *p++;
+		result *= 0x100000001b3ull;
+	}
+	return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////	
 // Resizing hash map
 template< class K, class V>
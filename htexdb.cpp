@@ -1,8 +1,11 @@
 #include "htexdb.hh"
 #include "render.hh"
 #include "hyper.hh"
+#include "density.hh"
 #include "tokparser.hh"
 #include "menu.hh"
+#include "camera.hh"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
@@ -13,30 +16,27 @@ static std::shared_ptr<ShaderInfo> g_sphereNoiseShader;
 static std::shared_ptr<ShaderInfo> g_planeNoiseShader;
 static std::shared_ptr<ShaderInfo> g_flameNoiseShader;
 
-enum AnimatedHtexBindType {
-	HTEXBIND_Time,
-	HTEXBIND_Radius,
-	HTEXBIND_InnerRadius,
-	HTEXBIND_Width,
-};
-
-static std::vector<CustomShaderAttr> g_animatedHtexUniforms =
-{
-	{ HTEXBIND_Time, "time" },
-	{ HTEXBIND_Radius, "radius", true },
-	{ HTEXBIND_InnerRadius, "innerRadius", true },
-	{ HTEXBIND_Width, "width", true },
-};
+static bool g_cpuGenEnabled;
 
 ////////////////////////////////////////////////////////////////////////////////
 void htexdb_Init()
 {
 	if(!g_sphereNoiseShader)
-		g_sphereNoiseShader = render_CompileShader("shaders/gen/spherenoise.glsl", g_animatedHtexUniforms);
+		g_sphereNoiseShader = render_CompileShader("shaders/gen/spherenoise.glsl", hyper_GetGenUniforms());
 	if(!g_planeNoiseShader)
-		g_planeNoiseShader = render_CompileShader("shaders/gen/planenoise.glsl", g_animatedHtexUniforms);
+		g_planeNoiseShader = render_CompileShader("shaders/gen/planenoise.glsl", hyper_GetGenUniforms());
 	if(!g_flameNoiseShader)
-		g_flameNoiseShader = render_CompileShader("shaders/gen/flamenoise.glsl", g_animatedHtexUniforms);
+		g_flameNoiseShader = render_CompileShader("shaders/gen/flamenoise.glsl", hyper_GetGenUniforms());
+}
+
+void htexdb_SetCpuGenEnabled(bool enabled)
+{
+	g_cpuGenEnabled = enabled;
+}
+
+bool htexdb_IsCpuGenEnabled()
+{
+	return g_cpuGenEnabled;
 }
 
 static std::shared_ptr<ShaderInfo> GetShaderFromName(const char* name)
@@ -55,11 +55,14 @@ static std::shared_ptr<ShaderInfo> GetShaderFromName(const char* name)
 ////////////////////////////////////////////////////////////////////////////////
 AnimatedHypertexture::AnimatedHypertexture()
 	: m_numCells(64)
+	, m_position(0.f)
 	, m_scale(100.0f)
+	, m_densityType(-1)
 	, m_absorption(0.7)
 	, m_g(-0.1)
 	, m_time(0.f)
 	, m_lastUpdateTime(0.f)
+	, m_updateRequested(false)
 	, m_color(1,1,1)
 	, m_densityMult(10)
 	, m_scatterColor(1,1,1)
@@ -72,7 +75,8 @@ AnimatedHypertexture::AnimatedHypertexture()
 
 void AnimatedHypertexture::Create()
 {
-	m_gpuhtex = std::make_shared<GpuHypertexture>(m_numCells, m_shader, vec3(m_scale), m_params);
+	m_gpuhtex = std::make_shared<GpuHypertexture>(m_numCells, m_shader, m_position, vec3(m_scale), 
+		m_params);
 }
 
 void AnimatedHypertexture::Destroy()
@@ -100,10 +104,37 @@ void AnimatedHypertexture::UpdateVariables()
 	m_gpuhtex->SetAbsorptionColor(m_absorbColor);
 }
 
+void AnimatedHypertexture::UpdateModel()
+{
+	if(!m_gpuhtex) return;
+	m_gpuhtex->SetModel(m_position, vec3(m_scale));
+	RequestUpdate();
+}
+
 void AnimatedHypertexture::Update(const vec3& sundir)
 {
+	m_updateRequested = false;
 	UpdateVariables();
-	m_gpuhtex->Update(sundir);
+	DensityParams params;
+	params.m_type = m_densityType;
+	params.m_time = m_time;
+	params.m_radius = m_radius;
+	params.m_innerRadius = m_innerRadius;
+	params.m_width = m_width;
+	// CPU lighting needs the density on the CPU as well
+	if((g_cpuGenEnabled || hyper_IsCpuLightingEnabled()) && m_densityType >= 0)
+		m_gpuhtex->UpdateCpu(sundir, params);
+	else
+		m_gpuhtex->Update(sundir, params);
+}
+
+bool AnimatedHypertexture::IsVisible(const Camera& camera) const
+{
+	if(m_gpuhtex)
+		return m_gpuhtex->IsVisible(camera);
+	// the box GpuHypertexture will have when it's created
+	return camera.IsBoxVisible(MakeTranslation(m_position) * MakeScale(vec3(m_scale)),
+		vec3(-1.f), vec3(1.f));
 }
 
 std::shared_ptr<SubmenuMenuItem> AnimatedHypertexture::CreateMenu()
@@ -117,7 +148,12 @@ std::shared_ptr<SubmenuMenuItem> AnimatedHypertexture::CreateMenu()
 					m_time = 0.f; 
 					m_lastUpdateTime = 0.f; 
 				}),
-			std::make_shared<FloatSliderMenuItem>("scale", &m_scale),
+			std::make_shared<VecSliderMenuItem>("position",
+				[this]() { return m_position; },
+				[this](const vec3& p) { m_position = p; UpdateModel(); }, 10.f),
+			std::make_shared<FloatSliderMenuItem>("scale",
+				[this]() { return m_scale; },
+				[this](float v) { m_scale = v; UpdateModel(); }),
 			std::make_shared<FloatSliderMenuItem>("time slider", &m_time),
 			std::make_shared<FloatSliderMenuItem>("absorption", 
 				[this]() { return m_absorption; },
@@ -157,6 +193,32 @@ std::shared_ptr<SubmenuMenuItem> AnimatedHypertexture::CreateMenu()
 	return menu;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+std::vector<std::shared_ptr<AnimatedHypertexture>> htexdb_GetVisible(
+	const std::vector<std::shared_ptr<AnimatedHypertexture>>& list, const Camera& camera)
+{
+	std::vector<std::pair<float, std::shared_ptr<AnimatedHypertexture>>> sorted;
+	for(const auto& htex : list)
+	{
+		if(!htex->IsVisible(camera))
+			continue;
+		// the camera looks down -z, so the most negative is the farthest
+		const float depth = TransformPoint(camera.GetView(), htex->m_position).z;
+		sorted.emplace_back(depth, htex);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), 
+		[](const std::pair<float, std::shared_ptr<AnimatedHypertexture>>& l,
+			const std::pair<float, std::shared_ptr<AnimatedHypertexture>>& r) {
+			return l.first < r.first;
+		});
+
+	std::vector<std::shared_ptr<AnimatedHypertexture>> result;
+	result.reserve(sorted.size());
+	for(auto& entry : sorted)
+		result.push_back(std::move(entry.second));
+	return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 std::vector<std::shared_ptr<AnimatedHypertexture>> ParseHtexFile(const char* filename)
 {
@@ -207,6 +269,7 @@ std::vector<std::shared_ptr<AnimatedHypertexture>> ParseHtexFile(const char* fil
 				parser.GetString(str, sizeof(str));
 				htex->m_shader = GetShaderFromName(str);
 				htex->m_shaderName = str;
+				htex->m_densityType = density_TypeFromName(str);
 				if(htex->m_shader)
 				{
 					htex->m_params = std::make_shared<ShaderParams>(htex->m_shader);
@@ -217,6 +280,11 @@ std::vector<std::shared_ptr<AnimatedHypertexture>> ParseHtexFile(const char* fil
 				}
 			} else if(strcasecmp(bufName, "dim") == 0) {
 				htex->m_numCells = parser.GetInt();
+			} else if(strcasecmp(bufName, "position") == 0) {
+				float x = parser.GetFloat();
+				float y = parser.GetFloat();
+				float z = parser.GetFloat();
+				htex->m_position = vec3(x,y,z);
 			} else if(strcasecmp(bufName, "scale") == 0) {
 				htex->m_scale = parser.GetFloat();
 			} else if(strcasecmp(bufName, "time") == 0) {
@@ -286,6 +354,8 @@ void SaveHtexFile(const char* filename, const std::vector<std::shared_ptr<Animat
 		w.String("name"); w.Token("="); w.String(animHtex->m_name.c_str()); w.Nl();
 		w.String("shader"); w.Token("="); w.String(animHtex->m_shaderName.c_str()); w.Nl();
 		w.String("dim"); w.Token("="); w.Int(animHtex->m_numCells); w.Nl();
+		w.String("position"); w.Token("="); w.Float(animHtex->m_position.x); 
+			w.Float(animHtex->m_position.y); w.Float(animHtex->m_position.z); w.Nl();
 		w.String("scale"); w.Token("="); w.Float(animHtex->m_scale); w.Nl();
 		w.String("time"); w.Token("="); w.Float(animHtex->m_time); w.Nl();
 		w.String("absorption"); w.Token("="); w.Float(animHtex->m_absorption); w.Nl();
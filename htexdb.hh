@@ -11,6 +11,7 @@ class GpuHypertexture;
 class ShaderInfo;
 class ShaderParams;
 class SubmenuMenuItem;
+class Camera;
 
 // just a collection of stuff needed to control and render a GpuHypertexture
 class AnimatedHypertexture
@@ -29,7 +30,14 @@ public:
 	bool Valid() const;
 
 	void UpdateVariables();
+	// moves the GpuHypertexture to m_position and m_scale, and updates it for there
+	void UpdateModel();
 	void Update(const vec3& sundir);
+	// Update the next time the volume is visible
+	void RequestUpdate() { m_updateRequested = true; }
+
+	// true if any of the volume's box is in the camera's frustum, whether it's created or not
+	bool IsVisible(const Camera& camera) const;
 
 	////////////////////////////////////////////////////////////////////////////////	
 	std::shared_ptr<GpuHypertexture> m_gpuhtex;
@@ -38,13 +46,16 @@ public:
 
 	// Creation parameters
 	int m_numCells;
+	vec3 m_position;
 	float m_scale;
 	std::string m_name;
 	std::string m_shaderName;
+	int m_densityType; // DensityFuncType, used when generating on the CPU
 	float m_absorption;
 	float m_g;
 	float m_time;
 	float m_lastUpdateTime;
+	bool m_updateRequested;
 	Color m_color;
 	float m_densityMult;
 	Color m_scatterColor;
@@ -60,6 +71,12 @@ public:
 };
 
 void htexdb_Init();
+// generate density volumes on the worker threads instead of with the gen shaders
+void htexdb_SetCpuGenEnabled(bool enabled);
+bool htexdb_IsCpuGenEnabled();
+// The volumes in list that the camera can see, sorted back to front for blending
+std::vector<std::shared_ptr<AnimatedHypertexture>> htexdb_GetVisible(
+	const std::vector<std::shared_ptr<AnimatedHypertexture>>& list, const Camera& camera);
 // hurray C++11!
 std::vector<std::shared_ptr<AnimatedHypertexture>> ParseHtexFile(const char* filename);
 void SaveHtexFile(const char* filename, const std::vector<std::shared_ptr<AnimatedHypertexture>>& descriptions);
@@ -0,0 +1,510 @@
+#include "htvfile.hh"
+#include "density.hh"
+#include "commonmath.hh"
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+static constexpr unsigned int kHtvMagic = 'H' | ('T' << 8) | ('V' << 16) | ('1' << 24);
+static constexpr unsigned int kHtvVersion = 1;
+static constexpr unsigned long long kHtvAlignment = 4096;
+
+static unsigned long long AlignOffset(unsigned long long offset)
+{
+	return (offset + kHtvAlignment - 1) & ~(kHtvAlignment - 1);
+}
+
+static bool InFile(unsigned long long offset, unsigned long long size, size_t fileSize)
+{
+	return offset <= fileSize && size <= fileSize - offset;
+}
+
+static const unsigned int kBytesPerTexel[] = { 1, 3, 1 };
+static_assert(sizeof(kBytesPerTexel) / sizeof(kBytesPerTexel[0]) == HTV_NUM, 
+	"missing section texel size");
+
+static size_t NumSectionTexels(int section, int numCells, int shadowDim)
+{
+	if(section == HTV_Shadow)
+		return size_t(shadowDim) * shadowDim;
+	return size_t(numCells) * numCells * numCells;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Brick compression. The texels of a brick are delta coded against the previous texel, which
+// turns the smooth gradients into runs of small values, and then packed with a small LZ77 in
+// the spirit of LZ4. Each sequence is a token with the literal count in the high 4 bits and
+// the match length - kMinMatch in the low 4, either extended by bytes while they're 255, the 
+// literals, a 2 byte little endian offset back to the match, and the match length extension.
+// The last sequence is only literals.
+static constexpr int kMinMatch = 4;
+static constexpr int kMaxBrickBytes = kBrickSize * kBrickSize * kBrickSize * 3;
+static constexpr int kMatchHashBits = 10;
+
+static void WriteLength(std::vector<unsigned char>& out, size_t len)
+{
+	for(; len >= 255; len -= 255)
+		out.push_back(255);
+	out.push_back(len);
+}
+
+static void CompressBlock(const unsigned char* src, size_t size, std::vector<unsigned char>& out)
+{
+	int table[1 << kMatchHashBits];
+	std::fill(table, table + (1 << kMatchHashBits), -1);
+	auto hash = [src](size_t pos) {
+		unsigned int v = src[pos] | (src[pos + 1] << 8) | (src[pos + 2] << 16) | 
+			(src[pos + 3] << 24);
+		return (v * 2654435761u) >> (32 - kMatchHashBits);
+	};
+
+	size_t literalStart = 0, pos = 0;
+	while(pos + kMinMatch <= size)
+	{
+		const unsigned int h = hash(pos);
+		const int candidate = table[h];
+		table[h] = pos;
+		if(candidate < 0 || pos - candidate > 0xffff ||
+			!std::equal(src + candidate, src + candidate + kMinMatch, src + pos))
+		{
+			++pos;
+			continue;
+		}
+
+		size_t matchLen = kMinMatch;
+		while(pos + matchLen < size && src[candidate + matchLen] == src[pos + matchLen])
+			++matchLen;
+
+		const size_t numLiterals = pos - literalStart;
+		const size_t extraMatch = matchLen - kMinMatch;
+		out.push_back((Min<size_t>(numLiterals, 15) << 4) | Min<size_t>(extraMatch, 15));
+		if(numLiterals >= 15) WriteLength(out, numLiterals - 15);
+		out.insert(out.end(), src + literalStart, src + pos);
+		const size_t offset = pos - candidate;
+		out.push_back(offset & 0xff);
+		out.push_back(offset >> 8);
+		if(extraMatch >= 15) WriteLength(out, extraMatch - 15);
+
+		pos += matchLen;
+		literalStart = pos;
+	}
+
+	const size_t numLiterals = size - literalStart;
+	out.push_back(Min<size_t>(numLiterals, 15) << 4);
+	if(numLiterals >= 15) WriteLength(out, numLiterals - 15);
+	out.insert(out.end(), src + literalStart, src + size);
+}
+
+static bool ReadLength(const unsigned char*& src, const unsigned char* srcEnd, size_t& len)
+{
+	unsigned char b;
+	do
+	{
+		if(src == srcEnd) return false;
+		b = *src++;
+		len += b;
+	} while(b == 255);
+	return true;
+}
+
+static bool DecompressBlock(const unsigned char* src, size_t srcSize, 
+	unsigned char* dst, size_t dstSize)
+{
+	const unsigned char* srcEnd = src + srcSize;
+	unsigned char* const dstBegin = dst;
+	unsigned char* const dstEnd = dst + dstSize;
+	while(src < srcEnd)
+	{
+		const unsigned char token = *src++;
+		size_t numLiterals = token >> 4;
+		if(numLiterals == 15 && !ReadLength(src, srcEnd, numLiterals))
+			return false;
+		if(numLiterals > size_t(srcEnd - src) || numLiterals > size_t(dstEnd - dst))
+			return false;
+		dst = std::copy(src, src + numLiterals, dst);
+		src += numLiterals;
+		if(src == srcEnd)
+			break;
+
+		if(srcEnd - src < 2) return false;
+		const size_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		size_t matchLen = token & 15;
+		if(matchLen == 15 && !ReadLength(src, srcEnd, matchLen))
+			return false;
+		matchLen += kMinMatch;
+		if(offset == 0 || offset > size_t(dst - dstBegin) || matchLen > size_t(dstEnd - dst))
+			return false;
+		// the match can overlap what it's writing
+		for(const unsigned char* match = dst - offset; matchLen--; )
+			*dst++ = *match++;
+	}
+	return dst == dstEnd;
+}
+
+// Size of the brick at (bx, by, bz), bricks on the far edges can be cut off by the volume.
+static void GetBrickExtent(int numCells, int bx, int by, int bz, int* begin, int* end)
+{
+	const int b[] = { bx, by, bz };
+	for(int i = 0; i < 3; ++i)
+	{
+		begin[i] = b[i] * kBrickSize;
+		end[i] = Min(begin[i] + kBrickSize, numCells);
+	}
+}
+
+// Copies a brick out of the texels laid out like the texture, delta coded.
+static size_t GatherBrick(const unsigned char* texels, int numCells, int bytesPerTexel, 
+	int bx, int by, int bz, unsigned char* brick)
+{
+	int begin[3], end[3];
+	GetBrickExtent(numCells, bx, by, bz, begin, end);
+	const int rowBytes = (end[0] - begin[0]) * bytesPerTexel;
+	unsigned char* out = brick;
+	for(int z = begin[2]; z < end[2]; ++z)
+	for(int y = begin[1]; y < end[1]; ++y)
+	{
+		const unsigned char* row = texels + 
+			((size_t(z) * numCells + y) * numCells + begin[0]) * bytesPerTexel;
+		out = std::copy(row, row + rowBytes, out);
+	}
+	const size_t size = out - brick;
+	for(size_t i = size - 1; i >= size_t(bytesPerTexel); --i)
+		brick[i] -= brick[i - bytesPerTexel];
+	return size;
+}
+
+// The reverse of GatherBrick, undoes the delta coding in place.
+static void ScatterBrick(unsigned char* brick, int numCells, int bytesPerTexel,
+	int bx, int by, int bz, unsigned char* texels)
+{
+	int begin[3], end[3];
+	GetBrickExtent(numCells, bx, by, bz, begin, end);
+	const int rowBytes = (end[0] - begin[0]) * bytesPerTexel;
+	const size_t size = size_t(rowBytes) * (end[1] - begin[1]) * (end[2] - begin[2]);
+	for(size_t i = bytesPerTexel; i < size; ++i)
+		brick[i] += brick[i - bytesPerTexel];
+
+	const unsigned char* in = brick;
+	for(int z = begin[2]; z < end[2]; ++z)
+	for(int y = begin[1]; y < end[1]; ++y, in += rowBytes)
+	{
+		unsigned char* row = texels + 
+			((size_t(z) * numCells + y) * numCells + begin[0]) * bytesPerTexel;
+		std::copy(in, in + rowBytes, row);
+	}
+}
+
+static void FillBrick(int numCells, int bytesPerTexel, int bx, int by, int bz, 
+	unsigned char value, unsigned char* texels)
+{
+	int begin[3], end[3];
+	GetBrickExtent(numCells, bx, by, bz, begin, end);
+	const int rowBytes = (end[0] - begin[0]) * bytesPerTexel;
+	for(int z = begin[2]; z < end[2]; ++z)
+	for(int y = begin[1]; y < end[1]; ++y)
+	{
+		unsigned char* row = texels + 
+			((size_t(z) * numCells + y) * numCells + begin[0]) * bytesPerTexel;
+		std::fill(row, row + rowBytes, value);
+	}
+}
+
+// Transmittance is only looked at where the density isn't 0, and linear filtering reaches a
+// texel into the neighbours, so it's needed in bricks next to any non-empty one.
+static bool IsTransNeeded(const DensityBricks& bricks, int bx, int by, int bz)
+{
+	const int last = bricks.m_numBricks - 1;
+	for(int z = Max(0, bz - 1); z <= Min(last, bz + 1); ++z)
+	for(int y = Max(0, by - 1); y <= Min(last, by + 1); ++y)
+	for(int x = Max(0, bx - 1); x <= Min(last, bx + 1); ++x)
+		if(bricks.GetType(x, y, z) != BRICK_Empty)
+			return true;
+	return false;
+}
+
+static void EncodeBricks(const unsigned char* texels, int section, const DensityBricks& bricks,
+	std::vector<unsigned char>& out)
+{
+	const int numBricks = bricks.m_types.size();
+	const int bytesPerTexel = kBytesPerTexel[section];
+	out.assign(numBricks * sizeof(HtvBrick), 0);
+	unsigned char brick[kMaxBrickBytes];
+	for(int bz = 0, index = 0; bz < bricks.m_numBricks; ++bz)
+	for(int by = 0; by < bricks.m_numBricks; ++by)
+	for(int bx = 0; bx < bricks.m_numBricks; ++bx, ++index)
+	{
+		const bool skip = section == HTV_Density ? 
+			bricks.m_types[index] != BRICK_Mixed : 
+			!IsTransNeeded(bricks, bx, by, bz);
+		HtvBrick entry = { unsigned(out.size()), 0 };
+		if(!skip)
+		{
+			const size_t size = GatherBrick(texels, bricks.m_numCells, bytesPerTexel, 
+				bx, by, bz, brick);
+			CompressBlock(brick, size, out);
+			entry.m_size = out.size() - entry.m_offset;
+		}
+		std::copy(reinterpret_cast<const unsigned char*>(&entry), 
+			reinterpret_cast<const unsigned char*>(&entry + 1), 
+			&out[index * sizeof(HtvBrick)]);
+	}
+}
+
+// Checks the brick table of a bricked section stays inside it
+static bool ValidBricks(const unsigned char* data, size_t size, int numBricks)
+{
+	const size_t tableSize = size_t(numBricks) * numBricks * numBricks * sizeof(HtvBrick);
+	if(size < tableSize)
+		return false;
+	const HtvBrick* entries = reinterpret_cast<const HtvBrick*>(data);
+	for(size_t i = 0, c = tableSize / sizeof(HtvBrick); i < c; ++i)
+		if(!InFile(entries[i].m_offset, entries[i].m_size, size))
+			return false;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+HtvFile::HtvFile(const unsigned char* data, size_t size)
+	: m_data(data)
+	, m_size(size)
+	, m_header(reinterpret_cast<const HtvHeader*>(data))
+{
+}
+
+HtvFile::~HtvFile()
+{
+	munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+std::shared_ptr<HtvFile> HtvFile::Open(const char* filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return nullptr;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(HtvHeader))
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	const size_t size = st.st_size;
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if(data == MAP_FAILED)
+	{
+		std::cerr << "Failed to map " << filename << std::endl;
+		return nullptr;
+	}
+
+	std::shared_ptr<HtvFile> file(new HtvFile(static_cast<const unsigned char*>(data), size));
+	const HtvHeader& header = *file->m_header;
+	const size_t numBricks = size_t(header.m_numBricks) * header.m_numBricks * header.m_numBricks;
+
+	bool valid = header.m_magic == kHtvMagic &&
+		header.m_version == kHtvVersion &&
+		header.m_numCells > 0 &&
+		header.m_brickSize == kBrickSize &&
+		header.m_numBricks == (header.m_numCells + kBrickSize - 1) / kBrickSize &&
+		InFile(header.m_keyOffset, header.m_keySize, size) &&
+		InFile(header.m_brickTableOffset, numBricks, size);
+	for(int i = 0; valid && i < HTV_NUM; ++i)
+	{
+		const HtvSection& section = header.m_sections[i];
+		valid = section.m_bytesPerTexel == kBytesPerTexel[i] &&
+			InFile(section.m_offset, section.m_size, size);
+		if(valid && section.m_encoding == HTVENC_Raw)
+			valid = section.m_size == file->GetTexelSize(i);
+		else if(valid && section.m_encoding == HTVENC_Bricks && i != HTV_Shadow)
+			valid = ValidBricks(file->GetSection(i), section.m_size, header.m_numBricks);
+		else
+			valid = false;
+	}
+	if(!valid)
+	{
+		std::cerr << filename << " isn't a valid .htv file" << std::endl;
+		return nullptr;
+	}
+	return file;
+}
+
+size_t HtvFile::GetTexelSize(int section) const
+{
+	return NumSectionTexels(section, m_header->m_numCells, m_header->m_shadowDim) * 
+		kBytesPerTexel[section];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void ClassifyBricks(const unsigned char* density, DensityBricks& bricks)
+{
+	const int numCells = bricks.m_numCells;
+	for(int bz = 0; bz < bricks.m_numBricks; ++bz)
+	for(int by = 0; by < bricks.m_numBricks; ++by)
+	for(int bx = 0; bx < bricks.m_numBricks; ++bx)
+	{
+		int minDensity = 255, maxDensity = 0;
+		const int x1 = Min((bx + 1) * kBrickSize, numCells);
+		const int y1 = Min((by + 1) * kBrickSize, numCells);
+		const int z1 = Min((bz + 1) * kBrickSize, numCells);
+		for(int z = bz * kBrickSize; z < z1; ++z)
+		for(int y = by * kBrickSize; y < y1; ++y)
+		{
+			const unsigned char* row = density + (size_t(z) * numCells + y) * numCells;
+			for(int x = bx * kBrickSize; x < x1; ++x)
+			{
+				minDensity = Min(minDensity, int(row[x]));
+				maxDensity = Max(maxDensity, int(row[x]));
+			}
+		}
+
+		int type = BRICK_Mixed;
+		if(maxDensity == 0) type = BRICK_Empty;
+		else if(minDensity == 255) type = BRICK_Full;
+		bricks.m_types[bricks.GetIndex(bx, by, bz)] = type;
+	}
+}
+
+static bool WriteAt(FILE* fp, unsigned long long offset, const void* data, size_t size)
+{
+	// pad up to the offset
+	static const char kZeros[256] = {};
+	long pos = ftell(fp);
+	while(pos >= 0 && (unsigned long long)pos < offset)
+	{
+		const size_t pad = Min<unsigned long long>(sizeof(kZeros), offset - pos);
+		if(fwrite(kZeros, 1, pad, fp) != pad)
+			return false;
+		pos += pad;
+	}
+	return fwrite(data, 1, size, fp) == size;
+}
+
+bool htv_Write(const char* filename, const HtvContents& contents)
+{
+	const int numCells = contents.m_numCells;
+	DensityBricks bricks(numCells);
+	ClassifyBricks(contents.m_texels[HTV_Density], bricks);
+
+	std::vector<unsigned char> encoded[HTV_NUM];
+	unsigned int encodings[HTV_NUM];
+	const unsigned char* sectionData[HTV_NUM];
+	size_t sectionSizes[HTV_NUM];
+	for(int i = 0; i < HTV_NUM; ++i)
+	{
+		encodings[i] = contents.m_compress && i != HTV_Shadow ? HTVENC_Bricks : HTVENC_Raw;
+		if(encodings[i] == HTVENC_Bricks)
+		{
+			EncodeBricks(contents.m_texels[i], i, bricks, encoded[i]);
+			sectionData[i] = &encoded[i][0];
+			sectionSizes[i] = encoded[i].size();
+		}
+		else
+		{
+			sectionData[i] = contents.m_texels[i];
+			sectionSizes[i] = NumSectionTexels(i, numCells, contents.m_shadowDim) * 
+				kBytesPerTexel[i];
+		}
+	}
+
+	HtvHeader header = {};
+	header.m_magic = kHtvMagic;
+	header.m_version = kHtvVersion;
+	header.m_keyHash = contents.m_keyHash;
+	header.m_keyOffset = sizeof(HtvHeader);
+	header.m_keySize = contents.m_keySize;
+	header.m_numCells = numCells;
+	header.m_brickSize = kBrickSize;
+	header.m_numBricks = bricks.m_numBricks;
+	header.m_shadowDim = contents.m_shadowDim;
+	header.m_brickTableOffset = header.m_keyOffset + header.m_keySize;
+	std::copy(contents.m_matShadow, contents.m_matShadow + 16, header.m_matShadow);
+
+	unsigned long long offset = header.m_brickTableOffset + bricks.m_types.size();
+	for(int i = 0; i < HTV_NUM; ++i)
+	{
+		HtvSection& section = header.m_sections[i];
+		section.m_encoding = encodings[i];
+		section.m_bytesPerTexel = kBytesPerTexel[i];
+		section.m_offset = AlignOffset(offset);
+		section.m_size = sectionSizes[i];
+		offset = section.m_offset + section.m_size;
+	}
+
+	const std::string tempFilename = std::string(filename) + ".tmp";
+	FILE* fp = fopen(tempFilename.c_str(), "wb");
+	if(!fp)
+	{
+		std::cerr << "Failed to open " << tempFilename << " for writing." << std::endl;
+		return false;
+	}
+
+	bool ok = WriteAt(fp, 0, &header, sizeof(header)) &&
+		WriteAt(fp, header.m_keyOffset, contents.m_key, contents.m_keySize) &&
+		WriteAt(fp, header.m_brickTableOffset, &bricks.m_types[0], bricks.m_types.size());
+	for(int i = 0; ok && i < HTV_NUM; ++i)
+	{
+		const HtvSection& section = header.m_sections[i];
+		ok = WriteAt(fp, section.m_offset, sectionData[i], section.m_size);
+	}
+	ok = (fclose(fp) == 0) && ok;
+
+	if(!ok || rename(tempFilename.c_str(), filename) != 0)
+	{
+		std::cerr << "Failed to write " << filename << std::endl;
+		unlink(tempFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool htv_DecodeBricks(const HtvFile& file, int section, int bzBegin, int bzEnd, 
+	unsigned char* texels)
+{
+	const HtvHeader& header = file.GetHeader();
+	const int numCells = header.m_numCells;
+	const int numBricks = header.m_numBricks;
+	const int bytesPerTexel = kBytesPerTexel[section];
+	const unsigned char* data = file.GetSection(section);
+	if(header.m_sections[section].m_encoding == HTVENC_Raw)
+	{
+		const size_t layerSize = size_t(numCells) * numCells * bytesPerTexel;
+		const int zBegin = bzBegin * kBrickSize;
+		const int zEnd = Min(bzEnd * kBrickSize, numCells);
+		std::copy(data + zBegin * layerSize, data + zEnd * layerSize, texels + zBegin * layerSize);
+		return true;
+	}
+
+	const HtvBrick* entries = reinterpret_cast<const HtvBrick*>(data);
+	const unsigned char* types = file.GetBrickTypes();
+	unsigned char brick[kMaxBrickBytes];
+	for(int bz = bzBegin; bz < bzEnd; ++bz)
+	for(int by = 0; by < numBricks; ++by)
+	for(int bx = 0; bx < numBricks; ++bx)
+	{
+		const int index = (bz * numBricks + by) * numBricks + bx;
+		const HtvBrick& entry = entries[index];
+		if(entry.m_size == 0)
+		{
+			const bool full = section == HTV_Density && types[index] == BRICK_Full;
+			FillBrick(numCells, bytesPerTexel, bx, by, bz, full ? 255 : 0, texels);
+			continue;
+		}
+
+		int begin[3], end[3];
+		GetBrickExtent(numCells, bx, by, bz, begin, end);
+		const size_t size = size_t(end[0] - begin[0]) * (end[1] - begin[1]) * 
+			(end[2] - begin[2]) * bytesPerTexel;
+		if(!DecompressBlock(data + entry.m_offset, entry.m_size, brick, size))
+			return false;
+		ScatterBrick(brick, numCells, bytesPerTexel, bx, by, bz, texels);
+	}
+	return true;
+}
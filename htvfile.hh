@@ -0,0 +1,103 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// .htv files hold a finished hypertexture volume: a header, the key it was generated from, a
+// table of brick types and the texels. Sections start on page boundaries and the texels are
+// laid out like the textures, so they can be uploaded straight out of a mapping of the file.
+enum HtvSectionType {
+	HTV_Density, // R8, numCells^3
+	HTV_Trans, // RGB8, numCells^3
+	HTV_Shadow, // R8, shadowDim^2
+	HTV_NUM,
+};
+
+enum HtvEncoding {
+	HTVENC_Raw,
+	// A table of HtvBrick followed by the bricks compressed one by one, see htv_DecodeBricks.
+	HTVENC_Bricks,
+};
+
+// Where a compressed brick is, relative to the start of its section. Bricks with a size of 0
+// are left out: density bricks that are all empty or all full, and transmittance bricks that
+// nothing non-empty is near enough to sample.
+class HtvBrick
+{
+public:
+	unsigned int m_offset;
+	unsigned int m_size;
+};
+
+class HtvSection
+{
+public:
+	unsigned int m_encoding; // HtvEncoding
+	unsigned int m_bytesPerTexel;
+	unsigned long long m_offset; // from the start of the file
+	unsigned long long m_size;
+};
+
+class HtvHeader
+{
+public:
+	unsigned int m_magic;
+	unsigned int m_version;
+	unsigned long long m_keyHash; // VolumeKey::m_hash
+	unsigned long long m_keyOffset;
+	unsigned long long m_keySize;
+	int m_numCells;
+	int m_brickSize;
+	int m_numBricks; // per axis
+	int m_shadowDim;
+	unsigned long long m_brickTableOffset; // m_numBricks^3 BrickTypes, x fastest
+	float m_matShadow[16];
+	HtvSection m_sections[HTV_NUM];
+};
+
+// A read only mapping of an .htv file.
+class HtvFile
+{
+public:
+	~HtvFile();
+	// returns null if the file is missing or isn't a valid .htv
+	static std::shared_ptr<HtvFile> Open(const char* filename);
+
+	const HtvHeader& GetHeader() const { return *m_header; }
+	const unsigned char* GetKey() const { return m_data + m_header->m_keyOffset; }
+	const unsigned char* GetBrickTypes() const { return m_data + m_header->m_brickTableOffset; }
+	const unsigned char* GetSection(int section) const
+		{ return m_data + m_header->m_sections[section].m_offset; }
+	// size of the section once decoded
+	size_t GetTexelSize(int section) const;
+private:
+	HtvFile(const unsigned char* data, size_t size);
+
+	const unsigned char* m_data;
+	size_t m_size;
+	const HtvHeader* m_header;
+};
+
+// What goes into a new file. The texel arrays are laid out like the sections.
+class HtvContents
+{
+public:
+	unsigned long long m_keyHash;
+	const unsigned char* m_key;
+	size_t m_keySize;
+	int m_numCells;
+	int m_shadowDim;
+	const float* m_matShadow;
+	const unsigned char* m_texels[HTV_NUM];
+	bool m_compress; // the density and transmittance as HTVENC_Bricks instead of raw
+};
+
+// Writes to a temporary file and renames it over filename, so a reader never maps a partial
+// file. Classifies the bricks from the density. Safe to call from the worker threads.
+bool htv_Write(const char* filename, const HtvContents& contents);
+
+// Decodes brick layers [bzBegin, bzEnd) of a section into texels laid out like the texture. 
+// Safe to run on several threads at once for different layers. Returns false if the data is
+// corrupt.
+bool htv_DecodeBricks(const HtvFile& file, int section, int bzBegin, int bzEnd, 
+	unsigned char* texels);
@@ -1,4 +1,8 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <unistd.h>
 #include "hyper.hh"
 #include "common.hh"
 #include "render.hh"
@@ -7,6 +11,12 @@
 #include "camera.hh"
 #include "commonmath.hh"
 #include "gputask.hh"
+#include "quality.hh"
+#include "htvfile.hh"
+#include "lighting.hh"
+#include "raymarch.hh"
+#include "timer.hh"
+#include "noise.hh"
 
 ////////////////////////////////////////////////////////////////////////////////
 static std::shared_ptr<ShaderInfo> g_htexShader;
@@ -18,6 +28,11 @@ enum HtexUniformLocType {
 	HTEXBIND_TransMap,
 	HTEXBIND_DensityMult,
 	HTEXBIND_AbsorptionColor,
+	HTEXBIND_MaxDensityMap,
+	HTEXBIND_MaxDensityLevels,
+	HTEXBIND_NumSteps,
+	HTEXBIND_JitterMap,
+	HTEXBIND_JitterOffset,
 };
 
 static std::vector<CustomShaderAttr> g_htexUniforms =
@@ -29,6 +44,11 @@ static std::vector<CustomShaderAttr> g_htexUniforms =
 	{ HTEXBIND_TransMap, "transMap" },
 	{ HTEXBIND_DensityMult, "densityMult" },
 	{ HTEXBIND_AbsorptionColor, "absorptionColor" },
+	{ HTEXBIND_MaxDensityMap, "maxDensityMap" },
+	{ HTEXBIND_MaxDensityLevels, "maxDensityLevels" },
+	{ HTEXBIND_NumSteps, "numSteps" },
+	{ HTEXBIND_JitterMap, "jitterMap" },
+	{ HTEXBIND_JitterOffset, "jitterOffset" },
 };
 
 static std::shared_ptr<ShaderInfo> g_lightingShader;
@@ -38,6 +58,9 @@ enum LightingUniformLocType {
 	LBIND_DensityMap,
 	LBIND_DensityMult,
 	LBIND_ScatteringColor,
+	LBIND_MaxDensityMap,
+	LBIND_MaxDensityLevels,
+	LBIND_NumSteps,
 };
 
 static std::vector<CustomShaderAttr> g_lightingUniforms =
@@ -46,6 +69,59 @@ static std::vector<CustomShaderAttr> g_lightingUniforms =
 	{ LBIND_DensityMap, "densityMap" },
 	{ LBIND_DensityMult, "densityMult" },
 	{ LBIND_ScatteringColor, "scatteringColor" },
+	{ LBIND_MaxDensityMap, "maxDensityMap" },
+	{ LBIND_MaxDensityLevels, "maxDensityLevels" },
+	{ LBIND_NumSteps, "numLightingSteps" },
+};
+
+static std::shared_ptr<ShaderInfo> g_lightingSweepShader;
+
+enum LightingSweepUniformLocType {
+	LSBIND_DensityMap,
+	LSBIND_PrevDepthMap,
+	LSBIND_SliceOrigin,
+	LSBIND_TexelStep,
+	LSBIND_RowStep,
+	LSBIND_Shift,
+	LSBIND_EdgeOffsets,
+	LSBIND_SliceLength,
+	LSBIND_FirstSlice,
+};
+
+static std::vector<CustomShaderAttr> g_lightingSweepUniforms =
+{
+	{ LSBIND_DensityMap, "densityMap" },
+	{ LSBIND_PrevDepthMap, "prevDepthMap" },
+	{ LSBIND_SliceOrigin, "sliceOrigin" },
+	{ LSBIND_TexelStep, "texelStep" },
+	{ LSBIND_RowStep, "rowStep" },
+	{ LSBIND_Shift, "shift" },
+	{ LSBIND_EdgeOffsets, "edgeOffsets" },
+	{ LSBIND_SliceLength, "sliceLength" },
+	{ LSBIND_FirstSlice, "firstSlice" },
+};
+
+static std::shared_ptr<ShaderInfo> g_lightingResolveShader;
+
+enum LightingResolveUniformLocType {
+	LRBIND_Absorption,
+	LRBIND_DensityMult,
+	LRBIND_ScatteringColor,
+	LRBIND_DepthMap,
+	LRBIND_Layer,
+	LRBIND_SweepAxes,
+	LRBIND_SliceDir,
+};
+
+static std::vector<CustomShaderAttr> g_lightingResolveUniforms =
+{
+	{ LRBIND_Absorption, "absorption" },
+	{ LRBIND_DensityMult, "densityMult" },
+	{ LRBIND_ScatteringColor, "scatteringColor" },
+	{ LRBIND_DepthMap, "depthMap" },
+	{ LRBIND_Layer, "layer" },
+	{ LRBIND_SweepAxes, "sweepAxes" },
+	{ LRBIND_SliceDir, "sliceDir" },
 };
 
 static std::shared_ptr<ShaderInfo> g_shadowShader;
@@ -55,6 +131,9 @@ enum ShadowUniformLocType {
 	SBIND_DensityMult,
 	SBIND_Absorption,
 	SBIND_AbsorptionColor,
+	SBIND_MaxDensityMap,
+	SBIND_MaxDensityLevels,
+	SBIND_NumSteps,
 };
 
 static std::vector<CustomShaderAttr> g_shadowUniforms =
@@ -63,11 +142,68 @@ static std::vector<CustomShaderAttr> g_shadowUniforms =
 	{ SBIND_DensityMult, "densityMult" },
 	{ SBIND_Absorption, "absorption" },
 	{ SBIND_AbsorptionColor, "absorptionColor" },
+	{ SBIND_MaxDensityMap, "maxDensityMap" },
+	{ SBIND_MaxDensityLevels, "maxDensityLevels" },
+	{ SBIND_NumSteps, "numSteps" },
+};
+
+static std::shared_ptr<ShaderInfo> g_transShadowShader;
+
+enum TransShadowUniformLocType {
+	TSBIND_TransMap,
+	TSBIND_ScatteringColor,
+	TSBIND_AbsorptionColor,
+};
+
+static std::vector<CustomShaderAttr> g_transShadowUniforms =
+{
+	{ TSBIND_TransMap, "transMap" },
+	{ TSBIND_ScatteringColor, "scatteringColor" },
+	{ TSBIND_AbsorptionColor, "absorptionColor" },
+};
+
+static std::shared_ptr<ShaderInfo> g_maxDensityShader;
+
+enum MaxDensityUniformLocType {
+	MBIND_SrcMap,
+	MBIND_Layer,
+	MBIND_CellSize,
+	MBIND_Border,
+};
+
+static std::vector<CustomShaderAttr> g_maxDensityUniforms =
+{
+	{ MBIND_SrcMap, "srcMap" },
+	{ MBIND_Layer, "layer" },
+	{ MBIND_CellSize, "cellSize" },
+	{ MBIND_Border, "border" },
+};
+
+static std::vector<CustomShaderAttr> g_genUniforms =
+{
+	{ GENBIND_Time, "time" },
+	{ GENBIND_Radius, "radius", true },
+	{ GENBIND_InnerRadius, "innerRadius", true },
+	{ GENBIND_Width, "width", true },
 };
 
 static std::shared_ptr<Geom> g_boxGeom;
+static bool g_emptySpaceSkipEnabled = true;
+static bool g_marchedLightingEnabled = false;
+static bool g_cpuLightingEnabled = false;
+static bool g_marchedShadowEnabled = false;
+static int g_shadowDim = HypertextureVolume::kDefaultShadowDim;
+static int g_rayJitterFrame = -1;
+static constexpr int kBlueNoiseSize = 64;
+static GLuint g_blueNoiseTex;
+static size_t g_volumeMemory; // of every HypertextureVolume
 
 ////////////////////////////////////////////////////////////////////////////////
+const std::vector<CustomShaderAttr>& hyper_GetGenUniforms()
+{
+	return g_genUniforms;
+}
+
 static std::shared_ptr<Geom> CreateHypertextureBoxGeom();
 void hyper_Init()
 {
@@ -75,35 +211,253 @@ void hyper_Init()
 		g_htexShader = render_CompileShader("shaders/hypertexture.glsl", g_htexUniforms);
 	if(!g_lightingShader)
 		g_lightingShader = render_CompileShader("shaders/computelighting.glsl", g_lightingUniforms);
+	if(!g_lightingSweepShader)
+		g_lightingSweepShader = render_CompileShader("shaders/lightingsweep.glsl", 
+			g_lightingSweepUniforms);
+	if(!g_lightingResolveShader)
+		g_lightingResolveShader = render_CompileShader("shaders/lightingresolve.glsl", 
+			g_lightingResolveUniforms);
 	if(!g_shadowShader)
 		g_shadowShader = render_CompileShader("shaders/cloudshadow.glsl", g_shadowUniforms);
+	if(!g_transShadowShader)
+		g_transShadowShader = render_CompileShader("shaders/transshadow.glsl", 
+			g_transShadowUniforms);
+	if(!g_maxDensityShader)
+		g_maxDensityShader = render_CompileShader("shaders/maxdensity.glsl", g_maxDensityUniforms);
 	if(!g_boxGeom)
 		g_boxGeom = CreateHypertextureBoxGeom();
+	if(!g_blueNoiseTex)
+	{
+		std::vector<float> noise = MakeBlueNoise(kBlueNoiseSize);
+		glGenTextures(1, &g_blueNoiseTex);
+		glBindTexture(GL_TEXTURE_2D, g_blueNoiseTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, kBlueNoiseSize, kBlueNoiseSize, 0, GL_RED, 
+			GL_FLOAT, &noise[0]);
+		render_SetTextureParameters(GL_REPEAT, GL_REPEAT, GL_NEAREST, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+}
+
+void hyper_SetEmptySpaceSkipEnabled(bool enabled)
+{
+	g_emptySpaceSkipEnabled = enabled;
+}
+
+bool hyper_IsEmptySpaceSkipEnabled()
+{
+	return g_emptySpaceSkipEnabled;
+}
+
+void hyper_SetMarchedLightingEnabled(bool enabled)
+{
+	g_marchedLightingEnabled = enabled;
+}
+
+bool hyper_IsMarchedLightingEnabled()
+{
+	return g_marchedLightingEnabled;
+}
+
+void hyper_SetCpuLightingEnabled(bool enabled)
+{
+	g_cpuLightingEnabled = enabled;
+}
+
+bool hyper_IsCpuLightingEnabled()
+{
+	return g_cpuLightingEnabled;
+}
+
+void hyper_SetMarchedShadowEnabled(bool enabled)
+{
+	g_marchedShadowEnabled = enabled;
+}
+
+bool hyper_IsMarchedShadowEnabled()
+{
+	return g_marchedShadowEnabled;
+}
+
+void hyper_SetShadowDim(int dim)
+{
+	g_shadowDim = Max(1, dim);
+}
+
+int hyper_GetShadowDim()
+{
+	return g_shadowDim;
+}
+
+void hyper_SetRayJitter(int frame)
+{
+	g_rayJitterFrame = frame;
+}
+
+// levels down to a single cell
+static int MaxDensityLevelCount(int numMaxCells)
+{
+	int count = 1;
+	while(numMaxCells > 1)
+	{
+		numMaxCells >>= 1;
+		++count;
+	}
+	return count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-GpuHypertexture::GpuHypertexture(int numCells, const std::shared_ptr<ShaderInfo>& shader,
-	const vec3& scale,
-	const std::shared_ptr<ShaderParams>& params)
+// the shadow covers this many world units whatever its size in texels
+static constexpr float kShadowExtent = 512.f;
+static constexpr int kMaxDensityCellSize = HypertextureVolume::kMaxDensityCellSize;
+static const float kClearShadow[] = {0.f, 0.f, 0.f, 1.f};
+
+// Roughly how many texels one frame of an update renders. Big volumes are spread over more
+// frames instead of hitching.
+static constexpr int kTexelsPerUpdateTask = 1 << 19;
+
+static int LayersPerUpdateTask(int numCells)
+{
+	return Clamp(kTexelsPerUpdateTask / (numCells * numCells), 1, numCells);
+}
+
+// Uploads layers [zBegin, zEnd) of a texture from texels, which is an offset into the pixel
+// unpack buffer if one is bound.
+static void UploadTexels(GLenum target, GLuint texture, GLenum format, 
+	int width, int height, const void* texels, int zBegin, int zEnd)
+{
+	glBindTexture(target, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if(target == GL_TEXTURE_3D)
+		glTexSubImage3D(target, 0, 0, 0, zBegin, width, height, zEnd - zBegin, 
+			format, GL_UNSIGNED_BYTE, texels);
+	else
+		glTexSubImage2D(target, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, texels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(target, 0);
+	checkGlError("UploadTexels");
+}
+
+// Uploads layers [zBegin, zEnd) of a texture from texels laid out like it, straight out of
+// wherever they are, like a file mapping. GL copies them once either way, staging them in a
+// PBO first would only add a copy.
+static void UploadLayers(GLenum target, GLuint texture, GLenum format, int bytesPerTexel, 
+	int width, int height, const unsigned char* texels, int zBegin, int zEnd)
+{
+	const size_t layerSize = size_t(width) * height * bytesPerTexel;
+	UploadTexels(target, texture, format, width, height, texels + layerSize * zBegin, 
+		zBegin, zEnd);
+}
+
+// A pixel unpack buffer that stays mapped while the worker threads fill it. Only touched on
+// the main thread, the workers just get the pointer.
+class UploadStaging
+{
+public:
+	UploadStaging(size_t size)
+		: m_buffer(0)
+		, m_data(nullptr)
+	{
+		glGenBuffers(1, &m_buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		m_data = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	~UploadStaging() 
+	{
+		Unmap();
+		glDeleteBuffers(1, &m_buffer);
+	}
+	void Unmap()
+	{
+		if(!m_data) return;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		m_data = nullptr;
+	}
+
+	GLuint m_buffer;
+	unsigned char* m_data;
+};
+
+// Slices of the GPU lighting sweep render their depth into one of two textures while reading
+// the other, and each is then copied into a layer of m_volume in the order they were swept.
+class LightingSweepBuffers
+{
+public:
+	LightingSweepBuffers(int numCells)
+		: m_numCells(numCells)
+		, m_fboDepth{ {numCells, numCells}, {numCells, numCells} }
+		, m_volume(0)
+	{
+		// the depth keeps accumulating so it needs full floats, the copy doesn't
+		for(Framebuffer& fbo : m_fboDepth)
+		{
+			fbo.AddTexture(GL_R32F, GL_RED, GL_FLOAT);
+			fbo.Create();
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		glGenTextures(1, &m_volume);
+		glBindTexture(GL_TEXTURE_3D, m_volume);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R16F, numCells, numCells, numCells, 0, 
+			GL_RED, GL_FLOAT, nullptr);
+		glBindTexture(GL_TEXTURE_3D, 0);
+		checkGlError("LightingSweepBuffers");
+	}
+	~LightingSweepBuffers() { glDeleteTextures(1, &m_volume); }
+
+	// two R32F slices and the R16F volume
+	size_t GetMemorySize() const 
+		{ return size_t(m_numCells) * m_numCells * (2 * 4 + size_t(m_numCells) * 2); }
+
+	int m_numCells;
+	Framebuffer m_fboDepth[2];
+	GLuint m_volume;
+};
+
+// Sweep buffers of shapes that went away, kept for the next one of the same size
+static std::vector<std::shared_ptr<LightingSweepBuffers>> g_freeSweepBuffers;
+static constexpr size_t kMaxFreeSweepBuffers = 2;
+
+static std::shared_ptr<LightingSweepBuffers> AcquireSweepBuffers(int numCells)
+{
+	for(auto it = g_freeSweepBuffers.begin(); it != g_freeSweepBuffers.end(); ++it)
+	{
+		if((*it)->m_numCells == numCells)
+		{
+			std::shared_ptr<LightingSweepBuffers> buffers = std::move(*it);
+			g_freeSweepBuffers.erase(it);
+			return buffers;
+		}
+	}
+	return std::make_shared<LightingSweepBuffers>(numCells);
+}
+
+HypertextureVolume::HypertextureVolume(int numCells, int shadowDim)
 	: m_numCells(numCells)
-	, m_shader(shader)
-	, m_genParams(params)
-	, m_ready(true)
+	, m_shadowDim(shadowDim)
 	, m_fboDensity{numCells, numCells, numCells}
+	, m_fboMaxDensity{Max(1, numCells / kMaxDensityCellSize), 
+		Max(1, numCells / kMaxDensityCellSize), Max(1, numCells / kMaxDensityCellSize)}
 	, m_fboTrans{numCells, numCells, numCells}
-	, m_fboShadow{kShadowDim,kShadowDim}
-	, m_model( MakeScale(scale) )
+	, m_fboShadow{shadowDim,shadowDim}
 	, m_matShadow( (mat4::identity_t()) )
-	, m_absorption(0.1)
-	, m_g(0.1)
-	, m_phaseConstants{}
-	, m_color(1,1,1)
-	, m_densityMult(1.0)
-	, m_scatteringColor(1.f,1.f,1.f)
-	, m_absorptionColor(1.f,1.f,1.f)
 {
 	m_fboDensity.AddTexture3D(GL_R8, GL_RED, GL_UNSIGNED_BYTE);
 	m_fboDensity.Create();
+
+	m_fboMaxDensity.AddTexture3D(GL_R8, GL_RED, GL_UNSIGNED_BYTE, 
+		GetMaxDensityLevelCount(numCells));
+	m_fboMaxDensity.Create();
+	glBindTexture(GL_TEXTURE_3D, m_fboMaxDensity.GetTexture(0));
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_3D, 0);
 	
 	m_fboTrans.AddTexture3D(GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
 	m_fboTrans.Create();
@@ -112,9 +466,90 @@ GpuHypertexture::GpuHypertexture(int numCells, const std::shared_ptr<ShaderInfo>
 	// sort of proxy geometry and the shadow intensity depends on the alpha of the cloud.
 	m_fboShadow.AddTexture(GL_R8, GL_RED, GL_UNSIGNED_BYTE);
 	m_fboShadow.Create();
+	// the ground samples it before the first update is done
+	glClearBufferfv(GL_COLOR, 0, kClearShadow);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	g_volumeMemory += GetMemorySize();
+}
+
+HypertextureVolume::~HypertextureVolume()
+{
+	g_volumeMemory -= GetMemorySize();
+}
 
+size_t HypertextureVolume::GetMemorySize(int numCells, int shadowDim)
+{
+	const size_t numTexels = size_t(numCells) * numCells * numCells;
+	const size_t numMaxCells = Max(1, numCells / kMaxDensityCellSize);
+	// density R8, transmittance RGB8 which is likely padded to 4 bytes, max density R8 with 
+	// its mips adding up to less than 8/7 of the first level, and the R8 shadow
+	return numTexels * (1 + 4) +
+		numMaxCells * numMaxCells * numMaxCells * 8 / 7 +
+		size_t(shadowDim) * shadowDim;
+}
+
+size_t HypertextureVolume::GetTotalMemory()
+{
+	return g_volumeMemory;
+}
+
+int HypertextureVolume::GetMaxDensityLevelCount(int numCells)
+{
+	return MaxDensityLevelCount(Max(1, numCells / kMaxDensityCellSize));
+}
+
+GpuHypertexture::GpuHypertexture(int numCells, const std::shared_ptr<ShaderInfo>& shader,
+	const vec3& pos, const vec3& scale,
+	const std::shared_ptr<ShaderParams>& params)
+	: m_numCells(numCells)
+	, m_shader(shader)
+	, m_genParams(params)
+	, m_ready(true)
+	, m_pending(false)
+	, m_pendingCpu(false)
+	, m_pendingSundir(0.f)
+	, m_pendingParams()
+	, m_numMaxDensityLevels(HypertextureVolume::GetMaxDensityLevelCount(numCells))
+	, m_front()
+	, m_back()
+	, m_hasVolume(false)
+	, m_updateKey()
+	, m_updateDensityKey()
+	, m_updateSteps()
+	, m_updateFromDisk(false)
+	, m_updateKeyStale(false)
+	, m_cpuDensity()
+	, m_cpuDensityKey()
+	, m_model( MakeTranslation(pos) * MakeScale(scale) )
+	, m_version(0)
+	, m_absorption(0.1)
+	, m_g(0.1)
+	, m_phaseConstants{}
+	, m_color(1,1,1)
+	, m_densityMult(1.0)
+	, m_scatteringColor(1.f,1.f,1.f)
+	, m_absorptionColor(1.f,1.f,1.f)
+{
 	UpdatePhaseConstants();
 }
+
+GpuHypertexture::~GpuHypertexture()
+{
+	volcache_Release(std::move(m_front));
+	volcache_Release(std::move(m_back));
+	if(m_sweepBuffers && g_freeSweepBuffers.size() < kMaxFreeSweepBuffers)
+		g_freeSweepBuffers.push_back(std::move(m_sweepBuffers));
+}
+
+size_t GpuHypertexture::GetMemoryUsed() const
+{
+	size_t size = 0;
+	if(m_front) size += m_front->GetMemorySize();
+	if(m_back && m_back != m_front) size += m_back->GetMemorySize();
+	if(m_sweepBuffers) size += m_sweepBuffers->GetMemorySize();
+	return size;
+}
 	
 void GpuHypertexture::UpdatePhaseConstants()
 {
@@ -126,131 +561,1025 @@ void GpuHypertexture::UpdatePhaseConstants()
 	m_phaseConstants[1] = 1 + g2;
 	m_phaseConstants[2] = -2*g;
 }
+
+void GpuHypertexture::SetPending(const vec3& sundir, const DensityParams& params, bool cpu)
+{
+	m_pending = true;
+	m_pendingCpu = cpu;
+	m_pendingSundir = sundir;
+	m_pendingParams = params;
+}
 	
-void GpuHypertexture::Update(const vec3& sundir)
+bool GpuHypertexture::BeginUpdate(const vec3& sundir, const DensityParams& params, bool cpu)
 {
-	if(!m_ready) return;
-	m_ready = false;
+	m_updateSteps = quality_GetSteps(m_numCells);
 
-	auto submit = [this, sundir]() {
-		const int numCells = m_numCells;
-		glEnable(GL_CULL_FACE);
+	VolumeKey& key = m_updateKey;
+	key = VolumeKey();
+	// density
+	key.Add(m_shader->GetFilename());
+	key.Add(m_shader->m_sourceHash);
+	key.Add(m_numCells);
+	key.Add(params.m_type);
+	key.Add(params.m_time);
+	key.Add(params.m_radius);
+	key.Add(params.m_innerRadius);
+	key.Add(params.m_width);
+	key.Add(cpu);
+	m_updateDensityKey = key;
+	// lighting and shadow
+	const bool cpuLighting = cpu && g_cpuLightingEnabled;
+	key.Add(cpuLighting);
+	key.Add(g_marchedLightingEnabled);
+	key.Add(g_marchedShadowEnabled);
+	key.Add(g_shadowDim);
+	key.Add(sundir);
+	key.Add(m_model);
+	key.Add(m_absorption);
+	key.Add(m_densityMult);
+	key.Add(m_scatteringColor);
+	key.Add(m_absorptionColor);
+	key.Add(m_updateSteps.m_lighting);
+	key.Add(m_updateSteps.m_shadow);
+	key.Add(g_lightingShader->m_sourceHash);
+	key.Add(g_shadowShader->m_sourceHash);
+	key.Add(g_transShadowShader->m_sourceHash);
 
-		// Update the density field
-		m_fboDensity.Bind();
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
-		const ShaderInfo* shader = m_shader.get();
-		GLint posLoc = shader->m_attrs[GEOM_Pos];
-		glUseProgram(shader->m_program);
-		if(m_genParams) m_genParams->Submit();
-	
-		float zCoord = -1.f;
-		const float zInc = 2.f / numCells;
+	if(auto cached = volcache_Find(key))
+	{
+		if(!m_back)
+			m_back = m_front;
+		else
+			volcache_Release(std::move(m_front));
+		m_front = cached;
+		m_hasVolume = true;
+		++m_version;
+		return true;
+	}
+
+	// the back buffer can't be written while the cache or the front still has it
+	if(!m_back || m_back.use_count() > 1 || m_back->m_shadowDim != g_shadowDim)
+	{
+		volcache_Release(std::move(m_back));
+		m_back = volcache_Acquire(m_numCells, g_shadowDim);
+	}
+	m_ready = false;
+
+	m_updateFromDisk = false;
+	if(volcache_IsDiskEnabled())
+	{
+		std::shared_ptr<HtvFile> file = volcache_OpenFile(key);
+		if(file && file->GetHeader().m_shadowDim == g_shadowDim)
 		{
-			ViewportState vpState(0, 0, numCells, numCells);
-			for(int z = 0; z < numCells; ++z, zCoord += zInc)
+			// if it's generated instead the file's still good, so it isn't saved again either
+			m_updateFromDisk = true;
+			return LoadFile(file, sundir, params, cpu);
+		}
+	}
+	return false;
+}
+	
+void GpuHypertexture::Update(const vec3& sundir, const DensityParams& params)
+{
+	if(!m_ready)
+	{
+		SetPending(sundir, params, false);
+		return;
+	}
+	if(BeginUpdate(sundir, params, false))
+		return;
+
+	if(params.m_type < 0)
+	{
+		SubmitGpuUpdate(sundir, params, nullptr);
+		return;
+	}
+
+	std::weak_ptr<GpuHypertexture> weakThis = shared_from_this();
+	density_ClassifyAsync(params, m_numCells,
+		[weakThis, sundir, params](const std::shared_ptr<DensityBricks>& bricks) {
+			if(auto htex = weakThis.lock())
+				htex->SubmitGpuUpdate(sundir, params, bricks);
+		});
+}
+
+void GpuHypertexture::SubmitGpuUpdate(const vec3& sundir, const DensityParams& params,
+	const std::shared_ptr<DensityBricks>& bricks)
+{
+	AppendUpdateTasks(sundir, 
+		[params, bricks](GpuHypertexture& htex, int zBegin, int zEnd) {
+			htex.SubmitDensity(params, bricks.get(), zBegin, zEnd);
+		});
+}
+
+void GpuHypertexture::UpdateCpu(const vec3& sundir, const DensityParams& params)
+{
+	if(!m_ready) 
+	{
+		SetPending(sundir, params, true);
+		return;
+	}
+	if(BeginUpdate(sundir, params, true))
+		return;
+
+	if(!g_cpuLightingEnabled)
+		m_cpuDensity.reset();
+	else if(m_cpuDensity && m_cpuDensityKey == m_updateDensityKey)
+	{
+		// only the lighting changed
+		ComputeCpuLighting(sundir, m_cpuDensity);
+		return;
+	}
+
+	// the tasks can outlive this object if the shape is switched while they're running
+	std::weak_ptr<GpuHypertexture> weakThis = shared_from_this();
+	auto volume = std::make_shared<DensityVolume>(m_numCells);
+	const bool lit = g_cpuLightingEnabled;
+	std::vector<std::shared_ptr<Task>> densityTasks = density_Generate(params, volume,
+		[weakThis, sundir, volume, lit]() {
+			if(auto htex = weakThis.lock())
+				htex->OnCpuDensityComplete(sundir, volume, lit);
+		});
+	// the sweep starts as soon as the last slab is generated, not a frame later in its join
+	if(lit)
+		ComputeCpuLighting(sundir, volume, densityTasks);
+}
+
+void GpuHypertexture::OnCpuDensityComplete(const vec3& sundir, 
+	const std::shared_ptr<DensityVolume>& volume, bool lit)
+{
+	if(lit)
+	{
+		// ComputeCpuLighting has it already
+		m_cpuDensity = volume;
+		m_cpuDensityKey = m_updateDensityKey;
+		return;
+	}
+
+	AppendUpdateTasks(sundir, 
+		[volume](GpuHypertexture& htex, int zBegin, int zEnd) {
+			htex.UploadDensity(*volume, zBegin, zEnd);
+		});
+}
+
+void GpuHypertexture::ComputeCpuLighting(const vec3& sundir, 
+	const std::shared_ptr<DensityVolume>& volume, const std::vector<std::shared_ptr<Task>>& after)
+{
+	LightingParams params;
+	params.m_sundir = sundir;
+	params.m_absorption = m_absorption;
+	params.m_densityMult = m_densityMult;
+	params.m_scatteringColor = m_scatteringColor;
+
+	std::weak_ptr<GpuHypertexture> weakThis = shared_from_this();
+	lighting_ComputeAsync(params, volume,
+		[weakThis, sundir, volume](const std::shared_ptr<TransmittanceVolume>& trans) {
+			auto htex = weakThis.lock();
+			if(!htex) return;
+			htex->AppendUpdateTasks(sundir,
+				[volume](GpuHypertexture& htex, int zBegin, int zEnd) {
+					htex.UploadDensity(*volume, zBegin, zEnd);
+				},
+				[trans](GpuHypertexture& htex, int zBegin, int zEnd) {
+					const int numCells = trans->m_numCells;
+					UploadLayers(GL_TEXTURE_3D, htex.m_back->m_fboTrans.GetTexture(0), GL_RGB, 3,
+						numCells, numCells, &trans->m_data[0], zBegin, zEnd);
+				});
+		}, after);
+}
+
+// Queues the density, shadow and lighting passes into the back buffers as one gpu task per
+// frame, with the big passes split into slabs of layers. The last task swaps the buffers.
+void GpuHypertexture::AppendTask(std::function<void(GpuHypertexture&)> submit)
+{
+	std::weak_ptr<GpuHypertexture> weakThis = shared_from_this();
+	gputask_Append(std::make_shared<GpuTask>(
+		[weakThis, submit]() {
+			auto htex = weakThis.lock();
+			if(!htex) return;
+			glEnable(GL_CULL_FACE);
+			submit(*htex);
+			glDisable(GL_CULL_FACE);
+		}, nullptr));
+}
+
+void GpuHypertexture::AppendUpdateTasks(const vec3& sundir, FillLayersFunc fillDensity,
+	FillLayersFunc fillTrans)
+{
+	// keep the step counts the same for the whole volume even if the tier changes meanwhile
+	const QualitySteps steps = m_updateSteps;
+	const int numCells = m_numCells;
+	const int layersPerTask = LayersPerUpdateTask(numCells);
+
+	for(int z = 0; z < numCells; z += layersPerTask)
+	{
+		const int zEnd = Min(z + layersPerTask, numCells);
+		AppendTask([fillDensity, z, zEnd](GpuHypertexture& htex) {
+			fillDensity(htex, z, zEnd);
+		});
+	}
+	AppendTask([](GpuHypertexture& htex) {
+		htex.SubmitMaxDensity();
+	});
+	const bool sweep = !fillTrans && !g_marchedLightingEnabled;
+	for(int s = 0; sweep && s < numCells; s += layersPerTask)
+	{
+		const int sEnd = Min(s + layersPerTask, numCells);
+		AppendTask([sundir, s, sEnd](GpuHypertexture& htex) {
+			if(!htex.m_sweepBuffers)
+				htex.m_sweepBuffers = AcquireSweepBuffers(htex.m_numCells);
+			htex.SubmitLightingSweep(*htex.m_back, *htex.m_sweepBuffers, sundir, s, sEnd);
+		});
+	}
+	for(int z = 0; z < numCells; z += layersPerTask)
+	{
+		const int zEnd = Min(z + layersPerTask, numCells);
+		AppendTask([fillTrans, sweep, sundir, steps, z, zEnd](GpuHypertexture& htex) {
+			const Framebuffer& trans = htex.m_back->m_fboTrans;
+			if(fillTrans)
+				fillTrans(htex, z, zEnd);
+			else if(sweep)
+				htex.SubmitLightingResolve(*htex.m_sweepBuffers, trans, sundir, z, zEnd);
+			else
+				htex.SubmitLighting(*htex.m_back, trans, sundir, steps.m_lighting, z, zEnd);
+		});
+	}
+	// after the lighting, the shadow is looked up from it
+	AppendTask([sundir, steps](GpuHypertexture& htex) {
+		htex.SubmitShadow(sundir, steps.m_shadow);
+	});
+	AppendTask([](GpuHypertexture& htex) {
+		htex.OnUpdateComplete();
+	});
+}
+
+// Raw files are uploaded straight from the mapping. Compressed ones are decoded on the worker
+// threads into a mapped PBO first, and then uploaded from that.
+bool GpuHypertexture::LoadFile(const std::shared_ptr<HtvFile>& file, const vec3& sundir,
+	const DensityParams& params, bool cpu)
+{
+	const HtvHeader& header = file->GetHeader();
+	if(header.m_sections[HTV_Density].m_encoding == HTVENC_Raw &&
+		header.m_sections[HTV_Trans].m_encoding == HTVENC_Raw)
+	{
+		AppendLoadTasks(file, nullptr);
+		return true;
+	}
+
+	const size_t densitySize = file->GetTexelSize(HTV_Density);
+	auto staging = std::make_shared<UploadStaging>(densitySize + file->GetTexelSize(HTV_Trans));
+	unsigned char* density = staging->m_data;
+	if(!density)
+		return false;
+	unsigned char* trans = density + densitySize;
+	auto failed = std::make_shared<std::atomic<bool>>(false);
+
+	std::weak_ptr<GpuHypertexture> weakThis = shared_from_this();
+	density_RunSlabTasks(m_numCells,
+		[file, density, trans, failed](int zBegin, int zEnd) {
+			const int bzBegin = zBegin / kBrickSize;
+			const int bzEnd = (zEnd + kBrickSize - 1) / kBrickSize;
+			if(*failed ||
+				!htv_DecodeBricks(*file, HTV_Density, bzBegin, bzEnd, density) ||
+				!htv_DecodeBricks(*file, HTV_Trans, bzBegin, bzEnd, trans))
+				*failed = true;
+		},
+		[weakThis, file, staging, failed, sundir, params, cpu]() {
+			staging->Unmap();
+			auto htex = weakThis.lock();
+			if(!htex) return;
+			if(!*failed)
 			{
-				m_fboDensity.BindLayer(z);
-
-				glBegin(GL_TRIANGLE_STRIP);
-				glVertexAttrib3f(posLoc, -1.f, -1.f, zCoord);
-				glVertexAttrib3f(posLoc, 1.f, -1.f, zCoord);
-				glVertexAttrib3f(posLoc, -1.f, 1.f, zCoord);
-				glVertexAttrib3f(posLoc, 1.f, 1.f, zCoord);
-				glEnd();
-				checkGlError("GpuHypertexture::Update - submit");
+				htex->AppendLoadTasks(file, staging);
+				return;
 			}
+
+			// throw the file away and generate the volume instead
+			const std::string filename = volcache_GetDiskPath(htex->m_updateKey);
+			std::cerr << "Failed to decode " << filename << std::endl;
+			unlink(filename.c_str());
+			htex->m_ready = true;
+			if(cpu)
+				htex->UpdateCpu(sundir, params);
+			else
+				htex->Update(sundir, params);
+		});
+	return true;
+}
+
+// Same as AppendUpdateTasks but the density, transmittance and shadow are uploaded from the
+// file, or from staging if it was decoded into that. The max densities are cheap enough to
+// rebuild.
+void GpuHypertexture::AppendLoadTasks(const std::shared_ptr<HtvFile>& file, 
+	const std::shared_ptr<UploadStaging>& staging)
+{
+	const int numCells = m_numCells;
+	const int layersPerTask = LayersPerUpdateTask(numCells);
+	const size_t densityLayerSize = size_t(numCells) * numCells;
+	const size_t transOffset = file->GetTexelSize(HTV_Density);
+
+	auto uploadLayers = [file, staging](const Framebuffer& fbo, int section, GLenum format,
+		size_t stagingOffset, int zBegin, int zEnd) {
+		const int numCells = file->GetHeader().m_numCells;
+		if(staging)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging->m_buffer);
+			UploadTexels(GL_TEXTURE_3D, fbo.GetTexture(0), format, numCells, numCells,
+				reinterpret_cast<const void*>(stagingOffset), zBegin, zEnd);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 		}
+		else
+		{
+			const int bytesPerTexel = file->GetHeader().m_sections[section].m_bytesPerTexel;
+			UploadLayers(GL_TEXTURE_3D, fbo.GetTexture(0), format, bytesPerTexel, 
+				numCells, numCells, file->GetSection(section), zBegin, zEnd);
+		}
+	};
 
-		// Update the shadows
-		m_fboShadow.Bind();
-		glClearBufferfv(GL_COLOR, 0, (float[]){0.f,0.f,0.f,1.f});
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	for(int z = 0; z < numCells; z += layersPerTask)
+	{
+		const int zEnd = Min(z + layersPerTask, numCells);
+		AppendTask([uploadLayers, densityLayerSize, z, zEnd](GpuHypertexture& htex) {
+			uploadLayers(htex.m_back->m_fboDensity, HTV_Density, GL_RED, 
+				densityLayerSize * z, z, zEnd);
+		});
+	}
+	AppendTask([](GpuHypertexture& htex) {
+		htex.SubmitMaxDensity();
+	});
+	AppendTask([file](GpuHypertexture& htex) {
+		const HtvHeader& header = file->GetHeader();
+		std::copy(header.m_matShadow, header.m_matShadow + 16, htex.m_back->m_matShadow.m);
+		UploadLayers(GL_TEXTURE_2D, htex.m_back->m_fboShadow.GetTexture(0), GL_RED, 1,
+			header.m_shadowDim, header.m_shadowDim, file->GetSection(HTV_Shadow), 0, 1);
+	});
+	for(int z = 0; z < numCells; z += layersPerTask)
+	{
+		const int zEnd = Min(z + layersPerTask, numCells);
+		AppendTask([uploadLayers, transOffset, densityLayerSize, z, zEnd](GpuHypertexture& htex) {
+			uploadLayers(htex.m_back->m_fboTrans, HTV_Trans, GL_RGB, 
+				transOffset + densityLayerSize * 3 * z, z, zEnd);
+		});
+	}
+	AppendTask([](GpuHypertexture& htex) {
+		htex.OnUpdateComplete();
+	});
+}
 
-		shader = g_shadowShader.get();
-		glUseProgram(shader->m_program);
-		posLoc = shader->m_attrs[GEOM_Pos];
-		GLint mvpLoc = shader->m_uniforms[BIND_Mvp];
-		GLint sundirLoc = shader->m_uniforms[BIND_Sundir];
-		GLint densityMapLoc = shader->m_custom[SBIND_DensityMap];
-		GLint densityMultLoc = shader->m_custom[SBIND_DensityMult];
-		GLint absorptionLoc = shader->m_custom[SBIND_Absorption];
-		GLint absorptionColorLoc = shader->m_custom[SBIND_AbsorptionColor];
-
-		m_matShadow = 
-			ComputeOrthoProj(kShadowDim, kShadowDim, 1, 4.5f * numCells) *
-			ComputeDirShadowView(vec3(0), sundir, 2.5f * numCells) ;
-
-		mat4 mvp = m_matShadow * m_model;
-
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_3D, m_fboDensity.GetTexture(0));
-		glUniform1i(densityMapLoc, 0);
-		glUniform3fv(sundirLoc, 1, &sundir.x);
-		glUniform1f(densityMultLoc, m_densityMult);
-		glUniform1f(absorptionLoc, m_absorption);
-		glUniform3fv(absorptionColorLoc, 1, &m_absorptionColor.r);
-		glUniformMatrix4fv(mvpLoc, 1, 0, mvp.m);
-		
+// Reads a finished volume back into a PBO, then the frame after maps it and writes the .htv
+// on a worker thread straight out of the mapping, so neither the GPU nor the disk stall the
+// main thread. The write task's join unmaps it.
+static void AppendSaveTask(const std::shared_ptr<HypertextureVolume>& volume, 
+	const VolumeKey& key)
+{
+	class VolumeReadback
+	{
+	public:
+		VolumeReadback() : m_buffer(0), m_offsets{}, m_mapped(nullptr)
+			{ glGenBuffers(1, &m_buffer); }
+		~VolumeReadback() { glDeleteBuffers(1, &m_buffer); }
+		void Unmap()
 		{
-			ViewportState vpState(0,0,kShadowDim,kShadowDim);
-			g_boxGeom->Render(*shader);
+			if(!m_mapped) return;
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, m_buffer);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			m_mapped = nullptr;
 		}
+		GLuint m_buffer;
+		size_t m_offsets[HTV_NUM + 1];
+		const unsigned char* m_mapped;
+	};
 
-		// Update the transmittance with respect to sun
-		m_fboTrans.Bind();
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	auto readback = std::make_shared<VolumeReadback>();
+	gputask_Append(std::make_shared<GpuTask>(
+		[volume, readback]() {
+			const size_t numTexels = size_t(volume->m_numCells) * volume->m_numCells * 
+				volume->m_numCells;
+			size_t* offsets = readback->m_offsets;
+			offsets[HTV_Density] = 0;
+			offsets[HTV_Trans] = offsets[HTV_Density] + numTexels;
+			offsets[HTV_Shadow] = offsets[HTV_Trans] + numTexels * 3;
+			offsets[HTV_NUM] = offsets[HTV_Shadow] + 
+				size_t(volume->m_shadowDim) * volume->m_shadowDim;
+
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->m_buffer);
+			glBufferData(GL_PIXEL_PACK_BUFFER, offsets[HTV_NUM], nullptr, GL_STREAM_READ);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glBindTexture(GL_TEXTURE_3D, volume->m_fboDensity.GetTexture(0));
+			glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_UNSIGNED_BYTE, 
+				reinterpret_cast<void*>(offsets[HTV_Density]));
+			glBindTexture(GL_TEXTURE_3D, volume->m_fboTrans.GetTexture(0));
+			glGetTexImage(GL_TEXTURE_3D, 0, GL_RGB, GL_UNSIGNED_BYTE, 
+				reinterpret_cast<void*>(offsets[HTV_Trans]));
+			glBindTexture(GL_TEXTURE_3D, 0);
+			glBindTexture(GL_TEXTURE_2D, volume->m_fboShadow.GetTexture(0));
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_BYTE, 
+				reinterpret_cast<void*>(offsets[HTV_Shadow]));
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			checkGlError("AppendSaveTask readback");
+		},
+		[volume, readback, key]() {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->m_buffer);
+			readback->m_mapped = static_cast<const unsigned char*>(
+				glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if(!readback->m_mapped)
+				return;
+
+			const std::string filename = volcache_GetDiskPath(key);
+			const int numCells = volume->m_numCells;
+			const int shadowDim = volume->m_shadowDim;
+			const mat4 matShadow = volume->m_matShadow;
+			const bool compress = volcache_IsDiskCompressEnabled();
+			task_AppendTask(std::make_shared<Task>(
+				nullptr,
+				[readback]() {
+					readback->Unmap();
+				},
+				[readback, key, filename, numCells, shadowDim, matShadow, compress]() {
+					HtvContents contents;
+					contents.m_keyHash = key.m_hash;
+					contents.m_key = &key.m_data[0];
+					contents.m_keySize = key.m_data.size();
+					contents.m_numCells = numCells;
+					contents.m_shadowDim = shadowDim;
+					contents.m_matShadow = matShadow.m;
+					for(int i = 0; i < HTV_NUM; ++i)
+						contents.m_texels[i] = readback->m_mapped + readback->m_offsets[i];
+					contents.m_compress = compress;
+					htv_Write(filename.c_str(), contents);
+				}));
+		}));
+}
+
+void GpuHypertexture::OnUpdateComplete()
+{
+	std::swap(m_front, m_back);
+	if(!m_updateKeyStale)
+	{
+		volcache_Insert(m_updateKey, m_front);
+		if(volcache_IsDiskEnabled() && !m_updateFromDisk)
+			AppendSaveTask(m_front, m_updateKey);
+	}
+	m_updateKeyStale = false;
+	m_hasVolume = true;
+	++m_version;
+	m_ready = true;
+	if(m_pending)
+	{
+		m_pending = false;
+		if(m_pendingCpu)
+			UpdateCpu(m_pendingSundir, m_pendingParams);
+		else
+			Update(m_pendingSundir, m_pendingParams);
+	}
+}
+
+// Finds the run of bricks along x starting at bx with the same type, returns the end of it.
+static int FindBrickRun(const DensityBricks& bricks, int bx, int by, int bz)
+{
+	const int type = bricks.GetType(bx, by, bz);
+	int end = bx + 1;
+	while(end < bricks.m_numBricks && bricks.GetType(end, by, bz) == type)
+		++end;
+	return end;
+}
+
+// Layer z of the density with the empty bricks skipped. Full bricks are cleared to 1 and mixed
+// ones are drawn with the gen shader, which has to be bound already.
+static void SubmitDensityLayerBricks(const DensityBricks& bricks, int z, float zCoord, 
+	GLint posLoc)
+{
+	static const float kEmptyDensity[] = {0.f, 0.f, 0.f, 0.f};
+	static const float kFullDensity[] = {1.f, 1.f, 1.f, 1.f};
+	const int numCells = bricks.m_numCells;
+	const int numBricks = bricks.m_numBricks;
+	const int bz = z / kBrickSize;
 
-		shader = g_lightingShader.get();
-		glUseProgram(shader->m_program);
-		posLoc = shader->m_attrs[GEOM_Pos];
-		sundirLoc = shader->m_uniforms[BIND_Sundir];
-		absorptionLoc = shader->m_custom[LBIND_Absorption];
-		densityMapLoc = shader->m_custom[LBIND_DensityMap];
-		densityMultLoc = shader->m_custom[LBIND_DensityMult];
-		GLint scatteringColor = shader->m_custom[LBIND_ScatteringColor];
-
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_3D, m_fboDensity.GetTexture(0));
-		glUniform1i(densityMapLoc, 0);
-		glUniform3fv(sundirLoc, 1, &sundir.x);
-		glUniform1f(absorptionLoc, m_absorption);
-		glUniform1f(densityMultLoc, m_densityMult);
-		glUniform3fv(scatteringColor, 1, &m_scatteringColor.r);
-
-		zCoord = -1.f;
+	glClearBufferfv(GL_COLOR, 0, kEmptyDensity);
+	for(int by = 0; by < numBricks; ++by)
+	{
+		const int y0 = by * kBrickSize;
+		const int y1 = Min(y0 + kBrickSize, numCells);
+		for(int bx = 0, end; bx < numBricks; bx = end)
 		{
-			ViewportState vpState(0, 0, numCells, numCells);
-			for(int z = 0; z < numCells; ++z, zCoord += zInc)
-			{
-				m_fboTrans.BindLayer(z);
+			end = FindBrickRun(bricks, bx, by, bz);
+			if(bricks.GetType(bx, by, bz) != BRICK_Full)
+				continue;
+			const int x0 = bx * kBrickSize;
+			const int x1 = Min(end * kBrickSize, numCells);
+			glScissor(x0, y0, x1 - x0, y1 - y0);
+			glClearBufferfv(GL_COLOR, 0, kFullDensity);
+		}
+	}
+	glScissor(0, 0, numCells, numCells);
 
-				glUseProgram(shader->m_program);
+	const float cellToNdc = 2.f / numCells;
+	glBegin(GL_TRIANGLES);
+	for(int by = 0; by < numBricks; ++by)
+	{
+		const float y0 = by * kBrickSize * cellToNdc - 1.f;
+		const float y1 = Min((by + 1) * kBrickSize, numCells) * cellToNdc - 1.f;
+		for(int bx = 0, end; bx < numBricks; bx = end)
+		{
+			end = FindBrickRun(bricks, bx, by, bz);
+			if(bricks.GetType(bx, by, bz) != BRICK_Mixed)
+				continue;
+			const float x0 = bx * kBrickSize * cellToNdc - 1.f;
+			const float x1 = Min(end * kBrickSize, numCells) * cellToNdc - 1.f;
+			glVertexAttrib3f(posLoc, x0, y0, zCoord);
+			glVertexAttrib3f(posLoc, x1, y0, zCoord);
+			glVertexAttrib3f(posLoc, x0, y1, zCoord);
+			glVertexAttrib3f(posLoc, x0, y1, zCoord);
+			glVertexAttrib3f(posLoc, x1, y0, zCoord);
+			glVertexAttrib3f(posLoc, x1, y1, zCoord);
+		}
+	}
+	glEnd();
+}
 
-				glBegin(GL_TRIANGLE_STRIP);
-				glVertexAttrib3f(posLoc, -1.f, -1.f, zCoord);
-				glVertexAttrib3f(posLoc, 1.f, -1.f, zCoord);
-				glVertexAttrib3f(posLoc, -1.f, 1.f, zCoord);
-				glVertexAttrib3f(posLoc, 1.f, 1.f, zCoord);
-				glEnd();
-				checkGlError("GpuHypertexture::Update - submit lighting");
-			}
+void GpuHypertexture::SubmitDensity(const DensityParams& params, const DensityBricks* bricks,
+	int zBegin, int zEnd)
+{
+	const int numCells = m_numCells;
+	const Framebuffer& fboDensity = m_back->m_fboDensity;
+
+	fboDensity.Bind();
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	const ShaderInfo* shader = m_shader.get();
+	GLint posLoc = shader->m_attrs[GEOM_Pos];
+	glUseProgram(shader->m_program);
+	if(m_genParams) m_genParams->Submit();
+	// the values m_genParams points at may have changed since the update started, every slab
+	// has to come from the same ones (and the bricks were classified with them)
+	glUniform1f(shader->m_custom[GENBIND_Time], params.m_time);
+	glUniform1f(shader->m_custom[GENBIND_Radius], params.m_radius);
+	glUniform1f(shader->m_custom[GENBIND_InnerRadius], params.m_innerRadius);
+	glUniform1f(shader->m_custom[GENBIND_Width], params.m_width);
+
+	const float zInc = 2.f / numCells;
+	float zCoord = -1.f + zBegin * zInc;
+	ViewportState vpState(0, 0, numCells, numCells);
+	ScissorState scissorState(0, 0, numCells, numCells);
+	for(int z = zBegin; z < zEnd; ++z, zCoord += zInc)
+	{
+		fboDensity.BindLayer(z);
+
+		if(bricks)
+		{
+			SubmitDensityLayerBricks(*bricks, z, zCoord, posLoc);
 		}
+		else
+		{
+			glBegin(GL_TRIANGLE_STRIP);
+			glVertexAttrib3f(posLoc, -1.f, -1.f, zCoord);
+			glVertexAttrib3f(posLoc, 1.f, -1.f, zCoord);
+			glVertexAttrib3f(posLoc, -1.f, 1.f, zCoord);
+			glVertexAttrib3f(posLoc, 1.f, 1.f, zCoord);
+			glEnd();
+		}
+		checkGlError("GpuHypertexture::SubmitDensity");
+	}
+}
 
-		glDisable(GL_CULL_FACE);
+void GpuHypertexture::UploadDensity(const DensityVolume& volume, int zBegin, int zEnd)
+{
+	ASSERT(volume.m_numCells == m_numCells);
+	UploadLayers(GL_TEXTURE_3D, m_back->m_fboDensity.GetTexture(0), GL_RED, 1, 
+		m_numCells, m_numCells, volume.GetSlice(0), zBegin, zEnd);
+}
 
-		m_ready = true;
-	};
+void GpuHypertexture::SubmitMaxDensity()
+{
+	const ShaderInfo* shader = g_maxDensityShader.get();
+	glUseProgram(shader->m_program);
+	GLint posLoc = shader->m_attrs[GEOM_Pos];
+	GLint srcMapLoc = shader->m_custom[MBIND_SrcMap];
+	GLint layerLoc = shader->m_custom[MBIND_Layer];
+	GLint cellSizeLoc = shader->m_custom[MBIND_CellSize];
+	GLint borderLoc = shader->m_custom[MBIND_Border];
+	const Framebuffer& fboMaxDensity = m_back->m_fboMaxDensity;
+
+	fboMaxDensity.Bind();
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(srcMapLoc, 0);
+
+	const GLuint maxTex = fboMaxDensity.GetTexture(0);
+	for(int level = 0; level < m_numMaxDensityLevels; ++level)
+	{
+		if(level == 0)
+		{
+			// widened by a texel for the neighbours linear filtering reads
+			glBindTexture(GL_TEXTURE_3D, m_back->m_fboDensity.GetTexture(0));
+			glUniform1i(cellSizeLoc, kMaxDensityCellSize);
+			glUniform1i(borderLoc, 1);
+		}
+		else
+		{
+			// limit the source to the level above so it isn't reading the one being rendered
+			glBindTexture(GL_TEXTURE_3D, maxTex);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, level - 1);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, level - 1);
+			glUniform1i(cellSizeLoc, 2);
+			glUniform1i(borderLoc, 0);
+		}
+
+		const int dim = Max(1, m_numCells / kMaxDensityCellSize) >> level;
+		ViewportState vpState(0, 0, dim, dim);
+		for(int z = 0; z < dim; ++z)
+		{
+			fboMaxDensity.BindLayer(z, level);
+			glUniform1i(layerLoc, z);
+
+			glBegin(GL_TRIANGLE_STRIP);
+			glVertexAttrib3f(posLoc, -1.f, -1.f, 0.f);
+			glVertexAttrib3f(posLoc, 1.f, -1.f, 0.f);
+			glVertexAttrib3f(posLoc, -1.f, 1.f, 0.f);
+			glVertexAttrib3f(posLoc, 1.f, 1.f, 0.f);
+			glEnd();
+		}
+		checkGlError("GpuHypertexture::SubmitMaxDensity");
+	}
 
-	gputask_Append(std::make_shared<GpuTask>(submit, nullptr));
+	glBindTexture(GL_TEXTURE_3D, maxTex);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, m_numMaxDensityLevels - 1);
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void GpuHypertexture::BindMaxDensity(const HypertextureVolume& buffers, int unit, GLint mapLoc, 
+	GLint levelsLoc) const
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_3D, buffers.m_fboMaxDensity.GetTexture(0));
+	glUniform1i(mapLoc, unit);
+	glUniform1i(levelsLoc, g_emptySpaceSkipEnabled ? m_numMaxDensityLevels : 0);
+}
+
+void GpuHypertexture::SubmitShadow(const vec3& sundir, int numSteps)
+{
+	const int numCells = m_numCells;
+	HypertextureVolume& buffers = *m_back;
+
+	buffers.m_fboShadow.Bind();
+	glClearBufferfv(GL_COLOR, 0, kClearShadow);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+	buffers.m_matShadow = 
+		ComputeOrthoProj(kShadowExtent, kShadowExtent, 1, 4.5f * numCells) *
+		ComputeDirShadowView(TransformPoint(m_model, vec3(0.f)), sundir, 2.5f * numCells) ;
+
+	mat4 mvp = buffers.m_matShadow * m_model;
+
+	// the transmittance already has what's left of the sun where the rays leave the volume, 
+	// so unless the reference is wanted it's a single lookup instead of a march
+	const ShaderInfo* shader = 
+		g_marchedShadowEnabled ? g_shadowShader.get() : g_transShadowShader.get();
+	glUseProgram(shader->m_program);
+	glUniform3fv(shader->m_uniforms[BIND_Sundir], 1, &sundir.x);
+	glUniformMatrix4fv(shader->m_uniforms[BIND_Mvp], 1, 0, mvp.m);
+
+	glActiveTexture(GL_TEXTURE0);
+	if(g_marchedShadowEnabled)
+	{
+		glBindTexture(GL_TEXTURE_3D, buffers.m_fboDensity.GetTexture(0));
+		glUniform1i(shader->m_custom[SBIND_DensityMap], 0);
+		glUniform1f(shader->m_custom[SBIND_DensityMult], m_densityMult);
+		glUniform1f(shader->m_custom[SBIND_Absorption], m_absorption);
+		glUniform3fv(shader->m_custom[SBIND_AbsorptionColor], 1, &m_absorptionColor.r);
+		glUniform1i(shader->m_custom[SBIND_NumSteps], numSteps);
+		BindMaxDensity(buffers, 1, shader->m_custom[SBIND_MaxDensityMap], 
+			shader->m_custom[SBIND_MaxDensityLevels]);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_3D, buffers.m_fboTrans.GetTexture(0));
+		glUniform1i(shader->m_custom[TSBIND_TransMap], 0);
+		glUniform3fv(shader->m_custom[TSBIND_ScatteringColor], 1, &m_scatteringColor.r);
+		glUniform3fv(shader->m_custom[TSBIND_AbsorptionColor], 1, &m_absorptionColor.r);
+	}
+	
+	ViewportState vpState(0,0,buffers.m_shadowDim,buffers.m_shadowDim);
+	g_boxGeom->Render(*shader);
+}
+
+void GpuHypertexture::SubmitLighting(const HypertextureVolume& volume, const Framebuffer& trans,
+	const vec3& sundir, int numSteps, int zBegin, int zEnd)
+{
+	const int numCells = m_numCells;
+
+	// Update the transmittance with respect to sun
+	trans.Bind();
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+	const ShaderInfo* shader = g_lightingShader.get();
+	glUseProgram(shader->m_program);
+	GLint posLoc = shader->m_attrs[GEOM_Pos];
+	GLint sundirLoc = shader->m_uniforms[BIND_Sundir];
+	GLint absorptionLoc = shader->m_custom[LBIND_Absorption];
+	GLint densityMapLoc = shader->m_custom[LBIND_DensityMap];
+	GLint densityMultLoc = shader->m_custom[LBIND_DensityMult];
+	GLint scatteringColor = shader->m_custom[LBIND_ScatteringColor];
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, volume.m_fboDensity.GetTexture(0));
+	glUniform1i(densityMapLoc, 0);
+	glUniform3fv(sundirLoc, 1, &sundir.x);
+	glUniform1f(absorptionLoc, m_absorption);
+	glUniform1f(densityMultLoc, m_densityMult);
+	glUniform3fv(scatteringColor, 1, &m_scatteringColor.r);
+	glUniform1i(shader->m_custom[LBIND_NumSteps], numSteps);
+	BindMaxDensity(volume, 1, shader->m_custom[LBIND_MaxDensityMap], 
+		shader->m_custom[LBIND_MaxDensityLevels]);
+
+	const float zInc = 2.f / numCells;
+	float zCoord = -1.f + zBegin * zInc;
+	ViewportState vpState(0, 0, numCells, numCells);
+	for(int z = zBegin; z < zEnd; ++z, zCoord += zInc)
+	{
+		trans.BindLayer(z);
+
+		glBegin(GL_TRIANGLE_STRIP);
+		glVertexAttrib3f(posLoc, -1.f, -1.f, zCoord);
+		glVertexAttrib3f(posLoc, 1.f, -1.f, zCoord);
+		glVertexAttrib3f(posLoc, -1.f, 1.f, zCoord);
+		glVertexAttrib3f(posLoc, 1.f, 1.f, zCoord);
+		glEnd();
+		checkGlError("GpuHypertexture::SubmitLighting");
+	}
+}
+
+// Slices are swept along the axis closest to sundir starting at the sun side, see lighting.hh.
+// Each one continues the depth of the slice before it where its ray toward the sun crosses it,
+// so a texel takes a few samples instead of numLightingSteps. The slices have to be rendered
+// one after another, but there are only numCells of them.
+void GpuHypertexture::SubmitLightingSweep(const HypertextureVolume& volume, 
+	LightingSweepBuffers& buffers, const vec3& sundir, int sweepBegin, int sweepEnd)
+{
+	const int numCells = m_numCells;
+	const LightingSweepAxes axes(sundir, numCells);
+	const float* offsets = LightingSweepAxes::kTexelOffsets;
+
+	const ShaderInfo* shader = g_lightingSweepShader.get();
+	glUseProgram(shader->m_program);
+	GLint posLoc = shader->m_attrs[GEOM_Pos];
+	GLint sliceOriginLoc = shader->m_custom[LSBIND_SliceOrigin];
+	GLint firstSliceLoc = shader->m_custom[LSBIND_FirstSlice];
+
+	vec3 texelStep(0.f), rowStep(0.f);
+	(&texelStep.x)[axes.m_texelAxis] = 1.f / numCells;
+	(&rowStep.x)[axes.m_rowAxis] = 1.f / numCells;
+	glUniform3fv(shader->m_uniforms[BIND_Sundir], 1, &sundir.x);
+	glUniform1i(shader->m_custom[LSBIND_DensityMap], 0);
+	glUniform1i(shader->m_custom[LSBIND_PrevDepthMap], 1);
+	glUniform3fv(shader->m_custom[LSBIND_TexelStep], 1, &texelStep.x);
+	glUniform3fv(shader->m_custom[LSBIND_RowStep], 1, &rowStep.x);
+	glUniform2f(shader->m_custom[LSBIND_Shift], axes.m_shiftTexel, axes.m_shiftRow);
+	glUniform2f(shader->m_custom[LSBIND_EdgeOffsets], offsets[axes.m_texelAxis], 
+		offsets[axes.m_rowAxis]);
+	glUniform1f(shader->m_custom[LSBIND_SliceLength], axes.m_sliceLength);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, volume.m_fboDensity.GetTexture(0));
+	// the copies go to whatever is bound to the active unit, keep them off the sampled ones
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_3D, buffers.m_volume);
+
+	ViewportState vpState(0, 0, numCells, numCells);
+	for(int s = sweepBegin; s < sweepEnd; ++s)
+	{
+		vec3 origin(offsets[0] / numCells, offsets[1] / numCells, offsets[2] / numCells);
+		(&origin.x)[axes.m_sliceAxis] = 
+			(axes.GetSlice(s) + offsets[axes.m_sliceAxis]) / numCells;
+		glUniform3fv(sliceOriginLoc, 1, &origin.x);
+		glUniform1i(firstSliceLoc, s == 0);
+
+		const Framebuffer& target = buffers.m_fboDepth[s & 1];
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, buffers.m_fboDepth[(s + 1) & 1].GetTexture(0));
+		glActiveTexture(GL_TEXTURE2);
+		target.Bind();
+		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+		glBegin(GL_TRIANGLE_STRIP);
+		glVertexAttrib3f(posLoc, -1.f, -1.f, 0.f);
+		glVertexAttrib3f(posLoc, 1.f, -1.f, 0.f);
+		glVertexAttrib3f(posLoc, -1.f, 1.f, 0.f);
+		glVertexAttrib3f(posLoc, 1.f, 1.f, 0.f);
+		glEnd();
+
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glCopyTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, s, 0, 0, numCells, numCells);
+		checkGlError("GpuHypertexture::SubmitLightingSweep");
+	}
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void GpuHypertexture::SubmitLightingResolve(const LightingSweepBuffers& buffers, 
+	const Framebuffer& trans, const vec3& sundir, int zBegin, int zEnd)
+{
+	const LightingSweepAxes axes(sundir, m_numCells);
+
+	trans.Bind();
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+	const ShaderInfo* shader = g_lightingResolveShader.get();
+	glUseProgram(shader->m_program);
+	GLint posLoc = shader->m_attrs[GEOM_Pos];
+	GLint layerLoc = shader->m_custom[LRBIND_Layer];
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, buffers.m_volume);
+	glUniform1i(shader->m_custom[LRBIND_DepthMap], 0);
+	glUniform1f(shader->m_custom[LRBIND_Absorption], m_absorption);
+	glUniform1f(shader->m_custom[LRBIND_DensityMult], m_densityMult);
+	glUniform3fv(shader->m_custom[LRBIND_ScatteringColor], 1, &m_scatteringColor.r);
+	glUniform3i(shader->m_custom[LRBIND_SweepAxes], axes.m_sliceAxis, axes.m_texelAxis, 
+		axes.m_rowAxis);
+	glUniform1i(shader->m_custom[LRBIND_SliceDir], axes.m_sliceDir);
+
+	ViewportState vpState(0, 0, m_numCells, m_numCells);
+	for(int z = zBegin; z < zEnd; ++z)
+	{
+		trans.BindLayer(z);
+		glUniform1i(layerLoc, z);
+
+		glBegin(GL_TRIANGLE_STRIP);
+		glVertexAttrib3f(posLoc, -1.f, -1.f, 0.f);
+		glVertexAttrib3f(posLoc, 1.f, -1.f, 0.f);
+		glVertexAttrib3f(posLoc, -1.f, 1.f, 0.f);
+		glVertexAttrib3f(posLoc, 1.f, 1.f, 0.f);
+		glEnd();
+		checkGlError("GpuHypertexture::SubmitLightingResolve");
+	}
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void GpuHypertexture::CompareLighting(const vec3& sundir)
+{
+	if(!m_hasVolume) return;
+	const int numCells = m_numCells;
+	Framebuffer swept(numCells, numCells, numCells);
+	Framebuffer marched(numCells, numCells, numCells);
+	for(Framebuffer* fbo : {&swept, &marched})
+	{
+		fbo->AddTexture3D(GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
+		fbo->Create();
+	}
+	LightingSweepBuffers buffers(numCells);
+
+	Timer sweepTimer, marchTimer;
+	glEnable(GL_CULL_FACE);
+	glFinish();
+	sweepTimer.Start();
+	SubmitLightingSweep(*m_front, buffers, sundir, 0, numCells);
+	SubmitLightingResolve(buffers, swept, sundir, 0, numCells);
+	glFinish();
+	sweepTimer.Stop();
+	marchTimer.Start();
+	SubmitLighting(*m_front, marched, sundir, quality_GetSteps(numCells).m_lighting, 0, numCells);
+	glFinish();
+	marchTimer.Stop();
+	glDisable(GL_CULL_FACE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	const size_t size = size_t(numCells) * numCells * numCells * 3;
+	std::vector<unsigned char> sweptTexels(size), marchedTexels(size);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_3D, swept.GetTexture(0));
+	glGetTexImage(GL_TEXTURE_3D, 0, GL_RGB, GL_UNSIGNED_BYTE, &sweptTexels[0]);
+	glBindTexture(GL_TEXTURE_3D, marched.GetTexture(0));
+	glGetTexImage(GL_TEXTURE_3D, 0, GL_RGB, GL_UNSIGNED_BYTE, &marchedTexels[0]);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	checkGlError("GpuHypertexture::CompareLighting");
+
+	int maxError = 0;
+	size_t sumError = 0;
+	for(size_t i = 0; i < size; ++i)
+	{
+		const int error = abs(int(sweptTexels[i]) - int(marchedTexels[i]));
+		maxError = Max(maxError, error);
+		sumError += error;
+	}
+	std::cout << "lighting sweep " << sweepTimer.GetTime() * 1000.f << " ms, march " << 
+		marchTimer.GetTime() * 1000.f << " ms, max error " << maxError << "/255, mean " << 
+		double(sumError) / size << std::endl;
+}
+
+RaymarchParams GpuHypertexture::GetRaymarchParams(const vec3& sundir, const Color& sunColor) const
+{
+	RaymarchParams params;
+	params.m_model = m_model;
+	params.m_sundir = sundir;
+	params.m_sunColor = sunColor;
+	params.m_absorption = m_absorption;
+	for(int i = 0; i < 3; ++i)
+		params.m_phaseConstants[i] = m_phaseConstants[i];
+	params.m_color = m_color;
+	params.m_densityMult = m_densityMult;
+	params.m_absorptionColor = m_absorptionColor;
+	params.m_numSteps = quality_GetSteps(m_numCells).m_raymarch;
+	return params;
+}
+
+std::shared_ptr<RaymarchVolume> GpuHypertexture::ReadVolume() const
+{
+	if(!m_hasVolume) return nullptr;
+	auto density = std::make_shared<DensityVolume>(m_numCells);
+	auto trans = std::make_shared<TransmittanceVolume>(m_numCells);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_3D, m_front->m_fboDensity.GetTexture(0));
+	glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_UNSIGNED_BYTE, &density->m_data[0]);
+	glBindTexture(GL_TEXTURE_3D, m_front->m_fboTrans.GetTexture(0));
+	glGetTexImage(GL_TEXTURE_3D, 0, GL_RGB, GL_UNSIGNED_BYTE, &trans->m_data[0]);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	checkGlError("GpuHypertexture::ReadVolume");
+	return std::make_shared<RaymarchVolume>(density, trans);
+}
+
+void GpuHypertexture::CompareRaymarch(const Camera& camera, const vec3& sundir,
+	const Color& sunColor)
+{
+	std::shared_ptr<RaymarchVolume> volume = ReadVolume();
+	if(!volume) return;
+	const int width = g_screen.m_width, height = g_screen.m_height;
+	Framebuffer target(width, height);
+	target.AddTexture(GL_RGBA32F, GL_RGBA, GL_FLOAT);
+	target.Create();
+
+	// the CPU march doesn't jitter
+	const int jitterFrame = g_rayJitterFrame;
+	g_rayJitterFrame = -1;
+	Timer gpuTimer;
+	target.Bind();
+	glViewport(0, 0, width, height);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glFinish();
+	gpuTimer.Start();
+	Render(camera, sundir, sunColor);
+	glFinish();
+	gpuTimer.Stop();
+	g_rayJitterFrame = jitterFrame;
+
+	auto gpuPixels = std::make_shared<std::vector<float>>(size_t(width) * height * 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, &(*gpuPixels)[0]);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	checkGlError("GpuHypertexture::CompareRaymarch");
+
+	const float gpuTime = gpuTimer.GetTime();
+	auto cpuTimer = std::make_shared<Timer>();
+	cpuTimer->Start();
+	raymarch_RenderAsync(GetRaymarchParams(sundir, sunColor), camera, volume, width, height,
+		[gpuPixels, gpuTime, cpuTimer](const std::shared_ptr<RaymarchImage>& image) {
+			cpuTimer->Stop();
+			float maxError = 0.f;
+			double sumError = 0.0;
+			for(size_t i = 0, size = gpuPixels->size(); i < size; ++i)
+			{
+				const float error = fabsf((*gpuPixels)[i] - image->m_data[i]) * 255.f;
+				maxError = Max(maxError, error);
+				sumError += error;
+			}
+			std::cout << "ray march gpu " << gpuTime * 1000.f << " ms, cpu " << 
+				cpuTimer->GetTime() * 1000.f << " ms, max error " << maxError << "/255, mean " << 
+				sumError / gpuPixels->size() << std::endl;
+		});
+}
+
+void GpuHypertexture::SetModel(const vec3& pos, const vec3& scale)
+{
+	m_model = MakeTranslation(pos) * MakeScale(scale);
+	// the update that's running was keyed with the old model
+	if(!m_ready)
+		m_updateKeyStale = true;
+	++m_version;
+}
+
+bool GpuHypertexture::IsVisible(const Camera& camera) const
+{
+	// same box as g_boxGeom
+	return camera.IsBoxVisible(m_model, vec3(-1.f), vec3(1.f));
 }
 
 void GpuHypertexture::Render(const Camera& camera, const vec3& sundir, const Color& sunColor)
 {
+	if(!m_hasVolume) return;
 	const ShaderInfo* shader = g_htexShader.get();
+	const HypertextureVolume& buffers = *m_front;
 
 	mat4 modelInv = AffineInverse(m_model);
-	mat4 mvp = camera.GetProj() * (camera.GetView() * m_model);
+	mat4 modelView = camera.GetView() * m_model;
+	mat4 mvp = camera.GetProj() * modelView;
 
 	vec3 eyePos = TransformPoint(modelInv, camera.GetPos());
 
@@ -268,12 +1597,13 @@ void GpuHypertexture::Render(const Camera& camera, const vec3& sundir, const Col
 
 	glUseProgram(shader->m_program);
 	glUniformMatrix4fv(mvpLoc, 1, 0, mvp.m);
+	glUniformMatrix4fv(shader->m_uniforms[BIND_ModelView], 1, 0, modelView.m);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, m_fboDensity.GetTexture(0));
+	glBindTexture(GL_TEXTURE_3D, buffers.m_fboDensity.GetTexture(0));
 	glUniform1i(densityMapLoc, 0);
 	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_3D, m_fboTrans.GetTexture(0));
+	glBindTexture(GL_TEXTURE_3D, buffers.m_fboTrans.GetTexture(0));
 	glUniform1i(transMapLoc, 1);
 	glUniform3fv(eyePosInModelLoc, 1, &eyePos.x);
 	glUniform3fv(sundirLoc, 1, &sundir.x);
@@ -283,9 +1613,23 @@ void GpuHypertexture::Render(const Camera& camera, const vec3& sundir, const Col
 	glUniform3fv(colorLoc, 1, &m_color.r);
 	glUniform1f(densityMultLoc, m_densityMult);
 	glUniform3fv(absorptionColorLoc, 1, &m_absorptionColor.r);
+	const QualitySteps steps = quality_GetSteps(m_numCells);
+	glUniform1i(shader->m_custom[HTEXBIND_NumSteps], 
+		g_rayJitterFrame < 0 ? steps.m_raymarch : steps.m_raymarchJittered);
+	BindMaxDensity(buffers, 2, shader->m_custom[HTEXBIND_MaxDensityMap], 
+		shader->m_custom[HTEXBIND_MaxDensityLevels]);
+
+	// the golden ratio steps through the offsets evenly over the frames
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, g_blueNoiseTex);
+	glUniform1i(shader->m_custom[HTEXBIND_JitterMap], 3);
+	glUniform1f(shader->m_custom[HTEXBIND_JitterOffset], g_rayJitterFrame < 0 ? -1.f :
+		float(fmod(g_rayJitterFrame * 0.6180339887, 1.0)));
+	glActiveTexture(GL_TEXTURE0);
 
+	// alpha is accumulated too, so the low resolution target comes out premultiplied
 	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 	glBlendEquation(GL_FUNC_ADD);
 	
 	glEnable(GL_CULL_FACE);
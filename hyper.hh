@@ -2,55 +2,218 @@
 
 #include "render.hh"
 #include "commonmath.hh"
+#include "density.hh"
+#include "quality.hh"
+#include "volcache.hh"
 #include <functional>
+#include <memory>
 
 class Camera;
+class HtvFile;
+class UploadStaging;
+class LightingSweepBuffers;
+class RaymarchParams;
+class RaymarchVolume;
 class vec3;
 
 void hyper_Init();
+// Uniforms the density generation shaders are compiled with, SubmitDensity sets them from the
+// DensityParams of the update.
+enum GenBindType {
+	GENBIND_Time,
+	GENBIND_Radius,
+	GENBIND_InnerRadius,
+	GENBIND_Width,
+};
+const std::vector<CustomShaderAttr>& hyper_GetGenUniforms();
+// Skipping empty space with the max density pyramid when ray marching, on by default
+void hyper_SetEmptySpaceSkipEnabled(bool enabled);
+bool hyper_IsEmptySpaceSkipEnabled();
+// Marching every texel toward the sun with the lighting shader, instead of sweeping slices in
+// order and continuing the depth of the slice before. Slower, kept as a reference. Off by
+// default.
+void hyper_SetMarchedLightingEnabled(bool enabled);
+bool hyper_IsMarchedLightingEnabled();
+// Marching the ground shadow through the density like the lighting reference, instead of
+// looking up how much of the sun makes it through the volume in its transmittance. Off by
+// default.
+void hyper_SetMarchedShadowEnabled(bool enabled);
+bool hyper_IsMarchedShadowEnabled();
+// Width and height of the projection shadow of volumes generated from now on
+void hyper_SetShadowDim(int dim);
+int hyper_GetShadowDim();
+// Offsets where each pixel's ray march starts by blue noise that's different every frame, so
+// the results can be accumulated over frames, and uses the jittered step count of the quality
+// tier. -1 (the default) starts at the box.
+void hyper_SetRayJitter(int frame);
+// Sweeping the transmittance on the worker threads instead of the lighting shader, off by
+// default. Needs the density on the CPU, so it only applies to UpdateCpu.
+void hyper_SetCpuLightingEnabled(bool enabled);
+bool hyper_IsCpuLightingEnabled();
+
+////////////////////////////////////////////////////////////////////////////////
+// Everything generated by an update of a GpuHypertexture. Finished ones are shared with the
+// volume cache.
+class HypertextureVolume
+{
+public:
+	static constexpr int kDefaultShadowDim = 512;
+	// density texels per axis in a cell of the finest max density level
+	static constexpr int kMaxDensityCellSize = 4;
+
+	HypertextureVolume(int numCells, int shadowDim);
+	~HypertextureVolume();
+	// roughly what the textures of a volume take on the GPU
+	static size_t GetMemorySize(int numCells, int shadowDim);
+	size_t GetMemorySize() const { return GetMemorySize(m_numCells, m_shadowDim); }
+	// of all the volumes there are right now
+	static size_t GetTotalMemory();
+	static int GetMaxDensityLevelCount(int numCells);
+
+	int m_numCells;
+	int m_shadowDim;
+	Framebuffer m_fboDensity;
+	Framebuffer m_fboMaxDensity;
+	Framebuffer m_fboTrans;
+	Framebuffer m_fboShadow;
+	mat4 m_matShadow;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 // Gpu rendering of density function
-class GpuHypertexture
+class GpuHypertexture : public std::enable_shared_from_this<GpuHypertexture>
 {
 public:
-	static constexpr int kShadowDim = 512;
 	GpuHypertexture(int numCells, const std::shared_ptr<ShaderInfo>& shader, 
-		const vec3& scale,
+		const vec3& pos, const vec3& scale,
 		const std::shared_ptr<ShaderParams>& params = nullptr);
+	// gives the volumes back to the volume cache to be reused
+	~GpuHypertexture();
 
+	// Also writes where the volume is seen in each pixel to the second color attachment if
+	// there is one, as the view distance premultiplied by alpha like the color.
 	void Render(const Camera& camera, const vec3& sundir, const Color& sunColor);
+	// true if any of the box is in the camera's frustum
+	bool IsVisible(const Camera& camera) const;
 
-	void Update(const vec3& sundir);
+	// Regenerates the density with m_shader. If params has one of the known density types, the
+	// bricks are classified on the worker threads first and only the mixed ones are shaded.
+	// Updates go into a back buffer a few slices per frame, and Render keeps drawing the last
+	// finished volume until it's swapped in. Requests made while busy are coalesced, the latest
+	// one wins. Volumes generated before with the same inputs are taken from the volume cache
+	// instead.
+	void Update(const vec3& sundir, const DensityParams& params);
+	// Generates the density on the worker threads instead of running m_shader, then uploads it
+	// and recomputes the lighting the same way as Update. With CPU lighting the transmittance
+	// is swept on the worker threads too, and the density is kept so that changing only the
+	// lighting doesn't generate it again.
+	void UpdateCpu(const vec3& sundir, const DensityParams& params);
+	// true until the last update requested has been swapped in
+	bool IsUpdating() const { return !m_ready || m_pending; }
 
 	float GetAbsorption() const { return m_absorption; }
-	void SetAbsorption(float a) { m_absorption = a; }
+	void SetAbsorption(float a) { m_absorption = a; ++m_version; }
 	float GetPhaseConstant() const { return m_g; }
-	void SetPhaseConstant(float g) { m_g = g; UpdatePhaseConstants(); }
+	void SetPhaseConstant(float g) { m_g = g; UpdatePhaseConstants(); ++m_version; }
 	const Color& GetColor() const { return m_color; }
-	void SetColor(const Color& c) { m_color = c; }
+	void SetColor(const Color& c) { m_color = c; ++m_version; }
 	float GetDensityMultiplier() const { return m_densityMult; }
-	void SetDensityMultiplier(float f) { m_densityMult = f; }
+	void SetDensityMultiplier(float f) { m_densityMult = f; ++m_version; }
 	const Color& GetScatteringColor() const { return m_scatteringColor; }
-	void SetScatteringColor(const Color& c) { m_scatteringColor= c; }
+	void SetScatteringColor(const Color& c) { m_scatteringColor= c; ++m_version; }
 	const Color& GetAbsorptionColor() const { return m_absorptionColor; }
-	void SetAbsorptionColor(const Color& c) { m_absorptionColor = c; }
+	void SetAbsorptionColor(const Color& c) { m_absorptionColor = c; ++m_version; }
+	// changes whenever what Render draws does, other than from the camera moving
+	unsigned int GetVersion() const { return m_version; }
 
-	GLuint GetShadowTexture() const { return m_fboShadow.GetTexture(0); }
+	GLuint GetShadowTexture() const { return m_front ? m_front->m_fboShadow.GetTexture(0) : 0; }
 	const mat4& GetModel() const { return m_model; }
-	const mat4& GetShadowMatrix() const { return m_matShadow; }
+	// Moves the box. The shadow depends on where it is, so it needs an Update after.
+	void SetModel(const vec3& pos, const vec3& scale);
+	mat4 GetShadowMatrix() const 
+		{ return m_front ? m_front->m_matShadow : mat4(mat4::identity_t()); }
+	// GPU memory of the volumes and buffers this has, including ones shared with the cache
+	size_t GetMemoryUsed() const;
+
+	// Recomputes the transmittance of the current volume both by sweeping and by marching,
+	// and prints the largest difference and the time each took. Stalls, for debugging.
+	void CompareLighting(const vec3& sundir);
+	// What Render marches the current volume with, for raymarch.cpp.
+	RaymarchParams GetRaymarchParams(const vec3& sundir, const Color& sunColor) const;
+	// Reads the density and transmittance of the current volume back from the GPU, or returns
+	// null if there's none yet.
+	std::shared_ptr<RaymarchVolume> ReadVolume() const;
+	// Draws the current volume with Render into a float target the size of the screen, and
+	// marches it on the worker threads with raymarch.cpp. Prints the largest difference and the
+	// time each took once the CPU one is done. For debugging.
+	void CompareRaymarch(const Camera& camera, const vec3& sundir, const Color& sunColor);
 private:
+	// fills layers [zBegin, zEnd) of one of the back buffers
+	typedef std::function<void(GpuHypertexture&, int zBegin, int zEnd)> FillLayersFunc;
+
 	void UpdatePhaseConstants();
+	void SetPending(const vec3& sundir, const DensityParams& params, bool cpu);
+	// Makes m_updateKey and m_updateSteps for a new update. Returns true if there's nothing to
+	// generate, because the volume was cached in memory and swapped in or it's being loaded
+	// from the disk cache.
+	bool BeginUpdate(const vec3& sundir, const DensityParams& params, bool cpu);
+	// queues submit to run on its own frame, if this is still around by then
+	void AppendTask(std::function<void(GpuHypertexture&)> submit);
+	// Without fillTrans the transmittance is computed with the lighting shader.
+	void AppendUpdateTasks(const vec3& sundir, FillLayersFunc fillDensity, 
+		FillLayersFunc fillTrans = nullptr);
+	// false if there's no staging buffer to decode into, the volume has to be generated then
+	bool LoadFile(const std::shared_ptr<HtvFile>& file, const vec3& sundir,
+		const DensityParams& params, bool cpu);
+	void AppendLoadTasks(const std::shared_ptr<HtvFile>& file, 
+		const std::shared_ptr<UploadStaging>& staging);
+	void SubmitGpuUpdate(const vec3& sundir, const DensityParams& params,
+		const std::shared_ptr<DensityBricks>& bricks);
+	void SubmitDensity(const DensityParams& params, const DensityBricks* bricks,
+		int zBegin, int zEnd);
+	void UploadDensity(const DensityVolume& volume, int zBegin, int zEnd);
+	void SubmitMaxDensity();
+	void BindMaxDensity(const HypertextureVolume& volume, int unit, GLint mapLoc, 
+		GLint levelsLoc) const;
+	void SubmitShadow(const vec3& sundir, int numSteps);
+	// marches the transmittance of volume into layers [zBegin, zEnd) of trans
+	void SubmitLighting(const HypertextureVolume& volume, const Framebuffer& trans,
+		const vec3& sundir, int numSteps, int zBegin, int zEnd);
+	// sweeps slices [sweepBegin, sweepEnd) of volume into buffers, in the order they're swept
+	void SubmitLightingSweep(const HypertextureVolume& volume, LightingSweepBuffers& buffers,
+		const vec3& sundir, int sweepBegin, int sweepEnd);
+	// turns the swept depths into layers [zBegin, zEnd) of trans
+	void SubmitLightingResolve(const LightingSweepBuffers& buffers, const Framebuffer& trans,
+		const vec3& sundir, int zBegin, int zEnd);
+	void OnCpuDensityComplete(const vec3& sundir, const std::shared_ptr<DensityVolume>& volume,
+		bool lit);
+	// the sweep waits for the tasks in after, which fill volume
+	void ComputeCpuLighting(const vec3& sundir, const std::shared_ptr<DensityVolume>& volume,
+		const std::vector<std::shared_ptr<Task>>& after = std::vector<std::shared_ptr<Task>>());
+	void OnUpdateComplete();
 
 	int m_numCells;
 	std::shared_ptr<ShaderInfo> m_shader;
 	std::shared_ptr<ShaderParams> m_genParams;
 	bool m_ready;
-	Framebuffer m_fboDensity;
-	Framebuffer m_fboTrans;
-	Framebuffer m_fboShadow;
+	bool m_pending;
+	bool m_pendingCpu;
+	vec3 m_pendingSundir;
+	DensityParams m_pendingParams;
+	int m_numMaxDensityLevels;
+	std::shared_ptr<HypertextureVolume> m_front; // what Render draws, made by the first update
+	std::shared_ptr<HypertextureVolume> m_back; // what updates write to, made when needed
+	bool m_hasVolume; // false until the first update is swapped in
+	VolumeKey m_updateKey; // of the volume being written to m_back
+	VolumeKey m_updateDensityKey; // just the part of m_updateKey the density depends on
+	QualitySteps m_updateSteps;
+	bool m_updateFromDisk; // loaded from the disk cache, so there's no need to save it
+	bool m_updateKeyStale; // moved since the update started, it's not cached
+	std::shared_ptr<LightingSweepBuffers> m_sweepBuffers; // made by the first sweep
+	std::shared_ptr<DensityVolume> m_cpuDensity; // the last one generated, for CPU lighting
+	VolumeKey m_cpuDensityKey;
 	mat4 m_model;
-	mat4 m_matShadow;
+	unsigned int m_version;
 
 	float m_absorption;
 	float m_g; // phase constant
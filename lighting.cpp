@@ -0,0 +1,246 @@
+#include "lighting.hh"
+#include "density.hh"
+#include "task.hh"
+#include <atomic>
+#include <thread>
+#include <cmath>
+
+////////////////////////////////////////////////////////////////////////////////
+constexpr float LightingSweepAxes::kTexelOffsets[];
+static constexpr const float* kTexelOffsets = LightingSweepAxes::kTexelOffsets;
+
+LightingSweepAxes::LightingSweepAxes(const vec3& sundir, int numCells)
+	: m_numCells(numCells)
+{
+	const float absDir[] = { fabsf(sundir.x), fabsf(sundir.y), fabsf(sundir.z) };
+	m_sliceAxis = absDir[0] >= absDir[1] ? (absDir[0] >= absDir[2] ? 0 : 2) :
+		(absDir[1] >= absDir[2] ? 1 : 2);
+	m_texelAxis = m_sliceAxis == 0 ? 1 : 0;
+	m_rowAxis = m_sliceAxis == 2 ? 1 : 2;
+
+	const float* d = &sundir.x;
+	const float slope = absDir[m_sliceAxis];
+	m_sliceDir = d[m_sliceAxis] > 0.f ? 1 : -1;
+	m_shiftTexel = d[m_texelAxis] / slope;
+	m_shiftRow = d[m_rowAxis] / slope;
+	m_sliceLength = 1.f / (numCells * slope);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Rows of a slice only depend on the rows of the previous slice within one row of theirs, so
+// they can run in parallel. Rows are claimed in sweep order and only wait on rows claimed before them, which
+// means any number of threads can run the sweep at once without deadlocking. Only the last
+// three slices of depths are kept.
+class LightingSweep
+{
+public:
+	LightingSweep(const LightingParams& params, const DensityVolume& density,
+		TransmittanceVolume& trans);
+	// claims and computes rows until there are none left
+	void Run();
+private:
+	static constexpr int kNumRingSlices = 3;
+	void ComputeRow(int sweepSlice, int row);
+	float SampleDensity(int x, int y, int z) const;
+
+	const DensityVolume& m_density;
+	TransmittanceVolume& m_trans;
+	int m_numCells;
+	LightingSweepAxes m_axes;
+	float m_extinction[3]; // per channel, scaled depth to optical depth
+
+	std::atomic<int> m_nextRow;
+	std::vector<std::atomic<int>> m_rowDone; // per sweep row
+	std::vector<std::atomic<int>> m_sliceRowsDone; // per sweep slice
+	std::vector<float> m_depth; // kNumRingSlices slices of depth through the density
+	std::vector<float> m_rho; // density at the texels, same layout
+};
+
+LightingSweep::LightingSweep(const LightingParams& params, const DensityVolume& density,
+	TransmittanceVolume& trans)
+	: m_density(density)
+	, m_trans(trans)
+	, m_numCells(density.m_numCells)
+	, m_axes(params.m_sundir, density.m_numCells)
+	, m_nextRow(0)
+	, m_rowDone(size_t(m_numCells) * m_numCells)
+	, m_sliceRowsDone(m_numCells)
+	, m_depth(size_t(kNumRingSlices) * m_numCells * m_numCells)
+	, m_rho(size_t(kNumRingSlices) * m_numCells * m_numCells)
+{
+	const float* scattering = &params.m_scatteringColor.r;
+	for(int i = 0; i < 3; ++i)
+		m_extinction[i] = -params.m_absorption * params.m_densityMult * scattering[i];
+
+	for(auto& done : m_rowDone) done.store(0);
+	for(auto& done : m_sliceRowsDone) done.store(0);
+}
+
+// What linear filtering returns at a texel of the transmittance, which is between two layers
+// of density along z.
+float LightingSweep::SampleDensity(int x, int y, int z) const
+{
+	const unsigned char* layer = m_density.GetSlice(z) + y * m_numCells + x;
+	if(z == 0)
+		return layer[0] * (1.f / 255.f);
+	const unsigned char* below = layer - m_numCells * m_numCells;
+	return (layer[0] + below[0]) * (0.5f / 255.f);
+}
+
+// How far the ray from texel index pos moving shift per slice gets before leaving the volume
+// along one axis, in slices.
+static float ExitFraction(float pos, float shift, float offset, int numCells)
+{
+	if(shift > 0.f) return (numCells - offset - pos) / shift;
+	if(shift < 0.f) return (-offset - pos) / shift;
+	return 1e6f;
+}
+
+// Bilinear filtering of a slice with clamping to the edge, like the textures.
+static float Lerp2(const float* slice, int numCells, float u, float v)
+{
+	u = Clamp(u, 0.f, float(numCells - 1));
+	v = Clamp(v, 0.f, float(numCells - 1));
+	const int u0 = Min(int(u), Max(numCells - 2, 0));
+	const int v0 = Min(int(v), Max(numCells - 2, 0));
+	const int u1 = Min(u0 + 1, numCells - 1);
+	const int v1 = Min(v0 + 1, numCells - 1);
+	const float fu = u - u0, fv = v - v0;
+	const float* row0 = slice + v0 * numCells;
+	const float* row1 = slice + v1 * numCells;
+	return (row0[u0] * (1.f - fu) + row0[u1] * fu) * (1.f - fv) +
+		(row1[u0] * (1.f - fu) + row1[u1] * fu) * fv;
+}
+
+// Between the outermost texels and the face of the volume the ray leaves through, the depth
+// goes down to 0 at the face instead of staying the same.
+static float EdgeFalloff(float pos, float shift, float offset, int numCells)
+{
+	if(shift > 0.f && pos > numCells - 1)
+		return (numCells - offset - pos) / (1.f - offset);
+	if(shift < 0.f && pos < 0.f)
+		return (pos + offset) / offset;
+	return 1.f;
+}
+
+void LightingSweep::ComputeRow(int sweepSlice, int row)
+{
+	const int n = m_numCells;
+	const size_t sliceSize = size_t(n) * n;
+	const LightingSweepAxes& axes = m_axes;
+	const int slice = axes.GetSlice(sweepSlice);
+	float* depth = &m_depth[(sweepSlice % kNumRingSlices) * sliceSize];
+	float* rho = &m_rho[(sweepSlice % kNumRingSlices) * sliceSize];
+	const float* prevDepth = &m_depth[((sweepSlice + kNumRingSlices - 1) % kNumRingSlices) * sliceSize];
+	const float* prevRho = &m_rho[((sweepSlice + kNumRingSlices - 1) % kNumRingSlices) * sliceSize];
+
+	const float rowExit = ExitFraction(row, axes.m_shiftRow, kTexelOffsets[axes.m_rowAxis], n);
+	const float sliceOffset = kTexelOffsets[axes.m_sliceAxis];
+	const float sliceExit = sweepSlice > 0 ? 1.f :
+		(axes.m_sliceDir > 0 ? n - sliceOffset - slice : slice + sliceOffset);
+
+	int coord[3];
+	coord[axes.m_sliceAxis] = slice;
+	coord[axes.m_rowAxis] = row;
+	for(int i = 0; i < n; ++i)
+	{
+		coord[axes.m_texelAxis] = i;
+		const float r = SampleDensity(coord[0], coord[1], coord[2]);
+		const float exit = Min(Min(rowExit, sliceExit),
+			ExitFraction(i, axes.m_shiftTexel, kTexelOffsets[axes.m_texelAxis], n));
+
+		float d;
+		if(sweepSlice == 0 || exit < 1.f)
+		{
+			// leaves the volume before the previous slice, take the density as constant until then
+			d = exit * axes.m_sliceLength * r;
+		}
+		else
+		{
+			// trapezoid from here to where the ray crosses the previous slice, plus its depth
+			const float u = i + axes.m_shiftTexel, v = row + axes.m_shiftRow;
+			const float prevR = Lerp2(prevRho, n, u, v);
+			const float prevD = Lerp2(prevDepth, n, u, v) *
+				EdgeFalloff(u, axes.m_shiftTexel, kTexelOffsets[axes.m_texelAxis], n) *
+				EdgeFalloff(v, axes.m_shiftRow, kTexelOffsets[axes.m_rowAxis], n);
+			d = prevD + 0.5f * axes.m_sliceLength * (r + prevR);
+		}
+		rho[row * n + i] = r;
+		depth[row * n + i] = d;
+
+		unsigned char* out = &m_trans.m_data[(((size_t(coord[2]) * n) + coord[1]) * n +
+			coord[0]) * 3];
+		for(int c = 0; c < 3; ++c)
+			out[c] = int(expf(m_extinction[c] * d) * 255.f + 0.5f);
+	}
+}
+
+void LightingSweep::Run()
+{
+	const int n = m_numCells;
+	const int numRows = n * n;
+	for(;;)
+	{
+		const int index = m_nextRow++;
+		if(index >= numRows)
+			return;
+		const int sweepSlice = index / n;
+		const int row = index % n;
+
+		if(sweepSlice > 0)
+		{
+			// the previous slice's rows this one interpolates between
+			const int prev = index - n;
+			for(int r = Max(0, row - 1), rEnd = Min(n - 1, row + 1); r <= rEnd; ++r)
+				while(!m_rowDone[prev - row + r].load(std::memory_order_acquire))
+					std::this_thread::yield();
+		}
+		if(sweepSlice >= kNumRingSlices - 1)
+		{
+			// the ring slot is about to be reused, everything reading the old one has to be done
+			const std::atomic<int>& done = m_sliceRowsDone[sweepSlice - (kNumRingSlices - 1)];
+			while(done.load(std::memory_order_acquire) < n)
+				std::this_thread::yield();
+		}
+
+		ComputeRow(sweepSlice, row);
+		m_rowDone[index].store(1, std::memory_order_release);
+		m_sliceRowsDone[sweepSlice].fetch_add(1, std::memory_order_release);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void lighting_Compute(const LightingParams& params, const DensityVolume& density,
+	TransmittanceVolume& trans)
+{
+	LightingSweep sweep(params, density, trans);
+	sweep.Run();
+}
+
+void lighting_ComputeAsync(const LightingParams& params,
+	const std::shared_ptr<const DensityVolume>& density,
+	std::function<void(const std::shared_ptr<TransmittanceVolume>&)> onComplete,
+	const std::vector<std::shared_ptr<Task>>& after)
+{
+	// the tasks only share the sweep, whichever of them start first do most of the work
+	constexpr int kMaxTasks = 8;
+	const int numTasks = Min(kMaxTasks, density->m_numCells);
+	auto trans = std::make_shared<TransmittanceVolume>(density->m_numCells);
+	auto sweep = std::make_shared<LightingSweep>(params, *density, *trans);
+	std::vector<std::shared_ptr<Task>> tasks;
+	tasks.reserve(numTasks);
+	for(int i = 0; i < numTasks; ++i)
+	{
+		// the sweep only references the density, the task keeps it alive
+		tasks.push_back(std::make_shared<Task>([sweep, density]() {
+			sweep->Run();
+		}));
+		for(auto& prev: after)
+			task_AddDependency(tasks.back(), prev);
+		task_AppendTask(tasks.back());
+	}
+	task_AppendContinuation(tasks, nullptr, [trans, onComplete]() {
+		if(onComplete)
+			onComplete(trans);
+	});
+}
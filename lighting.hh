@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include "vec.hh"
+#include "commonmath.hh"
+
+class DensityVolume;
+class Task;
+
+// CPU version of shaders/computelighting.glsl, the transmittance from every cell toward the
+// sun. Instead of marching each cell separately, slices are swept in order starting from the
+// sun side of the volume, and each cell continues the optical depth of the slice before it
+// where the ray toward the sun crosses that slice. That's O(N^3) instead of O(N^3 x steps).
+class LightingParams
+{
+public:
+	vec3 m_sundir; // normalized, pointing toward the sun
+	float m_absorption;
+	float m_densityMult;
+	Color m_scatteringColor;
+};
+
+// How slices are swept for a sun direction, shared with the GPU version in hyper.cpp. Slices
+// go along the axis sundir is most aligned with, starting at the sun side. Within a slice,
+// texels go along m_texelAxis and rows along m_rowAxis. The transmittance texels sit where
+// the lighting shader evaluates them: cell centers along x and y, but z layers start at the
+// face, since the lighting quads are drawn at z / numCells.
+class LightingSweepAxes
+{
+public:
+	static constexpr float kTexelOffsets[] = { 0.5f, 0.5f, 0.f };
+
+	LightingSweepAxes(const vec3& sundir, int numCells);
+	// the index along m_sliceAxis of the slice swept sweepSlice'th
+	int GetSlice(int sweepSlice) const 
+		{ return m_sliceDir > 0 ? m_numCells - 1 - sweepSlice : sweepSlice; }
+
+	int m_numCells;
+	int m_sliceAxis;
+	int m_texelAxis;
+	int m_rowAxis;
+	int m_sliceDir; // +1 if the sun is toward the higher slices
+	float m_shiftTexel; // where the ray toward the sun crosses the previous slice, in texels
+	float m_shiftRow;
+	float m_sliceLength; // distance along the ray between slices, in texture space
+};
+
+// numCells^3 RGB8 texels, laid out like the transmittance texture.
+class TransmittanceVolume
+{
+public:
+	TransmittanceVolume(int numCells)
+		: m_numCells(numCells), m_data(size_t(numCells) * numCells * numCells * 3) {}
+	const unsigned char* GetSlice(int z) const { return &m_data[size_t(z) * m_numCells * m_numCells * 3]; }
+
+	int m_numCells;
+	std::vector<unsigned char> m_data;
+};
+
+// Sweeps the whole volume on the calling thread.
+void lighting_Compute(const LightingParams& params, const DensityVolume& density,
+	TransmittanceVolume& trans);
+// Sweeps on the worker threads, rows of a slice are done in parallel. onComplete is called
+// from task_Update on the main thread. The sweep waits for the tasks in after, so density only
+// has to be filled once they've run.
+void lighting_ComputeAsync(const LightingParams& params,
+	const std::shared_ptr<const DensityVolume>& density,
+	std::function<void(const std::shared_ptr<TransmittanceVolume>&)> onComplete,
+	const std::vector<std::shared_ptr<Task>>& after = std::vector<std::shared_ptr<Task>>());
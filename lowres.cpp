@@ -0,0 +1,275 @@
+#include "lowres.hh"
+#include "render.hh"
+#include "matrix.hh"
+#include "commonmath.hh"
+#include "camera.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+static std::shared_ptr<ShaderInfo> g_depthDownsampleShader;
+
+enum DepthDownsampleUniformLocType {
+	DDBIND_DepthMap,
+	DDBIND_TargetSize,
+};
+
+static std::vector<CustomShaderAttr> g_depthDownsampleUniforms =
+{
+	{ DDBIND_DepthMap, "depthMap" },
+	{ DDBIND_TargetSize, "targetSize" },
+};
+
+static std::shared_ptr<ShaderInfo> g_upsampleShader;
+
+enum UpsampleUniformLocType {
+	UPBIND_ColorMap,
+	UPBIND_LowDepthMap,
+	UPBIND_DepthMap,
+	UPBIND_DepthParams,
+};
+
+static std::vector<CustomShaderAttr> g_upsampleUniforms =
+{
+	{ UPBIND_ColorMap, "colorMap" },
+	{ UPBIND_LowDepthMap, "lowDepthMap" },
+	{ UPBIND_DepthMap, "depthMap" },
+	{ UPBIND_DepthParams, "depthParams" },
+};
+
+static std::shared_ptr<ShaderInfo> g_temporalShader;
+
+enum TemporalUniformLocType {
+	TPBIND_ColorMap,
+	TPBIND_DistanceMap,
+	TPBIND_HistoryMap,
+	TPBIND_Reproject,
+	TPBIND_ProjScale,
+	TPBIND_HistoryWeight,
+};
+
+static std::vector<CustomShaderAttr> g_temporalUniforms =
+{
+	{ TPBIND_ColorMap, "colorMap" },
+	{ TPBIND_DistanceMap, "distanceMap" },
+	{ TPBIND_HistoryMap, "historyMap" },
+	{ TPBIND_Reproject, "reproject" },
+	{ TPBIND_ProjScale, "projScale" },
+	{ TPBIND_HistoryWeight, "historyWeight" },
+};
+
+// how much of the history is kept each frame
+static constexpr float kHistoryWeight = 0.9f;
+
+static float g_scale = 1.f;
+static bool g_temporalEnabled = false;
+static std::shared_ptr<Framebuffer> g_fboDepth; // full resolution
+// reduced resolution color, distance and depth
+static std::shared_ptr<Framebuffer> g_fboVolumes;
+// accumulated color, one is read while the other is written
+static std::shared_ptr<Framebuffer> g_fboHistory[2];
+static int g_curHistory;
+static bool g_historyValid;
+static mat4 g_prevViewProj;
+static int g_oldFramebuffer;
+static int g_oldViewport[4];
+static GLboolean g_oldScissor;
+
+////////////////////////////////////////////////////////////////////////////////
+void lowres_Init()
+{
+	if(!g_depthDownsampleShader)
+		g_depthDownsampleShader = render_CompileShader("shaders/depthdownsample.glsl", 
+			g_depthDownsampleUniforms);
+	if(!g_upsampleShader)
+		g_upsampleShader = render_CompileShader("shaders/upsample.glsl", g_upsampleUniforms);
+	if(!g_temporalShader)
+		g_temporalShader = render_CompileShader("shaders/temporal.glsl", g_temporalUniforms);
+}
+
+void lowres_SetScale(float scale)
+{
+	g_scale = Clamp(scale, 0.25f, 1.f);
+}
+
+float lowres_GetScale()
+{
+	return g_scale;
+}
+
+void lowres_SetTemporalEnabled(bool enabled)
+{
+	g_temporalEnabled = enabled;
+	g_historyValid = false;
+}
+
+bool lowres_IsTemporalEnabled()
+{
+	return g_temporalEnabled;
+}
+
+void lowres_ResetHistory()
+{
+	g_historyValid = false;
+}
+
+bool lowres_IsEnabled()
+{
+	return g_scale < 1.f || g_temporalEnabled;
+}
+
+static void DrawFullscreenQuad(const ShaderInfo& shader)
+{
+	GLint posLoc = shader.m_attrs[GEOM_Pos];
+	glBegin(GL_TRIANGLE_STRIP);
+	glVertexAttrib3f(posLoc, -1.f, -1.f, 0.f);
+	glVertexAttrib3f(posLoc, 1.f, -1.f, 0.f);
+	glVertexAttrib3f(posLoc, -1.f, 1.f, 0.f);
+	glVertexAttrib3f(posLoc, 1.f, 1.f, 0.f);
+	glEnd();
+}
+
+// Remakes the targets when the screen or the scale changes
+static void UpdateTargets(int width, int height)
+{
+	if(!g_fboDepth || g_fboDepth->GetWidth() != width || g_fboDepth->GetHeight() != height)
+	{
+		g_fboDepth = std::make_shared<Framebuffer>(width, height);
+		g_fboDepth->AddDepthTexture();
+		g_fboDepth->Create();
+	}
+
+	const int lowWidth = Max(1, int(width * g_scale + 0.5f));
+	const int lowHeight = Max(1, int(height * g_scale + 0.5f));
+	if(!g_fboVolumes || g_fboVolumes->GetWidth() != lowWidth || 
+		g_fboVolumes->GetHeight() != lowHeight)
+	{
+		g_fboVolumes = std::make_shared<Framebuffer>(lowWidth, lowHeight);
+		g_fboVolumes->AddTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+		g_fboVolumes->AddTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+		g_fboVolumes->AddDepthTexture();
+		g_fboVolumes->Create();
+		g_fboHistory[0] = nullptr;
+		g_fboHistory[1] = nullptr;
+	}
+
+	if(g_temporalEnabled && !g_fboHistory[0])
+	{
+		for(auto& fbo : g_fboHistory)
+		{
+			fbo = std::make_shared<Framebuffer>(lowWidth, lowHeight);
+			fbo->AddTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+			fbo->Create();
+		}
+		g_historyValid = false;
+	}
+}
+
+void lowres_Begin(int width, int height, const std::function<void()>& drawDepth)
+{
+	// before the targets are made, that binds them
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &g_oldFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, g_oldViewport);
+	g_oldScissor = glIsEnabled(GL_SCISSOR_TEST);
+	UpdateTargets(width, height);
+
+	// the scene's depth at full resolution
+	g_fboDepth->Bind();
+	glViewport(0, 0, width, height);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	drawDepth();
+
+	// and point sampled down to the volume target
+	const int lowWidth = g_fboVolumes->GetWidth();
+	const int lowHeight = g_fboVolumes->GetHeight();
+	g_fboVolumes->Bind();
+	glViewport(0, 0, lowWidth, lowHeight);
+	glDisable(GL_SCISSOR_TEST);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	const ShaderInfo* shader = g_depthDownsampleShader.get();
+	glUseProgram(shader->m_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, g_fboDepth->GetDepthTexture());
+	glUniform1i(shader->m_custom[DDBIND_DepthMap], 0);
+	glUniform2f(shader->m_custom[DDBIND_TargetSize], lowWidth, lowHeight);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthFunc(GL_ALWAYS);
+	DrawFullscreenQuad(*shader);
+	glDepthFunc(GL_LESS);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	// the upsample needs the depth of what's behind the volumes, not their boxes
+	glDepthMask(GL_FALSE);
+	checkGlError("lowres_Begin");
+}
+
+// Blends this frame's volumes with the history reprojected into it, and returns the texture
+// with the result.
+static GLuint ResolveTemporal(const Camera& camera)
+{
+	const Framebuffer& history = *g_fboHistory[g_curHistory];
+	const Framebuffer& target = *g_fboHistory[1 - g_curHistory];
+	const mat4& proj = camera.GetProj();
+	const mat4 viewProj = proj * camera.GetView();
+	const mat4 reproject = g_prevViewProj * AffineInverse(camera.GetView());
+
+	target.Bind();
+	const ShaderInfo* shader = g_temporalShader.get();
+	glUseProgram(shader->m_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, g_fboVolumes->GetTexture(0));
+	glUniform1i(shader->m_custom[TPBIND_ColorMap], 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, g_fboVolumes->GetTexture(1));
+	glUniform1i(shader->m_custom[TPBIND_DistanceMap], 1);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, history.GetTexture(0));
+	glUniform1i(shader->m_custom[TPBIND_HistoryMap], 2);
+	glUniformMatrix4fv(shader->m_custom[TPBIND_Reproject], 1, 0, reproject.m);
+	glUniform2f(shader->m_custom[TPBIND_ProjScale], 1.f / proj.m[0], 1.f / proj.m[5]);
+	glUniform1f(shader->m_custom[TPBIND_HistoryWeight], g_historyValid ? kHistoryWeight : 0.f);
+	DrawFullscreenQuad(*shader);
+	glActiveTexture(GL_TEXTURE0);
+
+	g_curHistory = 1 - g_curHistory;
+	g_historyValid = true;
+	g_prevViewProj = viewProj;
+	return target.GetTexture(0);
+}
+
+void lowres_End(const Camera& camera)
+{
+	glDepthMask(GL_TRUE);
+	glDisable(GL_DEPTH_TEST);
+	const GLuint colorTex = g_temporalEnabled ? ResolveTemporal(camera) : 
+		g_fboVolumes->GetTexture(0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, g_oldFramebuffer);
+	glViewport(g_oldViewport[0], g_oldViewport[1], g_oldViewport[2], g_oldViewport[3]);
+	if(g_oldScissor)
+		glEnable(GL_SCISSOR_TEST);
+
+	const mat4& proj = camera.GetProj();
+	const ShaderInfo* shader = g_upsampleShader.get();
+	glUseProgram(shader->m_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, colorTex);
+	glUniform1i(shader->m_custom[UPBIND_ColorMap], 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, g_fboVolumes->GetDepthTexture());
+	glUniform1i(shader->m_custom[UPBIND_LowDepthMap], 1);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, g_fboDepth->GetDepthTexture());
+	glUniform1i(shader->m_custom[UPBIND_DepthMap], 2);
+	glUniform2f(shader->m_custom[UPBIND_DepthParams], proj.m[10], proj.m[14]);
+
+	// the volumes are premultiplied
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	DrawFullscreenQuad(*shader);
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+
+	glActiveTexture(GL_TEXTURE0);
+	checkGlError("lowres_End");
+}
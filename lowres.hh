@@ -0,0 +1,30 @@
+#pragma once
+
+#include <functional>
+
+class Camera;
+
+// The volumes can be drawn into an offscreen target at a fraction of the screen resolution
+// and upsampled over the rest of the scene. They're low frequency, so this mostly just makes
+// the ray march cheaper. The upsample weights the low resolution texels by how close their
+// depth is to the pixel's so edges of the scene in front of the volumes stay sharp.
+void lowres_Init();
+// fraction of the screen width and height, at 1 the volumes are drawn straight to the screen
+// unless they're accumulated over frames
+void lowres_SetScale(float scale);
+float lowres_GetScale();
+// Accumulating the volumes over frames in a history that's reprojected into each new frame by
+// where the volumes are seen, for use with hyper_SetRayJitter. Turns on the offscreen target
+// even at full resolution. Off by default.
+void lowres_SetTemporalEnabled(bool enabled);
+bool lowres_IsTemporalEnabled();
+// Throws the history away, for when the volumes have changed and it's no good anymore
+void lowres_ResetHistory();
+// true if the volumes go through the offscreen target
+bool lowres_IsEnabled();
+
+// Binds the target for the volumes. drawDepth should draw the opaque scene, which is only
+// kept as depth for the volumes to be tested against and for the upsample.
+void lowres_Begin(int width, int height, const std::function<void()>& drawDepth);
+// Upsamples everything drawn since lowres_Begin over whatever framebuffer was bound before it.
+void lowres_End(const Camera& camera);
@@ -25,6 +25,11 @@
 #include "gputask.hh"
 #include "timer.hh"
 #include "hyper.hh"
+#include "quality.hh"
+#include "lowres.hh"
+#include "ground.hh"
+#include "capture.hh"
+#include "volcache.hh"
 #include "htexdb.hh"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -63,6 +68,8 @@ static Timer g_frameTimer;
 // dt tracking
 static float g_dt;
 static Clock g_timer;
+static Clock g_frameClock; // unclamped, for the quality governor
+static constexpr float kTimeScrubRate = 60.f; // steps per second of shape time
 
 // lighting
 static Color g_sunColor;
@@ -77,8 +84,12 @@ static bool g_screenshotRequested = false;
 static bool g_recording = false;
 static int g_recordFps = 30;
 static int g_recordCurFrame;
+static int g_recordRequestedFrame; // the frame whose time the volume was last updated to
 static int g_recordFrameCount = 300;
 static Limits<float> g_recordTimeRange;
+// 0 saves TGA files, 1 and 2 stream a CaptureStreamFormat + 1 to g_recordPath
+static int g_recordFormat = 0;
+static std::string g_recordPath = "-";
 
 // demo specific stuff:
 
@@ -89,27 +100,16 @@ static std::shared_ptr<SubmenuMenuItem> g_shapesMenu;
 // list of all hypertextures
 static std::vector<std::shared_ptr<AnimatedHypertexture>> g_htexList;
 
-// geom for the ground (just a plane)
-static std::shared_ptr<Geom> g_groundGeom;
-
-////////////////////////////////////////////////////////////////////////////////
-// Shaders
-static std::shared_ptr<ShaderInfo> g_groundShader;
-
-enum GroundUniformLocType {
-	GRNDBIND_ShadowMatrix,
-	GRNDBIND_ShadowMap,
-};
-
-static std::vector<CustomShaderAttr> g_groundUniforms =
-{
-	{ GRNDBIND_ShadowMatrix, "matShadow" },
-	{ GRNDBIND_ShadowMap, "shadowMap" },
-};
+// draw every shape in the list at its position instead of just the current one
+static bool g_drawAllShapes = false;
+// what's drawn this frame, back to front
+static std::vector<std::shared_ptr<AnimatedHypertexture>> g_visibleHtex;
+static unsigned long long g_historyKey; // of what the accumulated volumes were drawn from
 
 ////////////////////////////////////////////////////////////////////////////////
 // forward decls
 static void record_Start();
+static void scene_SetDrawAll(bool enabled);
 
 ////////////////////////////////////////////////////////////////////////////////
 // tweak vars - these are checked into git
@@ -148,10 +148,73 @@ static std::vector<std::shared_ptr<TweakVarBase>> g_settingsVars = {
 			[](bool enabled) { dbgdraw_SetDepthTestEnabled(int(enabled)); },
 			true),
 
+	std::make_shared<TweakBool>("gen.cpu", 
+			[](){ return htexdb_IsCpuGenEnabled(); },
+			[](bool enabled) { htexdb_SetCpuGenEnabled(enabled); },
+			false),
+	std::make_shared<TweakBool>("render.skipEmpty", 
+			[](){ return hyper_IsEmptySpaceSkipEnabled(); },
+			[](bool enabled) { hyper_SetEmptySpaceSkipEnabled(enabled); },
+			true),
+	std::make_shared<TweakFloat>("render.volumeScale", 
+			[](){ return lowres_GetScale(); },
+			[](float scale) { lowres_SetScale(scale); },
+			1.f, Limits<float>(0.25f, 1.f)),
+	std::make_shared<TweakBool>("render.temporal", 
+			[](){ return lowres_IsTemporalEnabled(); },
+			[](bool enabled) { lowres_SetTemporalEnabled(enabled); },
+			false),
+	std::make_shared<TweakBool>("lighting.march", 
+			[](){ return hyper_IsMarchedLightingEnabled(); },
+			[](bool enabled) { hyper_SetMarchedLightingEnabled(enabled); },
+			false),
+	std::make_shared<TweakBool>("lighting.cpu", 
+			[](){ return hyper_IsCpuLightingEnabled(); },
+			[](bool enabled) { hyper_SetCpuLightingEnabled(enabled); },
+			false),
+	std::make_shared<TweakBool>("shadow.march", 
+			[](){ return hyper_IsMarchedShadowEnabled(); },
+			[](bool enabled) { hyper_SetMarchedShadowEnabled(enabled); },
+			false),
+	std::make_shared<TweakInt>("shadow.dim", 
+			[](){ return hyper_GetShadowDim(); },
+			[](int dim) { hyper_SetShadowDim(dim); },
+			HypertextureVolume::kDefaultShadowDim, Limits<int>(16, 4096)),
+	std::make_shared<TweakBool>("scene.drawAll", 
+			[](){ return g_drawAllShapes; },
+			[](bool enabled) { scene_SetDrawAll(enabled); },
+			false),
+	std::make_shared<TweakBool>("quality.auto", 
+			[](){ return quality_IsAutoEnabled(); },
+			[](bool enabled) { quality_SetAutoEnabled(enabled); },
+			true),
+	std::make_shared<TweakInt>("quality.tier", 
+			[](){ return quality_GetTier(); },
+			[](int tier) { quality_SetTier(tier); },
+			QUALITY_High, Limits<int>(0, QUALITY_NUM - 1)),
+	std::make_shared<TweakFloat>("quality.frameBudget", 
+			[](){ return quality_GetFrameBudget(); },
+			[](float ms) { quality_SetFrameBudget(ms); },
+			16.6f),
+	std::make_shared<TweakInt>("cache.budgetMB", 
+			[](){ return volcache_GetBudget(); },
+			[](int megabytes) { volcache_SetBudget(megabytes); },
+			512, Limits<int>(0, 1 << 16)),
+	std::make_shared<TweakBool>("cache.disk", 
+			[](){ return volcache_IsDiskEnabled(); },
+			[](bool enabled) { volcache_SetDiskEnabled(enabled); },
+			false),
+	std::make_shared<TweakBool>("cache.diskCompress", 
+			[](){ return volcache_IsDiskCompressEnabled(); },
+			[](bool enabled) { volcache_SetDiskCompressEnabled(enabled); },
+			true),
+
 	std::make_shared<TweakInt>("record.fps", &g_recordFps, 30),
 	std::make_shared<TweakInt>("record.count", &g_recordFrameCount, 300),
 	std::make_shared<TweakFloat>("record.timeStart", &g_recordTimeRange.m_min, 1.0),
 	std::make_shared<TweakFloat>("record.timeEnd", &g_recordTimeRange.m_max, 2.0),
+	std::make_shared<TweakInt>("record.format", &g_recordFormat, 0, Limits<int>(0, 2)),
+	std::make_shared<TweakString>("record.path", &g_recordPath, "-"),
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -187,6 +250,51 @@ static std::shared_ptr<TopMenuItem> MakeMenu()
 	std::vector<std::shared_ptr<MenuItem>> lightingMenu = {
 		std::make_shared<VecSliderMenuItem>("sundir", &g_sundir),
 		std::make_shared<ColorSliderMenuItem>("suncolor", &g_sunColor),
+		std::make_shared<BoolMenuItem>("marched lighting (reference)", 
+			[](){ return hyper_IsMarchedLightingEnabled(); },
+			[](bool enabled) { hyper_SetMarchedLightingEnabled(enabled); }),
+		std::make_shared<BoolMenuItem>("cpu lighting", 
+			[](){ return hyper_IsCpuLightingEnabled(); },
+			[](bool enabled) { hyper_SetCpuLightingEnabled(enabled); }),
+		std::make_shared<BoolMenuItem>("marched shadow (reference)", 
+			[](){ return hyper_IsMarchedShadowEnabled(); },
+			[](bool enabled) { hyper_SetMarchedShadowEnabled(enabled); }),
+		std::make_shared<IntSliderMenuItem>("shadow size", 
+			[](){ return hyper_GetShadowDim(); },
+			[](int dim) { hyper_SetShadowDim(dim); },
+			64, Limits<int>(16, 4096)),
+	};
+	std::vector<std::shared_ptr<MenuItem>> qualityMenu = {
+		std::make_shared<BoolMenuItem>("auto", 
+			[](){ return quality_IsAutoEnabled(); },
+			[](bool enabled) { quality_SetAutoEnabled(enabled); }),
+		std::make_shared<IntSliderMenuItem>("tier", 
+			[](){ return quality_GetTier(); },
+			[](int tier) { quality_SetTier(tier); },
+			1, Limits<int>(0, QUALITY_NUM - 1)),
+		std::make_shared<FloatSliderMenuItem>("frame budget ms", 
+			[](){ return quality_GetFrameBudget(); },
+			[](float ms) { quality_SetFrameBudget(ms); }),
+		std::make_shared<FloatSliderMenuItem>("volume resolution scale", 
+			[](){ return lowres_GetScale(); },
+			[](float scale) { lowres_SetScale(scale); },
+			0.25f, Limits<float>(0.25f, 1.f)),
+		std::make_shared<BoolMenuItem>("accumulate over frames", 
+			[](){ return lowres_IsTemporalEnabled(); },
+			[](bool enabled) { lowres_SetTemporalEnabled(enabled); }),
+	};
+	std::vector<std::shared_ptr<MenuItem>> cacheMenu = {
+		std::make_shared<IntSliderMenuItem>("volume memory budget MB", 
+			[](){ return volcache_GetBudget(); },
+			[](int megabytes) { volcache_SetBudget(megabytes); },
+			64, Limits<int>(0, 1 << 16)),
+		std::make_shared<ButtonMenuItem>("clear volume cache", volcache_Clear),
+		std::make_shared<BoolMenuItem>("disk cache", 
+			[](){ return volcache_IsDiskEnabled(); },
+			[](bool enabled) { volcache_SetDiskEnabled(enabled); }),
+		std::make_shared<BoolMenuItem>("compress disk cache", 
+			[](){ return volcache_IsDiskCompressEnabled(); },
+			[](bool enabled) { volcache_SetDiskCompressEnabled(enabled); }),
 	};
 	std::vector<std::shared_ptr<MenuItem>> debugMenu = {
 		std::make_shared<ButtonMenuItem>("reload shaders", render_RefreshShaders),
@@ -202,11 +310,28 @@ static std::shared_ptr<TopMenuItem> MakeMenu()
 		std::make_shared<BoolMenuItem>("debug depth test", 
 			[](){ return dbgdraw_IsDepthTestEnabled(); },
 			[](bool enabled) { dbgdraw_SetDepthTestEnabled(int(enabled)); }),
+		std::make_shared<BoolMenuItem>("cpu density generation", 
+			[](){ return htexdb_IsCpuGenEnabled(); },
+			[](bool enabled) { htexdb_SetCpuGenEnabled(enabled); }),
+		std::make_shared<BoolMenuItem>("skip empty space", 
+			[](){ return hyper_IsEmptySpaceSkipEnabled(); },
+			[](bool enabled) { hyper_SetEmptySpaceSkipEnabled(enabled); }),
+		std::make_shared<ButtonMenuItem>("compare lighting sweep and march", [](){
+			if(g_curHtex)
+				g_curHtex->m_gpuhtex->CompareLighting(Normalize(g_sundir));
+		}),
+		std::make_shared<ButtonMenuItem>("compare cpu ray march", [](){
+			if(g_curHtex)
+				g_curHtex->m_gpuhtex->CompareRaymarch(*g_curCamera, Normalize(g_sundir),
+					g_sunColor);
+		}),
 	};
 	g_shapesMenu = std::make_shared<SubmenuMenuItem>("shapes");
 	std::vector<std::shared_ptr<MenuItem>> tweakMenu = {
 		std::make_shared<SubmenuMenuItem>("cam", std::move(cameraMenu)),
 		std::make_shared<SubmenuMenuItem>("lighting", std::move(lightingMenu)),
+		std::make_shared<SubmenuMenuItem>("quality", std::move(qualityMenu)),
+		std::make_shared<SubmenuMenuItem>("cache", std::move(cacheMenu)),
 		g_shapesMenu,
 		std::make_shared<SubmenuMenuItem>("debug", std::move(debugMenu)),
 	};
@@ -214,6 +339,7 @@ static std::shared_ptr<TopMenuItem> MakeMenu()
 		std::make_shared<ButtonMenuItem>("take screenshot", [](){ g_screenshotRequested = true; }),
 		std::make_shared<IntSliderMenuItem>("record fps", &g_recordFps),
 		std::make_shared<IntSliderMenuItem>("record frame count", &g_recordFrameCount),
+		std::make_shared<IntSliderMenuItem>("record format", &g_recordFormat, 1, Limits<int>(0, 2)),
 		std::make_shared<FloatSliderMenuItem>("start time", &g_recordTimeRange.m_min),
 		std::make_shared<FloatSliderMenuItem>("end time", &g_recordTimeRange.m_max),
 		std::make_shared<ButtonMenuItem>("start", record_Start),
@@ -229,71 +355,65 @@ static std::shared_ptr<TopMenuItem> MakeMenu()
 static void record_Start()
 {
 	if(g_recording) return;
+	if(g_recordFormat != 0 &&
+		!capture_BeginStream(g_recordPath.c_str(), g_recordFormat - 1, g_recordFps))
+		return;
 
 	g_recordCurFrame = 0;
+	g_recordRequestedFrame = -1;
 	g_dt = 1.f / g_recordFps;
 	g_recording = true;
 }
 
+// The volume updates over several frames, so each recorded frame waits for it to get to that
+// frame's time. Volumes that aren't drawn don't update and aren't waited for.
+static bool record_IsFrameReady()
+{
+	if(!g_curHtex || !g_recordTimeRange.Valid())
+		return true;
+	bool visible = false;
+	for(const auto& htex : g_visibleHtex)
+		visible |= htex == g_curHtex;
+	return !visible || (!g_curHtex->m_updateRequested && !g_curHtex->m_gpuhtex->IsUpdating());
+}
+
 static void record_SaveFrame()
 {
 	ASSERT(g_recording);
 
+	if(capture_IsStreaming())
+	{
+		// stdout may be the stream
+		std::cerr << "Streaming frame " << g_recordCurFrame << std::endl;
+		capture_StreamScreen();
+		return;
+	}
 	mkdir("frames", S_IRUSR | S_IWUSR | S_IXUSR);
 	std::stringstream sstr ;
 	sstr << "frames/frame_" << g_recordCurFrame << ".tga" ;
 	std::cout << "Saving frame " << sstr.str() << std::endl;
-	render_SaveScreen(sstr.str().c_str());
+	capture_SaveScreen(sstr.str().c_str());
 }
 
 static void record_Advance()
 {
 	ASSERT(g_recording);
 
+	const bool streaming = capture_IsStreaming();
 	++g_recordCurFrame;
 	if(g_recordCurFrame >= g_recordFrameCount)
+	{
 		g_recording = false;
-	std::cout << "done." << std::endl;
+		capture_EndStream();
+	}
+	(streaming ? std::cerr : std::cout) << "done." << std::endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 static void drawGround(const vec3& sundir)
 {
-	mat4 projview = g_curCamera->GetProj() * g_curCamera->GetView();
-	mat4 model = MakeTranslation(0,0,-100) * MakeScale(vec3(500));
-	mat4 modelIT = TransposeOfInverse(model);
-	mat4 mvp = projview * model;
-
-	const ShaderInfo* shader = g_groundShader.get();
-	GLint mvpLoc = shader->m_uniforms[BIND_Mvp];
-	GLint modelLoc = shader->m_uniforms[BIND_Model];
-	GLint modelITLoc = shader->m_uniforms[BIND_ModelIT];
-	GLint sundirLoc = shader->m_uniforms[BIND_Sundir];
-	GLint sunColorLoc = shader->m_uniforms[BIND_SunColor];
-	GLint eyePosLoc = shader->m_uniforms[BIND_Eyepos];
-	GLint matShadowLoc = shader->m_custom[GRNDBIND_ShadowMatrix];
-	GLint shadowMapLoc = shader->m_custom[GRNDBIND_ShadowMap];
-
-	glUseProgram(shader->m_program);
-	
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, g_curHtex ? g_curHtex->m_gpuhtex->GetShadowTexture() : 0);
-	glUniform1i(shadowMapLoc, 0);
-	
-	mat4 htexShadowMat = g_curHtex ? g_curHtex->m_gpuhtex->GetShadowMatrix() : (mat4::identity_t());
-	mat4 matShadow = 
-		MakeCoordinateScale(0.5f, 0.5f) *
-		htexShadowMat * model;
-
-	glUniformMatrix4fv(matShadowLoc, 1, 0, matShadow.m);
-	glUniformMatrix4fv(mvpLoc, 1, 0, mvp.m);
-	glUniformMatrix4fv(modelLoc, 1, 0, model.m);
-	glUniformMatrix4fv(modelITLoc, 1, 0, modelIT.m);
-	glUniform3fv(sundirLoc, 1, &sundir.x);
-	glUniform3fv(sunColorLoc, 1, &g_sunColor.r);
-	glUniform3fv(eyePosLoc, 1, &g_curCamera->GetPos().x);
-
-	g_groundGeom->Render(*shader);
+	const GpuHypertexture* shadowCaster = g_curHtex ? g_curHtex->m_gpuhtex.get() : nullptr;
+	ground_Draw(*g_curCamera, sundir, g_sunColor, shadowCaster);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -322,12 +442,19 @@ static void draw(Framedata& frame)
 	// ground render
 	drawGround(normalizedSundir);
 
-	// voxel render
-	if(g_curHtex) 
-		g_curHtex->m_gpuhtex->Render(*g_curCamera, normalizedSundir, g_sunColor);
+	// voxel render, possibly at a lower resolution and upsampled over the ground
+	const bool lowres = lowres_IsEnabled() && !g_visibleHtex.empty();
+	hyper_SetRayJitter(lowres && lowres_IsTemporalEnabled() ? g_frameCount : -1);
+	if(lowres)
+		lowres_Begin(g_screen.m_width, g_screen.m_height, 
+			[&](){ drawGround(normalizedSundir); });
+	for(const auto& htex : g_visibleHtex)
+		htex->m_gpuhtex->Render(*g_curCamera, normalizedSundir, g_sunColor);
+	if(lowres)
+		lowres_End(*g_curCamera);
 
 	// everything below here is feedback for the user, so record the frame if we're recording
-	if(g_recording)
+	if(g_recording && record_IsFrameReady())
 	{
 		record_SaveFrame();
 		record_Advance();
@@ -358,13 +485,45 @@ static void draw(Framedata& frame)
 		const vec3& pos = g_curCamera->GetPos();
 		snprintf(cameraPosStr, sizeof(cameraPosStr) - 1, "eye: %.2f %.2f %.2f", pos.x, pos.y, pos.z);
 		font_Print(g_screen.m_width-180, 40, cameraPosStr, fpsCol, 16.f);
+
+		char qualityStr[64] = {};
+		snprintf(qualityStr, sizeof(qualityStr) - 1, "quality: %s%s", 
+			quality_GetTierName(quality_GetTier()), quality_IsAutoEnabled() ? " (auto)" : "");
+		font_Print(g_screen.m_width-180, 56, qualityStr, fpsCol, 16.f);
+
+		char cacheStr[64] = {};
+		snprintf(cacheStr, sizeof(cacheStr) - 1, "cache: %d vols %d/%d MB %d hits", 
+			volcache_GetCount(), int(volcache_GetMemoryUsed() >> 20), volcache_GetBudget(),
+			volcache_GetHits());
+		font_Print(g_screen.m_width-180, 72, cacheStr, fpsCol, 16.f);
+
+		char memStr[64] = {};
+		snprintf(memStr, sizeof(memStr) - 1, "vram: %d/%d MB, %d MB pooled (%d reused)", 
+			int(volcache_GetResidentMemory() >> 20), volcache_GetBudget(), 
+			int(volcache_GetPooledMemory() >> 20), volcache_GetReuses());
+		font_Print(g_screen.m_width-180, 88, memStr, fpsCol, 16.f);
+
+		char shapesStr[64] = {};
+		snprintf(shapesStr, sizeof(shapesStr) - 1, "shapes: %d/%d drawn", 
+			int(g_visibleHtex.size()), g_drawAllShapes ? int(g_htexList.size()) : 1);
+		font_Print(g_screen.m_width-180, 104, shapesStr, fpsCol, 16.f);
+
+		int y = 120;
+		for(const auto& htex : g_visibleHtex)
+		{
+			char htexStr[64] = {};
+			snprintf(htexStr, sizeof(htexStr) - 1, "  %s: %.1f MB", htex->m_name.c_str(),
+				htex->m_gpuhtex->GetMemoryUsed() / float(1 << 20));
+			font_Print(g_screen.m_width-180, y, htexStr, fpsCol, 16.f);
+			y += 16;
+		}
 	}
 
 	task_RenderProgress();
 	checkGlError("end draw");
 
 	if(g_screenshotRequested) {
-		render_SaveScreen("screenshot.tga");
+		capture_SaveScreen("screenshot.tga");
 		g_screenshotRequested = false;
 	}
 	
@@ -383,17 +542,21 @@ static void createGpuHypertextures()
 		[&g_curHtex]() 
 		{
 			if(g_curHtex) 
-				g_curHtex->Update(Normalize(g_sundir)); 
+				g_curHtex->RequestUpdate(); 
 		}));
 
 	g_shapesMenu->AppendChild(std::make_shared<ButtonMenuItem>("save all",
 		[]() { SaveHtexFile("volumes.txt", g_htexList); }));
 
+	g_shapesMenu->AppendChild(std::make_shared<BoolMenuItem>("draw all", 
+		[](){ return g_drawAllShapes; },
+		[](bool enabled) { scene_SetDrawAll(enabled); }));
+
 	if(!g_htexList.empty())
 	{
 		g_curHtex = g_htexList[0];
 		g_curHtex->Create();
-		g_curHtex->Update(Normalize(g_sundir));
+		g_curHtex->RequestUpdate();
 	}
 
 	for(auto htex: g_htexList)
@@ -402,17 +565,73 @@ static void createGpuHypertextures()
 		htexMenu->InsertChild(0,
 			std::make_shared<ButtonMenuItem>("activate", 
 				[htex, &g_curHtex]() { 
-					if(g_curHtex) {
+					if(g_curHtex && !g_drawAllShapes) {
 						g_curHtex->Destroy();
 					}
 					g_curHtex = htex; 
 					g_curHtex->Create();
-					g_curHtex->Update(Normalize(g_sundir));
+					g_curHtex->RequestUpdate();
 				}));
 		g_shapesMenu->AppendChild(htexMenu);
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////
+static void scene_SetDrawAll(bool enabled)
+{
+	g_drawAllShapes = enabled;
+	// only the current shape is kept around otherwise
+	if(!enabled)
+	{
+		for(const auto& htex : g_htexList)
+			if(htex != g_curHtex)
+				htex->Destroy();
+	}
+}
+
+// Picks the shapes to draw this frame. The ones out of view aren't drawn or updated, they're
+// created and catch up on updates when they come into view.
+static void scene_Update()
+{
+	if(g_drawAllShapes)
+		g_visibleHtex = htexdb_GetVisible(g_htexList, *g_curCamera);
+	else if(g_curHtex)
+		g_visibleHtex = htexdb_GetVisible({g_curHtex}, *g_curCamera);
+	else
+		g_visibleHtex.clear();
+
+	const vec3 sundir = Normalize(g_sundir);
+	for(const auto& htex : g_visibleHtex)
+	{
+		if(!htex->m_gpuhtex)
+		{
+			htex->Create();
+			htex->RequestUpdate();
+		}
+		if(htex->m_updateRequested)
+			htex->Update(sundir);
+	}
+
+	// the volumes accumulated over frames are no good once any of them, the sun or the camera
+	// changes
+	unsigned long long historyKey = MakeHash64(&g_sunColor, sizeof(g_sunColor));
+	historyKey = MakeHash64(&sundir, sizeof(sundir), historyKey);
+	const Camera* camera = g_curCamera.get();
+	historyKey = MakeHash64(&camera, sizeof(camera), historyKey);
+	for(const auto& htex : g_visibleHtex)
+	{
+		const GpuHypertexture* gpuhtex = htex->m_gpuhtex.get();
+		const unsigned int version = gpuhtex->GetVersion();
+		historyKey = MakeHash64(&gpuhtex, sizeof(gpuhtex), historyKey);
+		historyKey = MakeHash64(&version, sizeof(version), historyKey);
+	}
+	if(historyKey != g_historyKey)
+	{
+		g_historyKey = historyKey;
+		lowres_ResetHistory();
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////	
 static void initialize()
 {
@@ -424,10 +643,11 @@ static void initialize()
 	menu_SetTop(MakeMenu());
 	ui_Init();
 	hyper_Init();
+	lowres_Init();
 	htexdb_Init();
 
-	g_groundGeom = render_GeneratePlaneGeom();
-	g_groundShader = render_CompileShader("shaders/ground.glsl", g_groundUniforms);
+	ground_Init();
+	capture_Init();
 
 	g_mainCamera = std::make_shared<Camera>(30.f, g_screen.m_aspect);
 	g_debugCamera = std::make_shared<Camera>(30.f, g_screen.m_aspect);
@@ -486,20 +706,28 @@ static void update(Framedata& frame)
 	}
 	else
 	{
-		if(g_curHtex && g_recordTimeRange.Valid())
+		// time only moves on once the last frame's been saved
+		g_dt = g_recordRequestedFrame == g_recordCurFrame ? 0.f : 1.0 / g_recordFps;
+		if(g_curHtex && g_recordTimeRange.Valid() && g_recordRequestedFrame != g_recordCurFrame)
 		{
 			float time = g_recordTimeRange.Interpolate(g_recordCurFrame / (float)g_recordFrameCount);
 			g_curHtex->m_time = time;
-			g_curHtex->Update(Normalize(g_sundir));
+			g_curHtex->RequestUpdate();
 		}
-		g_dt = 1.0 / g_recordFps;
+		g_recordRequestedFrame = g_recordCurFrame;
 	}
 
+	// frames while recording take as long as they take, so leave the quality alone
+	g_frameClock.Step();
+	if(!g_recording)
+		quality_Update(g_frameClock.GetDt() * 1000.f);
+
 	orbitcam_Update();
 
 	updateFps();
 
 	g_curCamera->Compute();
+	scene_Update();
 
 	menu_Update(g_dt);		
 
@@ -507,6 +735,7 @@ static void update(Framedata& frame)
 	gputask_Kick();
 
 	task_Update();
+	capture_Update();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -716,13 +945,16 @@ int main(void)
 			if(g_curHtex)
 			{
 				float prevtime = g_curHtex->m_time;
+				float time = prevtime;
 				if(keystate[SDLK_UP])
-					g_curHtex->m_time += g_dt;
+					time += g_dt;
 				if(keystate[SDLK_DOWN])
-					g_curHtex->m_time -= g_dt;
+					time -= g_dt;
 
-				if(prevtime != g_curHtex->m_time) {
-					g_curHtex->Update(Normalize(g_sundir));
+				if(prevtime != time) {
+					// snap to a grid so scrubbing back lands on times the volume cache has
+					g_curHtex->m_time = Floor(time * kTimeScrubRate + 0.5f) / kTimeScrubRate;
+					g_curHtex->RequestUpdate();
 				}
 			}
 		}
@@ -756,6 +988,7 @@ int main(void)
 
 	} while(!done);
 
+	capture_Shutdown();
 	task_Shutdown();
 
 	tweaker_SaveVars("tweaker.txt", g_tweakVars);
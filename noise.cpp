@@ -21,10 +21,25 @@ float gain(float g, float t)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// The batch loops are built twice on x86, once for AVX2 (which has gathers for the table
+// lookups) and once for the baseline, and the loader picks the right one.
+#if defined(__x86_64__) || defined(__i386__)
+#define NOISE_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define NOISE_CLONES
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+constexpr int Noise::kBatchBlockSize;
+
 Noise::Noise()
 	: m_seed(time(NULL))
 	, m_permuteTable(kPermuteSize*2)
-	, m_gradients(kPermuteSize)
+	, m_gradX(kPermuteSize)
+	, m_gradY(kPermuteSize)
+	, m_gradZ(kPermuteSize)
+	, m_amplitudeH(0.f)
+	, m_amplitudeLacunarity(0.f)
 {
 	Init();
 }
@@ -32,7 +47,11 @@ Noise::Noise()
 Noise::Noise(unsigned int seed)
 	: m_seed(seed)
 	, m_permuteTable(kPermuteSize*2)
-	, m_gradients(kPermuteSize)
+	, m_gradX(kPermuteSize)
+	, m_gradY(kPermuteSize)
+	, m_gradZ(kPermuteSize)
+	, m_amplitudeH(0.f)
+	, m_amplitudeLacunarity(0.f)
 {
 	Init();
 }
@@ -49,7 +68,7 @@ void Noise::Init()
 	}
 	std::copy(m_permuteTable.begin(), m_permuteTable.begin() + kPermuteSize,
 		m_permuteTable.begin() + kPermuteSize);
-	for(vec3& v: m_gradients)
+	for(int i = 0, c = kPermuteSize; i < c; ++i)
 	{
 		float horizAngle = ((float)rand_r(&seed) / RAND_MAX) * 2.f * M_PI;
 		float vertAngle = ((float)rand_r(&seed) / RAND_MAX) * M_PI;
@@ -57,11 +76,30 @@ void Noise::Init()
 			sinH = sin(horizAngle);
 		float cosV = cos(vertAngle),
 			sinV = sin(vertAngle);
-		v = {sinV * cosH, sinV * sinH, cosV};
+		m_gradX[i] = sinV * cosH;
+		m_gradY[i] = sinV * sinH;
+		m_gradZ[i] = cosV;
+	}
+}
+
+const float* Noise::GetOctaveAmplitudes(float h, float lacunarity, int numOctaves)
+{
+	// includes an entry for the fractional octave
+	int needed = numOctaves + 1;
+	if(h != m_amplitudeH || lacunarity != m_amplitudeLacunarity || 
+		(int)m_octaveAmplitudes.size() < needed)
+	{
+		m_amplitudeH = h;
+		m_amplitudeLacunarity = lacunarity;
+		m_octaveAmplitudes.resize(Max(needed, (int)m_octaveAmplitudes.size()));
+		for(int i = 0, c = m_octaveAmplitudes.size(); i < c; ++i)
+			m_octaveAmplitudes[i] = powf(lacunarity, -h * i);
 	}
+	return &m_octaveAmplitudes[0];
 }
 
-float Noise::Grad(int perm, float x, float y, float z) const
+static inline float Grad(const float* gradX, const float* gradY, const float* gradZ,
+	int perm, float x, float y, float z)
 {
 	//int hash = perm & 0xf;
 	//float u = hash < 8 ? x : y;
@@ -70,33 +108,21 @@ float Noise::Grad(int perm, float x, float y, float z) const
 	//v = (hash&2) ? -v : v;
 	//return u + v;
 
-	int hash = perm % kPermuteSize;
-	vec3 v = m_gradients[hash];
-	return v.x * x + v.y * y + v.z * z;
+	// permute table entries are < kPermuteSize, so perm is always a valid index
+	return gradX[perm] * x + gradY[perm] * y + gradZ[perm] * z;
 }
 
-inline int Fold3(const int* p, int i, int j, int k)
+inline int Fold3(const unsigned char* p, int i, int j, int k)
 {
 	return p[p[p[k] + j] + i];
 }
 
-float Noise::Sample(float x, float y, float z) const
+// Noise for one point once the lattice cell (ix,iy,iz), the position in it and the spline
+// weights are known. Shared by the scalar and batch paths so they do exactly the same math.
+static inline float LatticeNoise(const unsigned char* permute, 
+	const float* gradX, const float* gradY, const float* gradZ,
+	int ix, int iy, int iz, float x, float y, float z, float u, float v, float w)
 {
-	const int *permute = &m_permuteTable[0];
-	int ix = (int)Floor(x);
-	int iy = (int)Floor(y);
-	int iz = (int)Floor(z);
-	x -= (float)ix;
-	y -= (float)iy;
-	z -= (float)iz;
-	ix = ix % kPermuteSize;
-	iy = iy % kPermuteSize;
-	iz = iz % kPermuteSize;
-
-	float u = spline_c2(x);
-	float v = spline_c2(y);
-	float w = spline_c2(z);
-
 	int points[8];
 	points[0] = Fold3(permute, ix,iy,iz);
 	points[1] = Fold3(permute, ix+1,iy,iz);
@@ -109,43 +135,155 @@ float Noise::Sample(float x, float y, float z) const
 
 	float xlerp[4];
 	xlerp[0] = Lerp(u,
-		Grad(points[0], x, 	y, 		z), 
-		Grad(points[1], x-1, 	y, 		z));
+		Grad(gradX, gradY, gradZ, points[0], x, 	y, 		z), 
+		Grad(gradX, gradY, gradZ, points[1], x-1, 	y, 		z));
 	xlerp[1] = Lerp(u,
-		Grad(points[3], x, 	y-1, 	z),
-		Grad(points[2], x-1, 	y-1, 	z));
+		Grad(gradX, gradY, gradZ, points[3], x, 	y-1, 	z),
+		Grad(gradX, gradY, gradZ, points[2], x-1, 	y-1, 	z));
 	xlerp[2] = Lerp(u,
-		Grad(points[4], x, 	y, 		z-1), 
-		Grad(points[5], x-1, 	y, 		z-1));
+		Grad(gradX, gradY, gradZ, points[4], x, 	y, 		z-1), 
+		Grad(gradX, gradY, gradZ, points[5], x-1, 	y, 		z-1));
 	xlerp[3] = Lerp(u,
-		Grad(points[7], x, 	y-1, 	z-1),
-		Grad(points[6], x-1, 	y-1, 	z-1));
+		Grad(gradX, gradY, gradZ, points[7], x, 	y-1, 	z-1),
+		Grad(gradX, gradY, gradZ, points[6], x-1, 	y-1, 	z-1));
 	float ylerp[2];
 	ylerp[0] = Lerp(v, xlerp[0], xlerp[1]);
 	ylerp[1] = Lerp(v, xlerp[2], xlerp[3]);
 	return Lerp(w, ylerp[0], ylerp[1]);
 }
+
+float Noise::Sample(float x, float y, float z) const
+{
+	int ix = (int)Floor(x);
+	int iy = (int)Floor(y);
+	int iz = (int)Floor(z);
+	x -= (float)ix;
+	y -= (float)iy;
+	z -= (float)iz;
+	// mask rather than % so negative cells wrap around instead of indexing before the table
+	ix = ix & (kPermuteSize - 1);
+	iy = iy & (kPermuteSize - 1);
+	iz = iz & (kPermuteSize - 1);
+
+	float u = spline_c2(x);
+	float v = spline_c2(y);
+	float w = spline_c2(z);
+
+	return LatticeNoise(&m_permuteTable[0], &m_gradX[0], &m_gradY[0], &m_gradZ[0],
+		ix, iy, iz, x, y, z, u, v, w);
+}
+
+NOISE_CLONES
+void Noise::SampleBlock(const float* xs, const float* ys, const float* zs, int count,
+	float* result) const
+{
+	// cell and spline weights for the whole block first, this loop has no lookups and
+	// vectorizes
+	int ix[kBatchBlockSize], iy[kBatchBlockSize], iz[kBatchBlockSize];
+	float x[kBatchBlockSize], y[kBatchBlockSize], z[kBatchBlockSize];
+	float u[kBatchBlockSize], v[kBatchBlockSize], w[kBatchBlockSize];
+	for(int i = 0; i < count; ++i)
+	{
+		int cx = (int)Floor(xs[i]);
+		int cy = (int)Floor(ys[i]);
+		int cz = (int)Floor(zs[i]);
+		x[i] = xs[i] - (float)cx;
+		y[i] = ys[i] - (float)cy;
+		z[i] = zs[i] - (float)cz;
+		ix[i] = cx & (kPermuteSize - 1);
+		iy[i] = cy & (kPermuteSize - 1);
+		iz[i] = cz & (kPermuteSize - 1);
+		u[i] = spline_c2(x[i]);
+		v[i] = spline_c2(y[i]);
+		w[i] = spline_c2(z[i]);
+	}
+
+	const unsigned char* permute = &m_permuteTable[0];
+	const float* gradX = &m_gradX[0];
+	const float* gradY = &m_gradY[0];
+	const float* gradZ = &m_gradZ[0];
+	for(int i = 0; i < count; ++i)
+	{
+		result[i] = LatticeNoise(permute, gradX, gradY, gradZ,
+			ix[i], iy[i], iz[i], x[i], y[i], z[i], u[i], v[i], w[i]);
+	}
+}
+
+void Noise::SampleBatch(const float* x, const float* y, const float* z, int count,
+	float* result) const
+{
+	for(int start = 0; start < count; start += kBatchBlockSize)
+	{
+		SampleBlock(x + start, y + start, z + start, Min(kBatchBlockSize, count - start),
+			result + start);
+	}
+}
 	
 float Noise::FbmSample(const vec3& v, float h, float lacunarity, float octaves)
 {
 	int numOctaves = (int)octaves;
 	float remainder = octaves - (float)numOctaves;
+	const float* amplitudes = GetOctaveAmplitudes(h, lacunarity, numOctaves);
 
 	vec3 pt = v;
 	float result = 0.f;
 	for(int i = 0; i < numOctaves; ++i)
 	{
-		result += Sample(pt) * powf(lacunarity, -h * i);
+		result += Sample(pt) * amplitudes[i];
 		pt *= lacunarity;
 	}
 
 	if(remainder > 0.f) 
 	{
-		result += remainder * Sample(pt) * powf(lacunarity, -h * numOctaves);
+		result += remainder * Sample(pt) * amplitudes[numOctaves];
 	}
 	return result;
 }
 
+void Noise::FbmSampleBatch(const float* x, const float* y, const float* z, int count,
+	float h, float lacunarity, float octaves, float* result)
+{
+	int numOctaves = (int)octaves;
+	float remainder = octaves - (float)numOctaves;
+	const float* amplitudes = GetOctaveAmplitudes(h, lacunarity, numOctaves);
+
+	float px[kBatchBlockSize], py[kBatchBlockSize], pz[kBatchBlockSize];
+	float sample[kBatchBlockSize];
+	for(int start = 0; start < count; start += kBatchBlockSize)
+	{
+		const int n = Min(kBatchBlockSize, count - start);
+		float* out = result + start;
+		for(int i = 0; i < n; ++i)
+		{
+			px[i] = x[start + i];
+			py[i] = y[start + i];
+			pz[i] = z[start + i];
+			out[i] = 0.f;
+		}
+
+		for(int octave = 0; octave < numOctaves; ++octave)
+		{
+			SampleBlock(px, py, pz, n, sample);
+			const float amplitude = amplitudes[octave];
+			for(int i = 0; i < n; ++i)
+			{
+				out[i] += sample[i] * amplitude;
+				px[i] *= lacunarity;
+				py[i] *= lacunarity;
+				pz[i] *= lacunarity;
+			}
+		}
+
+		if(remainder > 0.f)
+		{
+			SampleBlock(px, py, pz, n, sample);
+			const float amplitude = amplitudes[numOctaves];
+			for(int i = 0; i < n; ++i)
+				out[i] += remainder * sample[i] * amplitude;
+		}
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 RidgedMultiFractal::RidgedMultiFractal(Noise& noise, int octaves, float offset,
 	float h, float lacunarity, float gain)
@@ -187,3 +325,597 @@ float RidgedMultiFractal::Sample(float x, float y, float z) const
 	return result;
 }
 
+void RidgedMultiFractal::SampleBlock(const float* x, const float* y, const float* z, int count,
+	float* result) const
+{
+	constexpr int kBlockSize = Noise::kBatchBlockSize;
+	float px[kBlockSize], py[kBlockSize], pz[kBlockSize];
+	float signal[kBlockSize], sample[kBlockSize];
+
+	m_noise.SampleBatch(x, y, z, count, sample);
+	for(int i = 0; i < count; ++i)
+	{
+		px[i] = x[i];
+		py[i] = y[i];
+		pz[i] = z[i];
+		signal[i] = m_offset - fabs(sample[i]);
+		signal[i] *= signal[i];
+		result[i] = signal[i];
+	}
+
+	for(int octave = 0, c = m_octaves; octave < c; ++octave)
+	{
+		for(int i = 0; i < count; ++i)
+		{
+			px[i] = px[i] * m_lacunarity;
+			py[i] = py[i] * m_lacunarity;
+			pz[i] = pz[i] * m_lacunarity;
+		}
+
+		m_noise.SampleBatch(px, py, pz, count, sample);
+
+		const float exponent = m_exponents[octave];
+		for(int i = 0; i < count; ++i)
+		{
+			float weight = Clamp(signal[i] * m_gain, 0.f, 1.f);
+			float s = m_offset - fabs(sample[i]);
+			s *= s;
+			s *= weight;
+			signal[i] = s;
+			result[i] += s * exponent;
+		}
+	}
+}
+
+void RidgedMultiFractal::SampleBatch(const float* x, const float* y, const float* z, int count,
+	float* result) const
+{
+	for(int start = 0; start < count; start += Noise::kBatchBlockSize)
+	{
+		SampleBlock(x + start, y + start, z + start, 
+			Min(Noise::kBatchBlockSize, count - start), result + start);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Port of pnoise/fbmNoise from shaders/noise.glsl. Every operation is done in the same order
+// as the shader (including spline_c2 and mix, which differ slightly from the commonmath
+// versions) so the CPU and GPU volumes can be swapped for each other.
+static inline float GlslFract(float x)
+{
+	return x - floorf(x);
+}
+
+static inline float GlslMix(float x, float y, float a)
+{
+	return x * (1.f - a) + y * a;
+}
+
+static inline float GlslSplineC2(float t)
+{
+	float t3 = t*t*t;
+	float t4 = t3*t;
+	float t5 = t4*t;
+	return 6.f * t5 - 15.f * t4 + 10.f * t3;
+}
+
+static inline float Mod289(float x)
+{
+	return x - floorf(x * (1.f / 289.f)) * 289.f;
+}
+
+static inline float Permute(float x)
+{
+	return Mod289((x * 34.f + 1.f) * x);
+}
+
+static inline float TaylorInvSqrt(float r)
+{
+	return 1.79284291400159f - 0.85373472095314f * r;
+}
+
+static inline float GlslStep(float edge, float x)
+{
+	return x < edge ? 0.f : 1.f;
+}
+
+// gradient for a lattice corner with the given hash
+static inline vec3 CornerGradient(float hash)
+{
+	float x = hash * (1.f / 7.f);
+	float y = GlslFract(floorf(x) * (1.f / 7.f)) - 0.5f;
+	x = GlslFract(x);
+	float z = 0.5f - fabsf(x) - fabsf(y);
+	float sz = GlslStep(z, 0.f);
+	x -= sz * (GlslStep(0.f, x) - 0.5f);
+	y -= sz * (GlslStep(0.f, y) - 0.5f);
+
+	float norm = TaylorInvSqrt(x*x + y*y + z*z);
+	return vec3(x * norm, y * norm, z * norm);
+}
+
+float PNoise(const vec3& p)
+{
+	const float lo[3] = { Mod289(floorf(p.x)), Mod289(floorf(p.y)), Mod289(floorf(p.z)) };
+	const float hi[3] = { Mod289(lo[0] + 1.f), Mod289(lo[1] + 1.f), Mod289(lo[2] + 1.f) };
+	const float f0[3] = { GlslFract(p.x), GlslFract(p.y), GlslFract(p.z) };
+	const float f1[3] = { f0[0] - 1.f, f0[1] - 1.f, f0[2] - 1.f };
+
+	// corner index bits are x, y, z, so 0-3 are the z=lo corners (ixy0 in the shader) and 4-7
+	// are the z=hi corners (ixy1)
+	float n[8];
+	for(int i = 0; i < 4; ++i)
+	{
+		float ixy = Permute(Permute((i & 1) ? hi[0] : lo[0]) + ((i & 2) ? hi[1] : lo[1]));
+		for(int j = 0; j < 2; ++j)
+		{
+			vec3 g = CornerGradient(Permute(ixy + (j ? hi[2] : lo[2])));
+			float fx = (i & 1) ? f1[0] : f0[0];
+			float fy = (i & 2) ? f1[1] : f0[1];
+			float fz = j ? f1[2] : f0[2];
+			n[i + 4*j] = g.x * fx + g.y * fy + g.z * fz;
+		}
+	}
+
+	float u = GlslSplineC2(f0[0]);
+	float v = GlslSplineC2(f0[1]);
+	float w = GlslSplineC2(f0[2]);
+
+	float zlerp[4];
+	for(int i = 0; i < 4; ++i)
+		zlerp[i] = GlslMix(n[i], n[i+4], w);
+	float ylerp0 = GlslMix(zlerp[0], zlerp[2], v);
+	float ylerp1 = GlslMix(zlerp[1], zlerp[3], v);
+	return 2.2f * GlslMix(ylerp0, ylerp1, u);
+}
+
+float FbmNoise(const vec3& pt, float h, float lacunarity, float octaves)
+{
+	int numOctaves = (int)octaves;
+	float result = 0.f;
+
+	vec3 p = pt;
+	for(int i = 0; i < numOctaves; ++i)
+	{
+		result += PNoise(p) * powf(lacunarity, -h * i);
+		p *= lacunarity;
+	}
+
+	float remainder = octaves - numOctaves;
+	if(remainder > 0.f)
+	{
+		result += remainder * PNoise(p) * powf(lacunarity, -h * numOctaves);
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Range of PNoise over a box. Within one lattice cell each corner term is linear in p and the
+// spline weights increase monotonically, so the min and max can be pushed through the lerps
+// exactly. Boxes that touch more than a few cells just get the global range.
+
+// largest |PNoise| found by searching for maxima is about 1.17
+static constexpr float kPNoiseMax = 1.25f;
+static constexpr int kMaxBoundsCells = 8;
+// cells are split into up to this many pieces along each axis
+static constexpr int kSubCellSplits = 4;
+// the sample points and the noise itself have some rounding the intervals don't track
+static constexpr float kBoundsBoxEpsilon = 1e-5f;
+static constexpr float kBoundsEpsilon = 1e-4f;
+
+static inline void MixBounds(float aMin, float aMax, float bMin, float bMax, 
+	float tMin, float tMax, float& outMin, float& outMax)
+{
+	// mix(a,b,t) increases with a and b when t is in 0..1, and is linear in t
+	outMin = Min(GlslMix(aMin, bMin, tMin), GlslMix(aMin, bMin, tMax));
+	outMax = Max(GlslMix(aMax, bMax, tMin), GlslMix(aMax, bMax, tMax));
+}
+
+// grad are the corner gradients of a cell, f0 and f1 the part of the cell covered, in 0..1
+static void SubCellBounds(const float (*grad)[3], const float* f0, const float* f1,
+	float& outMin, float& outMax)
+{
+	float nMin[8], nMax[8];
+	for(int corner = 0; corner < 8; ++corner)
+	{
+		nMin[corner] = nMax[corner] = 0.f;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			float offset = (corner & (1 << axis)) ? 1.f : 0.f;
+			float e0 = grad[corner][axis] * (f0[axis] - offset);
+			float e1 = grad[corner][axis] * (f1[axis] - offset);
+			nMin[corner] += Min(e0, e1);
+			nMax[corner] += Max(e0, e1);
+		}
+	}
+
+	float zMin[4], zMax[4];
+	for(int i = 0; i < 4; ++i)
+		MixBounds(nMin[i], nMax[i], nMin[i+4], nMax[i+4], 
+			GlslSplineC2(f0[2]), GlslSplineC2(f1[2]), zMin[i], zMax[i]);
+	float yMin[2], yMax[2];
+	for(int i = 0; i < 2; ++i)
+		MixBounds(zMin[i], zMax[i], zMin[i+2], zMax[i+2], 
+			GlslSplineC2(f0[1]), GlslSplineC2(f1[1]), yMin[i], yMax[i]);
+	MixBounds(yMin[0], yMax[0], yMin[1], yMax[1], 
+		GlslSplineC2(f0[0]), GlslSplineC2(f1[0]), outMin, outMax);
+	outMin *= 2.2f;
+	outMax *= 2.2f;
+}
+
+// cell is the lattice cell, f0 and f1 the part of the cell covered, in 0..1
+static void PNoiseCellBounds(const float* cell, const float* f0, const float* f1,
+	float& outMin, float& outMax)
+{
+	const float lo[3] = { Mod289(cell[0]), Mod289(cell[1]), Mod289(cell[2]) };
+	const float hi[3] = { Mod289(lo[0] + 1.f), Mod289(lo[1] + 1.f), Mod289(lo[2] + 1.f) };
+
+	float grad[8][3];
+	for(int i = 0; i < 4; ++i)
+	{
+		float ixy = Permute(Permute((i & 1) ? hi[0] : lo[0]) + ((i & 2) ? hi[1] : lo[1]));
+		for(int j = 0; j < 2; ++j)
+		{
+			vec3 g = CornerGradient(Permute(ixy + (j ? hi[2] : lo[2])));
+			grad[i + 4*j][0] = g.x;
+			grad[i + 4*j][1] = g.y;
+			grad[i + 4*j][2] = g.z;
+		}
+	}
+
+	// The bounds get looser the bigger the box is, since the weights and the corner terms are
+	// treated as independent. Splitting it up costs a lot less than the gradients.
+	int numSplits[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		numSplits[axis] = Clamp(static_cast<int>(ceilf((f1[axis] - f0[axis]) * kSubCellSplits)),
+			1, kSubCellSplits);
+	}
+
+	outMin = kPNoiseMax;
+	outMax = -kPNoiseMax;
+	int split[3];
+	for(split[2] = 0; split[2] < numSplits[2]; ++split[2])
+	for(split[1] = 0; split[1] < numSplits[1]; ++split[1])
+	for(split[0] = 0; split[0] < numSplits[0]; ++split[0])
+	{
+		float sub0[3], sub1[3];
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			float size = (f1[axis] - f0[axis]) / numSplits[axis];
+			sub0[axis] = f0[axis] + split[axis] * size;
+			sub1[axis] = split[axis] + 1 == numSplits[axis] ? f1[axis] : sub0[axis] + size;
+		}
+		float subMin, subMax;
+		SubCellBounds(grad, sub0, sub1, subMin, subMax);
+		outMin = Min(outMin, subMin);
+		outMax = Max(outMax, subMax);
+	}
+}
+
+void PNoiseBounds(const vec3& lo, const vec3& hi, float& outMin, float& outMax)
+{
+	float boxLo[3] = { lo.x, lo.y, lo.z };
+	float boxHi[3] = { hi.x, hi.y, hi.z };
+	float cellLo[3], cellHi[3];
+	int numCells = 1;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		boxLo[axis] -= kBoundsBoxEpsilon * (1.f + fabsf(boxLo[axis]));
+		boxHi[axis] += kBoundsBoxEpsilon * (1.f + fabsf(boxHi[axis]));
+		cellLo[axis] = floorf(boxLo[axis]);
+		cellHi[axis] = floorf(boxHi[axis]);
+		numCells *= Min(static_cast<int>(cellHi[axis] - cellLo[axis]) + 1, kMaxBoundsCells + 1);
+	}
+
+	if(numCells > kMaxBoundsCells)
+	{
+		outMin = -kPNoiseMax;
+		outMax = kPNoiseMax;
+		return;
+	}
+
+	outMin = kPNoiseMax;
+	outMax = -kPNoiseMax;
+	float cell[3];
+	for(cell[2] = cellLo[2]; cell[2] <= cellHi[2]; cell[2] += 1.f)
+	for(cell[1] = cellLo[1]; cell[1] <= cellHi[1]; cell[1] += 1.f)
+	for(cell[0] = cellLo[0]; cell[0] <= cellHi[0]; cell[0] += 1.f)
+	{
+		float f0[3], f1[3];
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			f0[axis] = Max(boxLo[axis] - cell[axis], 0.f);
+			f1[axis] = Min(boxHi[axis] - cell[axis], 1.f);
+		}
+		float cellMin, cellMax;
+		PNoiseCellBounds(cell, f0, f1, cellMin, cellMax);
+		outMin = Min(outMin, cellMin);
+		outMax = Max(outMax, cellMax);
+	}
+
+	outMin = Max(outMin - kBoundsEpsilon, -kPNoiseMax);
+	outMax = Min(outMax + kBoundsEpsilon, kPNoiseMax);
+}
+
+void FbmNoiseBounds(const vec3& lo, const vec3& hi, float h, float lacunarity, float octaves,
+	float& outMin, float& outMax)
+{
+	int numOctaves = (int)octaves;
+	float remainder = octaves - numOctaves;
+
+	outMin = outMax = 0.f;
+	vec3 boxLo = lo, boxHi = hi;
+	for(int i = 0; i <= numOctaves; ++i)
+	{
+		float weight = i < numOctaves ? 1.f : remainder;
+		if(weight <= 0.f) 
+			break;
+
+		float amplitude = weight * powf(lacunarity, -h * i);
+		float nMin, nMax;
+		PNoiseBounds(boxLo, boxHi, nMin, nMax);
+		outMin += amplitude * nMin;
+		outMax += amplitude * nMax;
+
+		boxLo *= lacunarity;
+		boxHi *= lacunarity;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 8-wide versions of PNoise/FbmNoise, written with gcc vector extensions. The baseline clone splits
+// them into pairs of SSE ops. Each lane does exactly what the scalar code does, so results are
+// identical.
+// The helpers are all inlined, so the warning about passing 32 byte vectors without AVX
+// doesn't apply. This has to stay in effect to the end of the file since gcc reports it late.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef float Float8 __attribute__((vector_size(32)));
+typedef int Int8 __attribute__((vector_size(32)));
+
+#define NOISE8_INLINE static inline __attribute__((always_inline))
+
+// truncate and fix up negative values. Inputs here are lattice coordinates and hashes, which 
+// are well inside int range.
+NOISE8_INLINE Float8 Floor8(const Float8& x)
+{
+	Float8 t = __builtin_convertvector(__builtin_convertvector(x, Int8), Float8);
+	return t > x ? t - 1.f : t;
+}
+
+NOISE8_INLINE Float8 Fract8(const Float8& x)
+{
+	return x - Floor8(x);
+}
+
+NOISE8_INLINE Float8 Abs8(const Float8& x)
+{
+	return (Float8)((Int8)x & 0x7fffffff);
+}
+
+NOISE8_INLINE Float8 Mix8(const Float8& x, const Float8& y, const Float8& a)
+{
+	return x * (1.f - a) + y * a;
+}
+
+NOISE8_INLINE Float8 SplineC28(const Float8& t)
+{
+	Float8 t3 = t*t*t;
+	Float8 t4 = t3*t;
+	Float8 t5 = t4*t;
+	return 6.f * t5 - 15.f * t4 + 10.f * t3;
+}
+
+NOISE8_INLINE Float8 Mod2898(const Float8& x)
+{
+	return x - Floor8(x * (1.f / 289.f)) * 289.f;
+}
+
+NOISE8_INLINE Float8 Permute8(const Float8& x)
+{
+	return Mod2898((x * 34.f + 1.f) * x);
+}
+
+NOISE8_INLINE Float8 PNoise8Core(const Float8& px, const Float8& py, const Float8& pz)
+{
+	const Float8 zero = {};
+	const Float8 one = zero + 1.f;
+	const Float8 lo[3] = { Mod2898(Floor8(px)), Mod2898(Floor8(py)), Mod2898(Floor8(pz)) };
+	const Float8 hi[3] = { Mod2898(lo[0] + 1.f), Mod2898(lo[1] + 1.f), Mod2898(lo[2] + 1.f) };
+	const Float8 f0[3] = { Fract8(px), Fract8(py), Fract8(pz) };
+	const Float8 f1[3] = { f0[0] - 1.f, f0[1] - 1.f, f0[2] - 1.f };
+
+	Float8 n[8];
+	for(int i = 0; i < 4; ++i)
+	{
+		Float8 ixy = Permute8(Permute8((i & 1) ? hi[0] : lo[0]) + ((i & 2) ? hi[1] : lo[1]));
+		for(int j = 0; j < 2; ++j)
+		{
+			Float8 x = Permute8(ixy + (j ? hi[2] : lo[2])) * (1.f / 7.f);
+			Float8 y = Fract8(Floor8(x) * (1.f / 7.f)) - 0.5f;
+			x = Fract8(x);
+			Float8 z = 0.5f - Abs8(x) - Abs8(y);
+			Float8 sz = zero < z ? zero : one;
+			x -= sz * ((x < zero ? zero : one) - 0.5f);
+			y -= sz * ((y < zero ? zero : one) - 0.5f);
+
+			Float8 norm = 1.79284291400159f - 0.85373472095314f * (x*x + y*y + z*z);
+			x *= norm;
+			y *= norm;
+			z *= norm;
+
+			Float8 fx = (i & 1) ? f1[0] : f0[0];
+			Float8 fy = (i & 2) ? f1[1] : f0[1];
+			Float8 fz = j ? f1[2] : f0[2];
+			n[i + 4*j] = x * fx + y * fy + z * fz;
+		}
+	}
+
+	Float8 u = SplineC28(f0[0]);
+	Float8 v = SplineC28(f0[1]);
+	Float8 w = SplineC28(f0[2]);
+
+	Float8 zlerp[4];
+	for(int i = 0; i < 4; ++i)
+		zlerp[i] = Mix8(n[i], n[i+4], w);
+	Float8 ylerp0 = Mix8(zlerp[0], zlerp[2], v);
+	Float8 ylerp1 = Mix8(zlerp[1], zlerp[3], v);
+	return 2.2f * Mix8(ylerp0, ylerp1, u);
+}
+
+NOISE_CLONES
+void PNoise8(const float* x, const float* y, const float* z, float* result)
+{
+	Float8 px, py, pz;
+	memcpy(&px, x, sizeof(px));
+	memcpy(&py, y, sizeof(py));
+	memcpy(&pz, z, sizeof(pz));
+	Float8 r = PNoise8Core(px, py, pz);
+	memcpy(result, &r, sizeof(r));
+}
+
+NOISE_CLONES
+void FbmNoise8(const float* x, const float* y, const float* z, 
+	float h, float lacunarity, float octaves, float* result)
+{
+	Float8 px, py, pz;
+	memcpy(&px, x, sizeof(px));
+	memcpy(&py, y, sizeof(py));
+	memcpy(&pz, z, sizeof(pz));
+
+	int numOctaves = (int)octaves;
+	Float8 r = {};
+	for(int i = 0; i < numOctaves; ++i)
+	{
+		r += PNoise8Core(px, py, pz) * powf(lacunarity, -h * i);
+		px *= lacunarity;
+		py *= lacunarity;
+		pz *= lacunarity;
+	}
+
+	float remainder = octaves - numOctaves;
+	if(remainder > 0.f)
+	{
+		r += remainder * PNoise8Core(px, py, pz) * powf(lacunarity, -h * numOctaves);
+	}
+	memcpy(result, &r, sizeof(r));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Void and cluster (Ulichney 93). Each point gets a gaussian energy over its neighbors, the
+// tightest cluster is the point with the most energy and the largest void the empty texel
+// with the least.
+class BlueNoiseEnergy
+{
+public:
+	BlueNoiseEnergy(int size)
+		: m_size(size)
+		, m_energy(size * size, 0.f)
+		, m_weights((2 * kRadius + 1) * (2 * kRadius + 1))
+	{
+		for(int y = -kRadius; y <= kRadius; ++y)
+			for(int x = -kRadius; x <= kRadius; ++x)
+				m_weights[(y + kRadius) * (2 * kRadius + 1) + x + kRadius] = 
+					exp(-(x * x + y * y) / (2.f * kSigma * kSigma));
+	}
+
+	void Add(int index, float sign)
+	{
+		const int px = index % m_size, py = index / m_size;
+		for(int y = -kRadius; y <= kRadius; ++y)
+		{
+			const int row = ((py + y + m_size) % m_size) * m_size;
+			for(int x = -kRadius; x <= kRadius; ++x)
+				m_energy[row + (px + x + m_size) % m_size] += 
+					sign * m_weights[(y + kRadius) * (2 * kRadius + 1) + x + kRadius];
+		}
+	}
+
+	int FindTightestCluster(const std::vector<bool>& points) const
+	{
+		int best = -1;
+		for(int i = 0, c = m_energy.size(); i < c; ++i)
+			if(points[i] && (best < 0 || m_energy[i] > m_energy[best]))
+				best = i;
+		return best;
+	}
+
+	int FindLargestVoid(const std::vector<bool>& points) const
+	{
+		int best = -1;
+		for(int i = 0, c = m_energy.size(); i < c; ++i)
+			if(!points[i] && (best < 0 || m_energy[i] < m_energy[best]))
+				best = i;
+		return best;
+	}
+private:
+	static constexpr float kSigma = 1.5f;
+	static constexpr int kRadius = 6;
+
+	int m_size;
+	std::vector<float> m_energy;
+	std::vector<float> m_weights;
+};
+
+std::vector<float> MakeBlueNoise(int size, unsigned int seed)
+{
+	const int count = size * size;
+	std::vector<bool> points(count, false);
+	BlueNoiseEnergy energy(size);
+
+	// a random tenth of the texels to start with
+	unsigned int rng = seed;
+	const int numInitial = Max(1, count / 10);
+	for(int placed = 0; placed < numInitial; )
+	{
+		rng = rng * 1664525u + 1013904223u;
+		const int i = (rng >> 8) % count;
+		if(points[i])
+			continue;
+		points[i] = true;
+		energy.Add(i, 1.f);
+		++placed;
+	}
+
+	// spread them out by moving the tightest cluster to the largest void until that's a no-op
+	for(int iter = 0; iter < count; ++iter)
+	{
+		const int cluster = energy.FindTightestCluster(points);
+		points[cluster] = false;
+		energy.Add(cluster, -1.f);
+		const int hole = energy.FindLargestVoid(points);
+		points[hole] = true;
+		energy.Add(hole, 1.f);
+		if(hole == cluster)
+			break;
+	}
+
+	// rank the starting points by taking the clusters away, then fill in the rest of the
+	// texels in the largest voids
+	std::vector<int> rank(count);
+	{
+		std::vector<bool> remaining = points;
+		BlueNoiseEnergy removeEnergy = energy;
+		for(int r = numInitial - 1; r >= 0; --r)
+		{
+			const int cluster = removeEnergy.FindTightestCluster(remaining);
+			remaining[cluster] = false;
+			removeEnergy.Add(cluster, -1.f);
+			rank[cluster] = r;
+		}
+	}
+	for(int r = numInitial; r < count; ++r)
+	{
+		const int hole = energy.FindLargestVoid(points);
+		points[hole] = true;
+		energy.Add(hole, 1.f);
+		rank[hole] = r;
+	}
+
+	std::vector<float> result(count);
+	for(int i = 0; i < count; ++i)
+		result[i] = (rank[i] + 0.5f) / count;
+	return result;
+}
@@ -13,12 +13,32 @@ public:
 	float Sample(float x, float y, float z) const;
 
 	float FbmSample(const vec3& v, float h, float lacunarity, float octaves);
+
+	// Batch versions, points are given as separate x, y and z arrays (SoA) of count entries.
+	// result[i] is the same as the scalar call on point i.
+	void SampleBatch(const float* x, const float* y, const float* z, int count, 
+		float* result) const;
+	void FbmSampleBatch(const float* x, const float* y, const float* z, int count,
+		float h, float lacunarity, float octaves, float* result);
+
+	constexpr static int kBatchBlockSize = 64;
 private:
 	void Init();
 	float Grad(int perm, float x, float y, float z) const;
+	void SampleBlock(const float* x, const float* y, const float* z, int count, 
+		float* result) const;
+	const float* GetOctaveAmplitudes(float h, float lacunarity, int numOctaves);
+
 	unsigned int m_seed;
-	std::vector<int> m_permuteTable;
-	std::vector<vec3> m_gradients;
+	std::vector<unsigned char> m_permuteTable;
+	std::vector<float> m_gradX;
+	std::vector<float> m_gradY;
+	std::vector<float> m_gradZ;
+
+	// lacunarity^(-h*i) for the last h and lacunarity passed to an fbm call
+	std::vector<float> m_octaveAmplitudes;
+	float m_amplitudeH;
+	float m_amplitudeLacunarity;
 
 	constexpr static int kPermuteSize = 256;
 };
@@ -30,7 +50,11 @@ public:
 		float h, float lacunarity, float gain);
 
 	float Sample(float x, float y, float z) const;
+	void SampleBatch(const float* x, const float* y, const float* z, int count,
+		float* result) const;
 private:
+	void SampleBlock(const float* x, const float* y, const float* z, int count,
+		float* result) const;
 
 	Noise& m_noise;
 	std::vector<float> m_exponents;
@@ -40,6 +64,28 @@ private:
 	float m_gain;
 };
 
+// CPU port of the classic noise in shaders/noise.glsl (webgl-noise). This is not the same
+// function as Noise::Sample, use it when the result needs to match the gen shaders.
+float PNoise(const vec3& p);
+float FbmNoise(const vec3& pt, float h, float lacunarity, float octaves);
+
+// Conservative range of PNoise/FbmNoise over the box [lo, hi]. Tight for boxes a cell or so
+// across, otherwise it falls back to the largest range the noise can have.
+void PNoiseBounds(const vec3& lo, const vec3& hi, float& outMin, float& outMax);
+void FbmNoiseBounds(const vec3& lo, const vec3& hi, float h, float lacunarity, float octaves,
+	float& outMin, float& outMax);
+
+// Evaluate kNoiseBatchSize points at once with SIMD. Lane i gives exactly the same result as
+// PNoise/FbmNoise on (x[i], y[i], z[i]).
+constexpr int kNoiseBatchSize = 8;
+void PNoise8(const float* x, const float* y, const float* z, float* result);
+void FbmNoise8(const float* x, const float* y, const float* z, 
+	float h, float lacunarity, float octaves, float* result);
+
+// A size x size tile of blue noise made with void and cluster: every value in [0, 1) appears
+// once, and neighboring texels are as far apart in value as possible. It wraps around.
+std::vector<float> MakeBlueNoise(int size, unsigned int seed = 1);
+
 float bias(float b, float t); // ref impl
 float gain(float g, float t); // ref impl
 
@@ -0,0 +1,382 @@
+// Renders a shape from volumes.txt over a range of time to an image sequence without a window or
+// the interactive loop. Each frame waits for its volume to finish generating and is written out
+// as soon as it's drawn, so it goes as fast as the volumes can be made. Uses EGL without a
+// surface, Mesa's llvmpipe is fine.
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glew.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "common.hh"
+#include "render.hh"
+#include "camera.hh"
+#include "commonmath.hh"
+#include "tweaker.hh"
+#include "task.hh"
+#include "gputask.hh"
+#include "timer.hh"
+#include "hyper.hh"
+#include "quality.hh"
+#include "lowres.hh"
+#include "ground.hh"
+#include "htexdb.hh"
+#include "raymarch.hh"
+#include "capture.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+class OfflineOptions
+{
+public:
+	std::string m_shape;
+	std::string m_outDir = "frames";
+	int m_width = 1280;
+	int m_height = 720;
+	int m_frameCount = 300;
+	Limits<float> m_timeRange = Limits<float>(1.f, 2.f);
+	int m_tier = QUALITY_High;
+	float m_volumeScale = 1.f;
+	bool m_cpuGen = false;
+	bool m_cpuMarch = false;
+	std::string m_streamPath; // streamed here instead of saving TGA files when set
+	int m_streamFormat = CAPTURE_Y4M;
+	int m_fps = 30;
+};
+
+// the scene from tweaker.txt, the rest of the vars in it are for the interactive camera
+static vec3 g_eye, g_focus, g_up;
+static vec3 g_sundir;
+static Color g_sunColor;
+
+static std::vector<std::shared_ptr<TweakVarBase>> g_tweakVars = {
+	std::make_shared<TweakVector>("cam.eye", &g_eye, vec3(8.f, 0.f, 2.f)),
+	std::make_shared<TweakVector>("cam.focus", &g_focus),
+	std::make_shared<TweakVector>("cam.up", &g_up, vec3(0,0,1)),
+	std::make_shared<TweakVector>("lighting.sundir", &g_sundir, vec3(0,0,1)),
+	std::make_shared<TweakColor>("lighting.suncolor", &g_sunColor, Color(1,1,1)),
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static void offline_Usage()
+{
+	std::cerr << "usage: hypertexture-offline [options] shape\n"
+		"  shape          name or index of a shape in volumes.txt\n"
+		"  -o dir         where the frames go (frames)\n"
+		"  -s WxH         size of the frames (1280x720)\n"
+		"  -n count       number of frames (300)\n"
+		"  -t start end   time range of the shape (1 2)\n"
+		"  -q tier        quality tier, 0 to " << QUALITY_NUM - 1 << " (" << QUALITY_High << ")\n"
+		"  -v scale       volume resolution scale, 0.25 to 1 (1)\n"
+		"  -c             generate the density on the CPU\n"
+		"  -r             generate, light and ray march the volume on the CPU\n"
+		"  -y path        stream YUV4MPEG2 to path instead, - for stdout\n"
+		"  -p path        stream raw rgb24 to path instead, - for stdout\n"
+		"  -f fps         frame rate in the stream's header (30)\n";
+}
+
+static bool offline_ParseArgs(int argc, char** argv, OfflineOptions& options)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		const int remaining = argc - i - 1;
+		if(strcmp(arg, "-o") == 0 && remaining >= 1)
+			options.m_outDir = argv[++i];
+		else if(strcmp(arg, "-s") == 0 && remaining >= 1)
+		{
+			if(sscanf(argv[++i], "%dx%d", &options.m_width, &options.m_height) != 2 ||
+				options.m_width <= 0 || options.m_height <= 0)
+				return false;
+		}
+		else if(strcmp(arg, "-n") == 0 && remaining >= 1)
+			options.m_frameCount = Max(1, atoi(argv[++i]));
+		else if(strcmp(arg, "-t") == 0 && remaining >= 2)
+		{
+			options.m_timeRange.m_min = atof(argv[++i]);
+			options.m_timeRange.m_max = atof(argv[++i]);
+		}
+		else if(strcmp(arg, "-q") == 0 && remaining >= 1)
+			options.m_tier = atoi(argv[++i]);
+		else if(strcmp(arg, "-v") == 0 && remaining >= 1)
+			options.m_volumeScale = atof(argv[++i]);
+		else if(strcmp(arg, "-c") == 0)
+			options.m_cpuGen = true;
+		else if(strcmp(arg, "-r") == 0)
+			options.m_cpuMarch = true;
+		else if((strcmp(arg, "-y") == 0 || strcmp(arg, "-p") == 0) && remaining >= 1)
+		{
+			options.m_streamFormat = arg[1] == 'y' ? CAPTURE_Y4M : CAPTURE_RawRGB;
+			options.m_streamPath = argv[++i];
+		}
+		else if(strcmp(arg, "-f") == 0 && remaining >= 1)
+			options.m_fps = Max(1, atoi(argv[++i]));
+		else if(arg[0] != '-' && options.m_shape.empty())
+			options.m_shape = arg;
+		else
+			return false;
+	}
+	return !options.m_shape.empty();
+}
+
+// A context with no surface at all. Everything is drawn to a framebuffer object.
+static bool offline_CreateContext()
+{
+	EGLDisplay display = EGL_NO_DISPLAY;
+	auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+		eglGetProcAddress("eglGetPlatformDisplayEXT"));
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	if(getPlatformDisplay)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+	if(display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		std::cerr << "Failed to initialize EGL." << std::endl;
+		return false;
+	}
+	if(!eglBindAPI(EGL_OPENGL_API))
+	{
+		std::cerr << "EGL doesn't support desktop GL." << std::endl;
+		return false;
+	}
+
+	static const EGLint configAttrs[] = {
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config = nullptr;
+	EGLint numConfigs = 0;
+	eglChooseConfig(display, configAttrs, &config, 1, &numConfigs);
+
+	// compatibility, the fullscreen passes and debug drawing use immediate mode
+	static const EGLint contextAttrs[] = {
+		EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+		EGL_CONTEXT_MINOR_VERSION_KHR, 2,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT_KHR,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, numConfigs > 0 ? config : nullptr,
+		EGL_NO_CONTEXT, contextAttrs);
+	if(context == EGL_NO_CONTEXT ||
+		!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		std::cerr << "Failed to create a GL context without a surface." << std::endl;
+		return false;
+	}
+
+	GLenum glewResult = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW built for GLX has loaded the GL functions by the time it finds there's no display
+	if(glewResult == GLEW_ERROR_NO_GLX_DISPLAY)
+		glewResult = GLEW_OK;
+#endif
+	if(glewResult != GLEW_OK)
+	{
+		std::cerr << "Failed to initialize GLEW: " << glewGetErrorString(glewResult) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static std::shared_ptr<AnimatedHypertexture> offline_FindShape(
+	const std::vector<std::shared_ptr<AnimatedHypertexture>>& shapes, const std::string& name)
+{
+	for(const auto& shape : shapes)
+		if(shape->m_name == name)
+			return shape;
+
+	char* end = nullptr;
+	const long index = strtol(name.c_str(), &end, 10);
+	if(*end == '\0' && index >= 0 && index < long(shapes.size()))
+		return shapes[index];
+	return nullptr;
+}
+
+// runs the GPU and worker tasks until the volume has caught up with its last update
+static void offline_WaitForVolume(const GpuHypertexture& gpuhtex)
+{
+	while(gpuhtex.IsUpdating())
+	{
+		gputask_Join();
+		gputask_Kick();
+		task_Update();
+		std::this_thread::yield();
+	}
+	gputask_Join();
+}
+
+static void offline_Draw(const Camera& camera, const AnimatedHypertexture& shape)
+{
+	const vec3 sundir = Normalize(g_sundir);
+	const GpuHypertexture* gpuhtex = shape.m_gpuhtex.get();
+
+	glClearColor(0.0f,0.0f,0.0f,1.f);
+	glClear(GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+
+	ground_Draw(camera, sundir, g_sunColor, gpuhtex);
+
+	const bool lowres = lowres_IsEnabled();
+	if(lowres)
+		lowres_Begin(g_screen.m_width, g_screen.m_height,
+			[&](){ ground_Draw(camera, sundir, g_sunColor, gpuhtex); });
+	shape.m_gpuhtex->Render(camera, sundir, g_sunColor);
+	if(lowres)
+		lowres_End(camera);
+
+	glDisable(GL_DEPTH_TEST);
+	checkGlError("offline_Draw");
+}
+
+// Draws just the ground, then marches the volume with raymarch.cpp and blends it over what was
+// read back. The ground's depth isn't used, which only matters for volumes that go through it.
+// pixels are BGRA like capture_SaveScreen reads them.
+static void offline_DrawCpu(const Camera& camera, const AnimatedHypertexture& shape,
+	int width, int height, std::vector<unsigned char>& pixels)
+{
+	const vec3 sundir = Normalize(g_sundir);
+	const GpuHypertexture& gpuhtex = *shape.m_gpuhtex;
+
+	glClearColor(0.0f,0.0f,0.0f,1.f);
+	glClear(GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	ground_Draw(camera, sundir, g_sunColor, &gpuhtex);
+	glDisable(GL_DEPTH_TEST);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, &pixels[0]);
+	checkGlError("offline_DrawCpu");
+
+	std::shared_ptr<RaymarchImage> image;
+	raymarch_RenderAsync(gpuhtex.GetRaymarchParams(sundir, g_sunColor), camera,
+		gpuhtex.ReadVolume(), width, height,
+		[&image](const std::shared_ptr<RaymarchImage>& result) { image = result; });
+	while(!image)
+	{
+		task_Update();
+		std::this_thread::yield();
+	}
+
+	for(size_t i = 0, numPixels = size_t(width) * height; i < numPixels; ++i)
+	{
+		const float* src = &image->m_data[i * 4];
+		unsigned char* dst = &pixels[i * 4];
+		for(int c = 0; c < 3; ++c)
+		{
+			unsigned char& channel = dst[2 - c];
+			channel = Min(255, int((src[c] + channel * (1.f / 255.f) * (1.f - src[3])) * 255.f + 0.5f));
+		}
+		dst[3] = 0xff;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+	OfflineOptions options;
+	if(!offline_ParseArgs(argc, argv, options))
+	{
+		offline_Usage();
+		return 1;
+	}
+	if(!offline_CreateContext())
+		return 1;
+
+	g_screen.Resize(options.m_width, options.m_height);
+	task_Startup(3);
+	render_Init();
+	hyper_Init();
+	lowres_Init();
+	htexdb_Init();
+	ground_Init();
+	capture_Init();
+
+	tweaker_LoadVars("tweaker.txt", g_tweakVars);
+	quality_SetAutoEnabled(false);
+	quality_SetTier(options.m_tier);
+	lowres_SetScale(options.m_volumeScale);
+	htexdb_SetCpuGenEnabled(options.m_cpuGen);
+	// CPU lighting has the density generated on the CPU too
+	hyper_SetCpuLightingEnabled(options.m_cpuMarch);
+
+	std::vector<std::shared_ptr<AnimatedHypertexture>> shapes = ParseHtexFile("volumes.txt");
+	std::shared_ptr<AnimatedHypertexture> shape = offline_FindShape(shapes, options.m_shape);
+	if(!shape || !shape->Valid())
+	{
+		std::cerr << "No shape " << options.m_shape << " in volumes.txt." << std::endl;
+		capture_Shutdown();
+		task_Shutdown();
+		return 1;
+	}
+	shape->Create();
+
+	Camera camera(30.f, g_screen.m_aspect);
+	camera.LookAt(g_focus, g_eye, Normalize(g_up));
+	camera.Compute();
+
+	Framebuffer target(options.m_width, options.m_height);
+	target.AddTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+	target.AddDepthTexture();
+	target.Create();
+
+	const bool streaming = !options.m_streamPath.empty();
+	if(streaming)
+	{
+		if(!capture_BeginStream(options.m_streamPath.c_str(), options.m_streamFormat, options.m_fps))
+		{
+			shape->Destroy();
+			capture_Shutdown();
+			task_Shutdown();
+			return 1;
+		}
+	}
+	else
+		mkdir(options.m_outDir.c_str(), S_IRWXU);
+	std::vector<unsigned char> pixels(options.m_width * options.m_height * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	Clock clock;
+	for(int frame = 0; frame < options.m_frameCount; ++frame)
+	{
+		shape->m_time = options.m_timeRange.Interpolate(frame / float(options.m_frameCount));
+		shape->Update(Normalize(g_sundir));
+		offline_WaitForVolume(*shape->m_gpuhtex);
+
+		target.Bind();
+		glViewport(0, 0, options.m_width, options.m_height);
+		std::stringstream sstr;
+		sstr << options.m_outDir << "/frame_" << frame << ".tga";
+		if(options.m_cpuMarch)
+		{
+			offline_DrawCpu(camera, *shape, options.m_width, options.m_height, pixels);
+			if(streaming)
+				capture_StreamPixels(options.m_width, options.m_height, &pixels[0]);
+			else
+				render_SaveTGA32(sstr.str().c_str(), options.m_width, options.m_height, &pixels[0]);
+		}
+		else
+		{
+			// read back and written while the next frames are made
+			offline_Draw(camera, *shape);
+			if(streaming)
+				capture_StreamScreen();
+			else
+				capture_SaveScreen(sstr.str().c_str());
+			capture_Update();
+		}
+	}
+	capture_Shutdown();
+	clock.Step();
+	// stdout may be the stream
+	(streaming ? std::cerr : std::cout) << options.m_frameCount << " frames in " << clock.GetDt() << " s" << std::endl;
+
+	shape->Destroy();
+	task_Shutdown();
+	return 0;
+}
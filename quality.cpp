@@ -0,0 +1,122 @@
+#include "quality.hh"
+#include "commonmath.hh"
+
+////////////////////////////////////////////////////////////////////////////////
+// The tier step counts are for a volume this many cells wide.
+static constexpr int kReferenceCells = 128;
+static constexpr int kMinSteps = 4;
+static constexpr int kMaxSteps = 256;
+
+static const QualitySteps kTierSteps[] = {
+	{ 24, 12, 12, 6 },
+	{ 40, 16, 20, 10 },
+	{ 64, 24, 32, 16 }, // what the shaders used to have hardcoded
+	{ 96, 32, 48, 24 },
+};
+static_assert(sizeof(kTierSteps) / sizeof(kTierSteps[0]) == QUALITY_NUM, "missing tier steps");
+
+static const char* kTierNames[] = {
+	"low",
+	"medium",
+	"high",
+	"ultra",
+};
+
+// The average frame time has to be this far over or under the budget before switching. Going
+// down happens quickly, going up waits longer so it doesn't flip back and forth.
+static constexpr float kFrameAverageRate = 0.1f;
+static constexpr float kLowerThreshold = 1.15f;
+static constexpr float kRaiseThreshold = 0.6f;
+static constexpr int kLowerFrames = 30;
+static constexpr int kRaiseFrames = 120;
+
+static int g_tier = QUALITY_High;
+static bool g_autoEnabled = true;
+static float g_frameBudget = 16.6f;
+static float g_frameAverage;
+static int g_framesSinceChange;
+
+////////////////////////////////////////////////////////////////////////////////
+static void ResetGovernor()
+{
+	g_frameAverage = 0.f;
+	g_framesSinceChange = 0;
+}
+
+void quality_SetTier(int tier)
+{
+	g_tier = Clamp(tier, 0, QUALITY_NUM - 1);
+	ResetGovernor();
+}
+
+int quality_GetTier()
+{
+	return g_tier;
+}
+
+const char* quality_GetTierName(int tier)
+{
+	return kTierNames[Clamp(tier, 0, QUALITY_NUM - 1)];
+}
+
+void quality_SetAutoEnabled(bool enabled)
+{
+	g_autoEnabled = enabled;
+	ResetGovernor();
+}
+
+bool quality_IsAutoEnabled()
+{
+	return g_autoEnabled;
+}
+
+void quality_SetFrameBudget(float ms)
+{
+	g_frameBudget = Max(ms, 1.f);
+	ResetGovernor();
+}
+
+float quality_GetFrameBudget()
+{
+	return g_frameBudget;
+}
+
+void quality_Update(float frameMs)
+{
+	if(!g_autoEnabled)
+		return;
+
+	if(g_framesSinceChange == 0)
+		g_frameAverage = frameMs;
+	else
+		g_frameAverage += kFrameAverageRate * (frameMs - g_frameAverage);
+	++g_framesSinceChange;
+
+	if(g_frameAverage > kLowerThreshold * g_frameBudget)
+	{
+		if(g_framesSinceChange >= kLowerFrames && g_tier > 0)
+			quality_SetTier(g_tier - 1);
+	}
+	else if(g_frameAverage < kRaiseThreshold * g_frameBudget)
+	{
+		if(g_framesSinceChange >= kRaiseFrames && g_tier < QUALITY_NUM - 1)
+			quality_SetTier(g_tier + 1);
+	}
+}
+
+static int ScaleSteps(int steps, int numCells)
+{
+	return Clamp(steps * numCells / kReferenceCells, kMinSteps, kMaxSteps);
+}
+
+QualitySteps quality_GetSteps(int numCells)
+{
+	const QualitySteps& steps = kTierSteps[g_tier];
+	QualitySteps result;
+	result.m_raymarch = ScaleSteps(steps.m_raymarch, numCells);
+	result.m_raymarchJittered = ScaleSteps(steps.m_raymarchJittered, numCells);
+	result.m_lighting = ScaleSteps(steps.m_lighting, numCells);
+	result.m_shadow = ScaleSteps(steps.m_shadow, numCells);
+	return result;
+}
+
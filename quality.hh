@@ -0,0 +1,36 @@
+#pragma once
+
+// Step counts for the hypertexture ray marches. The governor picks a tier from the measured
+// frame time so slower machines can keep their frame rate without editing the shaders.
+enum QualityTier {
+	QUALITY_Low,
+	QUALITY_Medium,
+	QUALITY_High,
+	QUALITY_Ultra,
+	QUALITY_NUM,
+};
+
+class QualitySteps
+{
+public:
+	int m_raymarch; // main render, per pixel
+	int m_raymarchJittered; // main render with the starts jittered and accumulated over frames
+	int m_lighting; // transmittance toward the sun, per cell
+	int m_shadow; // ground shadow, per texel
+};
+
+void quality_SetTier(int tier);
+int quality_GetTier();
+const char* quality_GetTierName(int tier);
+void quality_SetAutoEnabled(bool enabled);
+bool quality_IsAutoEnabled();
+void quality_SetFrameBudget(float ms);
+float quality_GetFrameBudget();
+
+// Feeds the governor the length of the last frame. Does nothing unless auto is enabled.
+void quality_Update(float frameMs);
+
+// Step counts for the current tier, scaled for a volume numCells wide so small volumes aren't
+// sampled as finely as big ones.
+QualitySteps quality_GetSteps(int numCells);
+
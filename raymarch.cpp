@@ -0,0 +1,448 @@
+#include "raymarch.hh"
+#include "density.hh"
+#include "lighting.hh"
+#include "camera.hh"
+#include "task.hh"
+#include <cmath>
+#include <cstring>
+
+// The packet march is built twice on x86 like the noise batches, once for AVX2 and once for the
+// baseline.
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYMARCH_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define RAYMARCH_CLONES
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+constexpr int RaymarchVolume::kEmptyCellSize;
+
+RaymarchVolume::RaymarchVolume(const std::shared_ptr<const DensityVolume>& density,
+	const std::shared_ptr<const TransmittanceVolume>& trans)
+	: m_density(density)
+	, m_trans(trans)
+	, m_numCells(density->m_numCells)
+	, m_numEmptyCells((m_numCells + kEmptyCellSize - 1) / kEmptyCellSize)
+	, m_emptyCells(size_t(m_numEmptyCells) * m_numEmptyCells * m_numEmptyCells)
+{
+	// filtering anywhere in a cell reads from the texel before it to the one after it
+	const int n = m_numCells;
+	const int numEmpty = m_numEmptyCells;
+	task_ParallelFor(0, numEmpty, 1, [&](int czBegin, int czEnd) {
+		for(int cz = czBegin; cz < czEnd; ++cz)
+		for(int cy = 0; cy < numEmpty; ++cy)
+		for(int cx = 0; cx < numEmpty; ++cx)
+		{
+			const int x0 = Max(0, cx * kEmptyCellSize - 1), x1 = Min(n - 1, (cx + 1) * kEmptyCellSize);
+			const int y0 = Max(0, cy * kEmptyCellSize - 1), y1 = Min(n - 1, (cy + 1) * kEmptyCellSize);
+			const int z0 = Max(0, cz * kEmptyCellSize - 1), z1 = Min(n - 1, (cz + 1) * kEmptyCellSize);
+			bool empty = true;
+			for(int z = z0; z <= z1 && empty; ++z)
+				for(int y = y0; y <= y1 && empty; ++y)
+				{
+					const unsigned char* row = density->GetSlice(z) + y * n;
+					for(int x = x0; x <= x1 && empty; ++x)
+						empty = row[x] == 0;
+				}
+			m_emptyCells[(cz * numEmpty + cy) * numEmpty + cx] = empty;
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same as GetExitPoint in shaders/raymarch_common.glsl, in texture space.
+static vec3 GetExitPoint(const vec3& pos, const vec3& ray)
+{
+	const float* p = &pos.x;
+	const float* r = &ray.x;
+	float t = 10.f;
+	for(int i = 0; i < 3; ++i)
+	{
+		if(fabsf(r[i]) > 0.001f)
+			t = Min(t, Max(-p[i] / r[i], (1.f - p[i]) / r[i]));
+	}
+	return pos + t * ray;
+}
+
+static float MiePhase(const float* phaseConstants, const vec3& L, const vec3& V)
+{
+	const float c = Dot(L, V);
+	return phaseConstants[0] * (c * c + 1.f) /
+		powf(phaseConstants[1] + phaseConstants[2] * c, 1.5f);
+}
+
+// Where the ray from pos along dir is inside the box from -1 to 1. False if it misses.
+static bool IntersectBox(const vec3& pos, const vec3& dir, float& tNear, float& tFar)
+{
+	const float* p = &pos.x;
+	const float* d = &dir.x;
+	tNear = -1e30f;
+	tFar = 1e30f;
+	for(int i = 0; i < 3; ++i)
+	{
+		if(fabsf(d[i]) < 1e-12f)
+		{
+			if(fabsf(p[i]) > 1.f)
+				return false;
+			continue;
+		}
+		const float t1 = (-1.f - p[i]) / d[i];
+		const float t2 = (1.f - p[i]) / d[i];
+		tNear = Max(tNear, Min(t1, t2));
+		tFar = Min(tFar, Max(t1, t2));
+	}
+	return tNear < tFar;
+}
+
+// Same as EmptySpaceSteps in shaders/emptyspace.glsl, with a single level.
+static int EmptySpaceSteps(const RaymarchVolume& volume, const float* pos, const float* step)
+{
+	const int numEmpty = volume.m_numEmptyCells;
+	const float cellSize = float(RaymarchVolume::kEmptyCellSize) / volume.m_numCells;
+	int cell[3];
+	for(int i = 0; i < 3; ++i)
+		cell[i] = Clamp(int(floorf(pos[i] / cellSize)), 0, numEmpty - 1);
+	if(!volume.IsCellEmpty(cell[0], cell[1], cell[2]))
+		return 0;
+
+	float tExit = 1e6f;
+	for(int i = 0; i < 3; ++i)
+	{
+		const float cellMin = cell[i] * cellSize;
+		const float dist = step[i] > 0.f ? cellMin + cellSize - pos[i] : pos[i] - cellMin;
+		tExit = Min(tExit, dist / Max(fabsf(step[i]), 1e-6f));
+	}
+	return Max(1, int(ceilf(tExit)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 8 rays are marched together, written with gcc vector extensions like the noise batches. Each
+// lane only gathers its own texels, the filtering and lighting math is done for all of them at
+// once. Lanes that are done keep going with a density of 0, which changes nothing.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef float Float8 __attribute__((vector_size(32)));
+typedef int Int8 __attribute__((vector_size(32)));
+
+static constexpr int kPacketWidth = 4;
+static constexpr int kPacketHeight = 2;
+static constexpr int kPacketSize = kPacketWidth * kPacketHeight;
+
+#define RAYMARCH8_INLINE static inline __attribute__((always_inline))
+
+// what each lane of a packet starts with, in texture space
+class RayPacket
+{
+public:
+	float m_start[3][kPacketSize];
+	float m_step[3][kPacketSize];
+	float m_len[kPacketSize];
+	float m_phase[kPacketSize];
+	int m_active[kPacketSize];
+};
+
+RAYMARCH8_INLINE Float8 Load8(const float* values)
+{
+	Float8 result;
+	memcpy(&result, values, sizeof(result));
+	return result;
+}
+
+// the texels linear filtering with clamping to the edge reads along one axis, and the weight
+RAYMARCH8_INLINE void TexelCoords8(const Float8& u, int numCells, Int8& i0, Int8& i1,
+	Float8& frac)
+{
+	const Float8 x = u * float(numCells) - 0.5f;
+	Float8 fl = __builtin_convertvector(__builtin_convertvector(x, Int8), Float8);
+	fl = fl > x ? fl - 1.f : fl;
+	frac = x - fl;
+	const Int8 zero = {};
+	const Int8 last = zero + (numCells - 1);
+	const Int8 i = __builtin_convertvector(fl, Int8);
+	i0 = i < zero ? zero : (i > last ? last : i);
+	const Int8 next = i + 1;
+	i1 = next < zero ? zero : (next > last ? last : next);
+}
+
+RAYMARCH8_INLINE Float8 Gather8(const unsigned char* data, const Int8& index)
+{
+	float values[kPacketSize];
+	for(int lane = 0; lane < kPacketSize; ++lane)
+		values[lane] = data[index[lane]];
+	return Load8(values);
+}
+
+RAYMARCH8_INLINE Float8 Mix8(const Float8& x, const Float8& y, const Float8& a)
+{
+	return x + (y - x) * a;
+}
+
+// Trilinear filtering of channel of a texture with numChannels 8 bit channels, like texture()
+// on the GPU.
+RAYMARCH8_INLINE Float8 Sample8(const unsigned char* data, int numCells, int numChannels,
+	int channel, const Int8 (&x)[2], const Int8 (&y)[2], const Int8 (&z)[2], const Float8 (&f)[3])
+{
+	Float8 zlerp[2];
+	for(int k = 0; k < 2; ++k)
+	{
+		Float8 ylerp[2];
+		for(int j = 0; j < 2; ++j)
+		{
+			const Int8 row = (z[k] * numCells + y[j]) * numCells;
+			ylerp[j] = Mix8(Gather8(data, (row + x[0]) * numChannels + channel),
+				Gather8(data, (row + x[1]) * numChannels + channel), f[0]);
+		}
+		zlerp[k] = Mix8(ylerp[0], ylerp[1], f[1]);
+	}
+	return Mix8(zlerp[0], zlerp[1], f[2]) * (1.f / 255.f);
+}
+
+// The loop in the fragment shader of shaders/hypertexture.glsl for each lane. out gets the
+// color and alpha of each lane the way Render blends them over black.
+RAYMARCH_CLONES
+static void MarchPacket(const RaymarchParams& params, const RaymarchVolume& volume,
+	const RayPacket& rays, float (*out)[4])
+{
+	const int numCells = volume.m_numCells;
+	const int numSteps = params.m_numSteps;
+	const unsigned char* density = &volume.m_density->m_data[0];
+	const unsigned char* trans = &volume.m_trans->m_data[0];
+
+	const Float8 zero = {};
+	const Float8 one = zero + 1.f;
+	const Float8 start[3] = { Load8(rays.m_start[0]), Load8(rays.m_start[1]),
+		Load8(rays.m_start[2]) };
+	const Float8 step[3] = { Load8(rays.m_step[0]), Load8(rays.m_step[1]),
+		Load8(rays.m_step[2]) };
+	const Float8 len = Load8(rays.m_len);
+	const Float8 phase = Load8(rays.m_phase);
+
+	// optical depth and light per unit of density over a step
+	const float* absorptionColor = &params.m_absorptionColor.r;
+	const float* sunColor = &params.m_sunColor.r;
+	const float* color = &params.m_color.r;
+	Float8 depthFactor[3], lightFactor[3];
+	for(int c = 0; c < 3; ++c)
+	{
+		depthFactor[c] = params.m_absorption * absorptionColor[c] * params.m_densityMult * len;
+		lightFactor[c] = sunColor[c] * color[c] * params.m_densityMult * phase * len;
+	}
+
+	Float8 T[3] = { one, one, one };
+	Float8 curColor[3] = { zero, zero, zero };
+	int steps[kPacketSize] = {};
+	int active[kPacketSize];
+	memcpy(active, rays.m_active, sizeof(active));
+
+	for(;;)
+	{
+		// step each lane over the empty cells first
+		int numActive = 0;
+		float stepIndex[kPacketSize], mask[kPacketSize];
+		for(int lane = 0; lane < kPacketSize; ++lane)
+		{
+			if(active[lane])
+			{
+				const float laneStep[3] = { rays.m_step[0][lane], rays.m_step[1][lane],
+					rays.m_step[2][lane] };
+				while(steps[lane] < numSteps)
+				{
+					const float pos[3] = {
+						rays.m_start[0][lane] + float(steps[lane]) * laneStep[0],
+						rays.m_start[1][lane] + float(steps[lane]) * laneStep[1],
+						rays.m_start[2][lane] + float(steps[lane]) * laneStep[2] };
+					const int skip = EmptySpaceSteps(volume, pos, laneStep);
+					if(skip == 0)
+						break;
+					steps[lane] += skip;
+				}
+				active[lane] = steps[lane] < numSteps;
+			}
+			numActive += active[lane];
+			stepIndex[lane] = active[lane] ? float(steps[lane]) : 0.f;
+			mask[lane] = active[lane] ? 1.f : 0.f;
+		}
+		if(numActive == 0)
+			break;
+
+		const Float8 i = Load8(stepIndex);
+		const Float8 pos[3] = { start[0] + i * step[0], start[1] + i * step[1],
+			start[2] + i * step[2] };
+		Int8 x[2], y[2], z[2];
+		Float8 f[3];
+		TexelCoords8(pos[0], numCells, x[0], x[1], f[0]);
+		TexelCoords8(pos[1], numCells, y[0], y[1], f[1]);
+		TexelCoords8(pos[2], numCells, z[0], z[1], f[2]);
+
+		const Float8 sample = Sample8(density, numCells, 1, 0, x, y, z, f) * Load8(mask);
+		for(int c = 0; c < 3; ++c)
+		{
+			const Float8 opticalDepth = depthFactor[c] * sample;
+			float tlocal[kPacketSize];
+			for(int lane = 0; lane < kPacketSize; ++lane)
+				tlocal[lane] = expf(-opticalDepth[lane]);
+			const Float8 Tlocal = Load8(tlocal);
+			// the transmittance integrated over the step
+			const Float8 Tstep = opticalDepth < 1e-4f ? one :
+				(1.f - Tlocal) / (opticalDepth < 1e-4f ? one : opticalDepth);
+			const Float8 light = Sample8(trans, numCells, 3, c, x, y, z, f);
+			curColor[c] += T[c] * Tstep * light * lightFactor[c] * sample;
+			T[c] *= Tlocal;
+		}
+
+		for(int lane = 0; lane < kPacketSize; ++lane)
+		{
+			if(!active[lane])
+				continue;
+			if(T[0][lane] < 0.001f && T[1][lane] < 0.001f && T[2][lane] < 0.001f)
+				active[lane] = 0;
+			else
+				++steps[lane];
+		}
+	}
+
+	const Float8 alpha = 1.f - (T[0] + T[1] + T[2]) * (1.f / 3.f);
+	for(int lane = 0; lane < kPacketSize; ++lane)
+	{
+		for(int c = 0; c < 3; ++c)
+			out[lane][c] = curColor[c][lane] * alpha[lane];
+		out[lane][3] = alpha[lane];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The tiles don't share anything, so any number of threads can march them at once.
+class RaymarchTiles
+{
+public:
+	static constexpr int kTileSize = 16;
+
+	RaymarchTiles(const RaymarchParams& params, const Camera& camera,
+		const RaymarchVolume& volume, RaymarchImage& image);
+	void MarchTile(int tile);
+	int GetNumTiles() const { return m_numTiles; }
+private:
+	// false if the pixel is outside the image or its ray misses the box
+	bool SetupRay(int x, int y, RayPacket& rays, int lane) const;
+
+	RaymarchParams m_params;
+	const RaymarchVolume& m_volume;
+	RaymarchImage& m_image;
+	mat4 m_viewToModel;
+	vec3 m_eyePos; // in model space
+	float m_projScale[2];
+	float m_projOffset[2];
+	int m_numTilesX;
+	int m_numTiles;
+};
+
+constexpr int RaymarchTiles::kTileSize;
+
+RaymarchTiles::RaymarchTiles(const RaymarchParams& params, const Camera& camera,
+	const RaymarchVolume& volume, RaymarchImage& image)
+	: m_params(params)
+	, m_volume(volume)
+	, m_image(image)
+	, m_numTilesX((image.m_width + kTileSize - 1) / kTileSize)
+	, m_numTiles(m_numTilesX * ((image.m_height + kTileSize - 1) / kTileSize))
+{
+	const mat4 modelInv = AffineInverse(params.m_model);
+	m_viewToModel = modelInv * AffineInverse(camera.GetView());
+	m_eyePos = TransformPoint(modelInv, camera.GetPos());
+	const mat4& proj = camera.GetProj();
+	m_projScale[0] = proj.m[0];
+	m_projScale[1] = proj.m[5];
+	m_projOffset[0] = proj.m[8];
+	m_projOffset[1] = proj.m[9];
+}
+
+// The shader starts where the pixel sees the front of the box, and goes along the ray from the
+// eye in texture space.
+bool RaymarchTiles::SetupRay(int x, int y, RayPacket& rays, int lane) const
+{
+	for(int i = 0; i < 3; ++i)
+	{
+		rays.m_start[i][lane] = 0.5f;
+		rays.m_step[i][lane] = 0.f;
+	}
+	rays.m_len[lane] = 0.f;
+	rays.m_phase[lane] = 0.f;
+	rays.m_active[lane] = 0;
+	if(x >= m_image.m_width || y >= m_image.m_height)
+		return false;
+
+	const float ndcX = (x + 0.5f) * 2.f / m_image.m_width - 1.f;
+	const float ndcY = (y + 0.5f) * 2.f / m_image.m_height - 1.f;
+	const vec3 dir = TransformVec(m_viewToModel, vec3((ndcX + m_projOffset[0]) / m_projScale[0],
+		(ndcY + m_projOffset[1]) / m_projScale[1], -1.f));
+	float tNear, tFar;
+	if(!IntersectBox(m_eyePos, dir, tNear, tFar) || tNear <= 0.f)
+		return false;
+
+	const vec3 ray = Normalize(dir);
+	const vec3 start = (m_eyePos + tNear * dir) * 0.5f + vec3(0.5f);
+	const vec3 step = (GetExitPoint(start, ray) - start) / float(m_params.m_numSteps);
+	for(int i = 0; i < 3; ++i)
+	{
+		rays.m_start[i][lane] = (&start.x)[i];
+		rays.m_step[i][lane] = (&step.x)[i];
+	}
+	rays.m_len[lane] = Length(step);
+	rays.m_phase[lane] = MiePhase(m_params.m_phaseConstants, m_params.m_sundir, -ray);
+	rays.m_active[lane] = 1;
+	return true;
+}
+
+void RaymarchTiles::MarchTile(int tile)
+{
+	const int x0 = (tile % m_numTilesX) * kTileSize;
+	const int y0 = (tile / m_numTilesX) * kTileSize;
+	const int xEnd = Min(x0 + kTileSize, m_image.m_width);
+	const int yEnd = Min(y0 + kTileSize, m_image.m_height);
+	for(int py = y0; py < yEnd; py += kPacketHeight)
+	for(int px = x0; px < xEnd; px += kPacketWidth)
+	{
+		RayPacket rays;
+		bool anyHit = false;
+		for(int lane = 0; lane < kPacketSize; ++lane)
+			anyHit |= SetupRay(px + lane % kPacketWidth, py + lane / kPacketWidth, rays, lane);
+
+		float out[kPacketSize][4] = {};
+		if(anyHit)
+			MarchPacket(m_params, m_volume, rays, out);
+
+		for(int lane = 0; lane < kPacketSize; ++lane)
+		{
+			const int x = px + lane % kPacketWidth, y = py + lane / kPacketWidth;
+			if(x < xEnd && y < yEnd)
+				memcpy(m_image.GetPixel(x, y), out[lane], sizeof(out[lane]));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void raymarch_Render(const RaymarchParams& params, const Camera& camera,
+	const RaymarchVolume& volume, RaymarchImage& image)
+{
+	RaymarchTiles tiles(params, camera, volume, image);
+	task_ParallelFor(0, tiles.GetNumTiles(), 1, [&tiles](int begin, int end) {
+		for(int tile = begin; tile < end; ++tile)
+			tiles.MarchTile(tile);
+	});
+}
+
+void raymarch_RenderAsync(const RaymarchParams& params, const Camera& camera,
+	const std::shared_ptr<const RaymarchVolume>& volume, int width, int height,
+	std::function<void(const std::shared_ptr<RaymarchImage>&)> onComplete)
+{
+	auto image = std::make_shared<RaymarchImage>(width, height);
+	task_AppendTask(std::make_shared<Task>(
+		nullptr,
+		[image, onComplete]() {
+			if(onComplete)
+				onComplete(image);
+		},
+		[params, camera, volume, image]() {
+			raymarch_Render(params, camera, *volume, *image);
+		}));
+}
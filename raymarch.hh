@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include "vec.hh"
+#include "matrix.hh"
+#include "commonmath.hh"
+
+class Camera;
+class DensityVolume;
+class TransmittanceVolume;
+
+// CPU version of shaders/hypertexture.glsl, the main ray march of a volume. It does what
+// GpuHypertexture::Render does without jittering, so it can be used where there's no GPU and
+// as a reference for the faster modes. The screen is split into tiles which are marched on the
+// worker threads, 8 rays at a time.
+class RaymarchParams
+{
+public:
+	mat4 m_model; // places the box from -1 to 1 the volume fills
+	vec3 m_sundir; // normalized, pointing toward the sun
+	Color m_sunColor;
+	float m_absorption;
+	float m_phaseConstants[3]; // like GpuHypertexture's
+	Color m_color;
+	float m_densityMult;
+	Color m_absorptionColor;
+	int m_numSteps;
+};
+
+// The density and transmittance textures Render samples. The cells of the density that linear
+// filtering can only read 0 from anywhere inside are found when it's made, so the march can step
+// over them like the max density pyramid lets the shader do.
+class RaymarchVolume
+{
+public:
+	static constexpr int kEmptyCellSize = 4; // density texels per axis
+
+	RaymarchVolume(const std::shared_ptr<const DensityVolume>& density,
+		const std::shared_ptr<const TransmittanceVolume>& trans);
+	bool IsCellEmpty(int x, int y, int z) const
+		{ return m_emptyCells[(z * m_numEmptyCells + y) * m_numEmptyCells + x]; }
+
+	std::shared_ptr<const DensityVolume> m_density;
+	std::shared_ptr<const TransmittanceVolume> m_trans;
+	int m_numCells;
+	int m_numEmptyCells; // per axis
+	std::vector<unsigned char> m_emptyCells;
+};
+
+// What Render blends over black, the light scattered toward the camera times alpha, and alpha.
+// Rows go bottom up like glReadPixels.
+class RaymarchImage
+{
+public:
+	RaymarchImage(int width, int height)
+		: m_width(width), m_height(height), m_data(size_t(width) * height * 4) {}
+	float* GetPixel(int x, int y) { return &m_data[(size_t(y) * m_width + x) * 4]; }
+	const float* GetPixel(int x, int y) const { return &m_data[(size_t(y) * m_width + x) * 4]; }
+
+	int m_width;
+	int m_height;
+	std::vector<float> m_data;
+};
+
+// Marches the tiles with task_ParallelFor, so the calling thread helps the workers, and returns
+// once they're done.
+void raymarch_Render(const RaymarchParams& params, const Camera& camera,
+	const RaymarchVolume& volume, RaymarchImage& image);
+// Renders with raymarch_Render from a worker thread. onComplete is called from task_Update on
+// the main thread once it's done.
+void raymarch_RenderAsync(const RaymarchParams& params, const Camera& camera,
+	const std::shared_ptr<const RaymarchVolume>& volume, int width, int height,
+	std::function<void(const std::shared_ptr<RaymarchImage>&)> onComplete);
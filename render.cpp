@@ -14,6 +14,7 @@
 #include "commonmath.hh"
 #include "vec.hh"
 #include "camera.hh"
+#include "hashmap.hh"
 
 ////////////////////////////////////////////////////////////////////////////////
 #define VTX_BUFFER 0
@@ -364,6 +365,7 @@ ShaderInfo::ShaderInfo(const std::string& filename)
 	: m_program(0)
 	, m_customSpec()
 	, m_custom()
+	, m_sourceHash(0)
 	, m_filename(filename)
 {
 	std::fill(m_uniforms,m_uniforms+BIND_NUM, -1);
@@ -377,6 +379,7 @@ ShaderInfo::ShaderInfo(const std::string& filename, const std::vector<CustomShad
 	, m_custom(
 		std::minmax_element(customSpec.begin(), customSpec.end(), 
 			[](const CustomShaderAttr& a, const CustomShaderAttr& b){return a.m_id < b.m_id;}).second->m_id + 1, -1)
+	, m_sourceHash(0)
 	, m_filename(filename)
 {
 	std::fill(m_uniforms,m_uniforms+BIND_NUM, -1);
@@ -580,6 +583,9 @@ void ShaderInfo::Recompile()
 
 	std::vector<ShaderChunk> chunks;
 	CompileShaderSources(m_filename, chunks);
+	m_sourceHash = kHash64Seed;
+	for(const ShaderChunk& chunk : chunks)
+		m_sourceHash = MakeHash64(chunk.m_source.data(), chunk.m_source.size(), m_sourceHash);
 	CompileShaderChunks(chunks);
 
 	glLinkProgram(m_program);
@@ -679,6 +685,7 @@ void render_SetTextureParameters(int sWrap, int tWrap, int magFilter, int minFil
 Framebuffer::Framebuffer(int width, int height, int layers)
 	: m_fbo(0)
 	, m_rboDepth(0)
+	, m_depthTex(0)
 	, m_hasStencil(false)
 	, m_width(width)
 	, m_height(height)
@@ -690,6 +697,7 @@ Framebuffer::Framebuffer(int width, int height, int layers)
 Framebuffer::Framebuffer(Framebuffer&& other)
 	: m_fbo(0)
 	, m_rboDepth(0)
+	, m_depthTex(0)
 	, m_hasStencil(false)
 	, m_width(0)
 	, m_height(0)
@@ -698,6 +706,7 @@ Framebuffer::Framebuffer(Framebuffer&& other)
 {
 	std::swap(m_fbo, other.m_fbo);
 	std::swap(m_rboDepth, other.m_rboDepth);
+	std::swap(m_depthTex, other.m_depthTex);
 	std::swap(m_hasStencil, other.m_hasStencil);
 	std::swap(m_width, other.m_width);
 	std::swap(m_height, other.m_height);
@@ -711,6 +720,8 @@ Framebuffer::~Framebuffer()
 		glDeleteTextures(1, &info.tex);
 	if(m_rboDepth)
 		glDeleteRenderbuffers(1, &m_rboDepth);
+	if(m_depthTex)
+		glDeleteTextures(1, &m_depthTex);
 	if(m_fbo)
 		glDeleteFramebuffers(1, &m_fbo);
 }
@@ -725,6 +736,17 @@ void Framebuffer::AddDepth(bool stencil)
 	glBindRenderbuffer(GL_RENDERBUFFER, 0);
 }
 
+void Framebuffer::AddDepthTexture()
+{
+	glGenTextures(1, &m_depthTex);
+	glBindTexture(GL_TEXTURE_2D, m_depthTex);
+	render_SetTextureParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_width, m_height, 0, 
+		GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0);
+	checkGlError("Framebuffer::AddDepthTexture");
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 void Framebuffer::AddTexture(int internalFormat, int format, int dataType)
 {
 	GLuint tex;
@@ -737,7 +759,7 @@ void Framebuffer::AddTexture(int internalFormat, int format, int dataType)
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
-void Framebuffer::AddTexture3D(int internalFormat, int format, int dataType)
+void Framebuffer::AddTexture3D(int internalFormat, int format, int dataType, int numLevels)
 {
 	GLuint tex;
 	glGenTextures(1, &tex);
@@ -747,8 +769,13 @@ void Framebuffer::AddTexture3D(int internalFormat, int format, int dataType)
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, m_width, m_height, m_layers, 0, format,
-		dataType, 0);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+	for(int level = 0; level < numLevels; ++level)
+	{
+		glTexImage3D(GL_TEXTURE_3D, level, internalFormat, 
+			Max(1, m_width >> level), Max(1, m_height >> level), Max(1, m_layers >> level), 0, 
+			format, dataType, 0);
+	}
 	m_tbo.emplace_back(GL_TEXTURE_3D, tex);
 	checkGlError("FrameBuffer::AddTexture3D");
 	glBindTexture(GL_TEXTURE_3D, 0);
@@ -760,6 +787,14 @@ void Framebuffer::Create()
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 	glFramebufferRenderbuffer(GL_FRAMEBUFFER, m_hasStencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
 		GL_RENDERBUFFER, m_rboDepth);
+	if(m_depthTex)
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_depthTex, 0);
+	if(m_tbo.empty())
+	{
+		// depth only
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+	}
 	for(int i = 0, c = m_tbo.size(); i < c; ++i)
 	{
 		if(m_tbo[i].type == GL_TEXTURE_2D) {
@@ -768,6 +803,14 @@ void Framebuffer::Create()
 			glFramebufferTexture3D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_3D, m_tbo[i].tex, 0, 0);
 		}
 	}
+	if(m_tbo.size() > 1)
+	{
+		// draw to all of them, in order
+		std::vector<GLenum> drawBuffers;
+		for(int i = 0, c = m_tbo.size(); i < c; ++i)
+			drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+		glDrawBuffers(drawBuffers.size(), &drawBuffers[0]);
+	}
 	GLuint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 	if(status != GL_FRAMEBUFFER_COMPLETE)
 	{
@@ -780,12 +823,12 @@ void Framebuffer::Bind() const
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 }
 	
-void Framebuffer::BindLayer(int layer) const
+void Framebuffer::BindLayer(int layer, int level) const
 {
 	for(int i = 0, c = m_tbo.size(); i < c; ++i)
 	{
 		if(m_tbo[i].type == GL_TEXTURE_3D) {
-			glFramebufferTexture3D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_3D, m_tbo[i].tex, 0, layer);
+			glFramebufferTexture3D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_3D, m_tbo[i].tex, level, layer);
 		}
 	}
 	GLuint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
@@ -886,6 +929,20 @@ enum TGAImageDescFlags
 };
 
 void render_SaveTGA(const char* filename, int w, int h, unsigned char* bytes)
+{
+	std::vector<unsigned int> bgra(size_t(w) * h);
+	for(size_t i = 0, offset = 0; i < bgra.size(); ++i, offset += 3)
+	{
+		bgra[i] = 
+			0xff000000 |
+			(bytes[offset] << 16) |
+			(bytes[offset+1] << 8) |
+			(bytes[offset+2]);
+	}
+	render_SaveTGA32(filename, w, h, reinterpret_cast<const unsigned char*>(&bgra[0]));
+}
+
+void render_SaveTGA32(const char* filename, int w, int h, const unsigned char* bgra)
 {
 	std::ofstream out(filename, std::ios_base::binary | std::ios_base::out);
 	if(!out) {
@@ -913,18 +970,8 @@ void render_SaveTGA(const char* filename, int w, int h, unsigned char* bytes)
 	out.write(reinterpret_cast<const char*>(&header.m_bpp), sizeof(header.m_bpp));
 	out.write(reinterpret_cast<const char*>(&header.m_desc), sizeof(header.m_desc));
 
-	for(int offset = 0, y = h - 1; y>=0; --y)
-	{
-		for(int x = 0; x < w; ++x, offset += 3)
-		{
-			unsigned int data = 
-				0xff000000 |
-				(bytes[offset] << 16) |
-				(bytes[offset+1] << 8) |
-				(bytes[offset+2]);
-			out.write(reinterpret_cast<const char*>(&data), sizeof(data));
-		}
-	}
+	// rows are bottom up like glReadPixels, which is the default for TGA
+	out.write(reinterpret_cast<const char*>(bgra), std::streamsize(w) * h * 4);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -57,7 +57,10 @@ void render_RefreshShaders();
 void render_SetTextureParameters(int sWrap = GL_REPEAT, int tWrap = GL_REPEAT,
 	int magFilter = GL_LINEAR, int minFilter = GL_LINEAR_MIPMAP_LINEAR);
 void render_SaveScreen(const char* filename);
+// bytes are RGB rows from the bottom up, like glReadPixels returns them
 void render_SaveTGA(const char* filename, int w, int h, unsigned char* bytes);
+// Same with BGRA pixels, the way the file stores them, so they're written as they are.
+void render_SaveTGA32(const char* filename, int w, int h, const unsigned char* bgra);
 void render_drawDebugTexture(GLuint dbgTex, bool splitChannels);
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -116,12 +119,14 @@ public:
 	~ShaderInfo();
 	
 	void Recompile();
+	const std::string& GetFilename() const { return m_filename; }
 
 	GLuint m_program;
 	GLint m_uniforms[BIND_NUM];	
 	GLint m_attrs[GEOM_NUM];
 	std::vector<CustomShaderAttr> m_customSpec;
 	std::vector<GLint> m_custom;
+	unsigned long long m_sourceHash; // of the source with the includes, changes on reload
 private:
 	class ShaderChunk {
 	public:
@@ -183,13 +188,19 @@ public:
 	Framebuffer& operator=(const Framebuffer&) = delete;
 
 	void AddDepth(bool stencil = false);
+	// depth that can be sampled afterwards, instead of AddDepth
+	void AddDepthTexture();
 	void AddTexture(int internalFormat, int format, int dataType);
-	void AddTexture3D(int internalFormat, int format, int dataType);
+	// numLevels > 1 allocates a mip chain, the levels can be rendered to with BindLayer
+	void AddTexture3D(int internalFormat, int format, int dataType, int numLevels = 1);
 	GLuint GetTexture(int index) const { return m_tbo[index].tex; }
+	GLuint GetDepthTexture() const { return m_depthTex; }
+	int GetWidth() const { return m_width; }
+	int GetHeight() const { return m_height; }
 	void Create();
 
 	void Bind() const;
-	void BindLayer(int layer) const;
+	void BindLayer(int layer, int level = 0) const;
 
 	void CopyTexture(int index, GLuint destTex, int internalFormat) const;
 private:
@@ -200,6 +211,7 @@ private:
 	};
 	GLuint m_fbo;
 	GLuint m_rboDepth;
+	GLuint m_depthTex;
 	bool m_hasStencil;
 	int m_width;
 	int m_height;
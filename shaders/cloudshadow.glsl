@@ -19,9 +19,10 @@ void main()
 }
 #endif
 
-#define NUM_STEPS 16
+uniform int numSteps = 16;
 
 #include "shaders/raymarch_common.glsl"
+#include "shaders/emptyspace.glsl"
 
 #ifdef FRAGMENT_P
 in vec3 vCoord;
@@ -33,17 +34,26 @@ void main()
 	vec3 ray = normalize(vRay);
 	vec3 position = vCoord;
 	vec3 exitPt = GetExitPoint(position, ray);
-	vec3 step = (exitPt - position)/NUM_STEPS;
+	vec3 step = (exitPt - position)/float(numSteps);
 	float len = length(step);
 
 	vec3 Tfactor = -absorption * len * absorptionColor * densityMult;
 
 	float sampleSum = 0.0;
-	for(int i = 0; i < NUM_STEPS; ++i)
+	vec3 start = position;
+	int i = 0;
+	while(i < numSteps)
 	{
+		position = start + float(i) * step;
+		int skip = EmptySpaceSteps(position, step);
+		if(skip > 0)
+		{
+			i += skip;
+			continue;
+		}
 		float sample = texture(densityMap, position).r;
 		sampleSum += sample;
-		position += step;
+		++i;
 	}
 
 	vec3 T = exp(Tfactor * sampleSum);
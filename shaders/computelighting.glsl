@@ -14,22 +14,32 @@ void main()
 }
 #endif
 
-#define NUM_LIGHTING_STEPS 32 
+uniform int numLightingSteps = 32;
 
 #include "shaders/raymarch_common.glsl"
+#include "shaders/emptyspace.glsl"
 
 vec3 computeLightingTransmittance(vec3 pos)
 {
 	vec3 exitPt = GetExitPoint(pos, sundir);
-	vec3 step = (exitPt - pos) / NUM_LIGHTING_STEPS;
+	vec3 step = (exitPt - pos) / float(numLightingSteps);
 	float len = length(step);
 	vec3 factor = -absorption * scatteringColor * len * densityMult;
 	float densitySum = 0.0;
-	for(int i = 0; i < NUM_LIGHTING_STEPS; ++i)
+	vec3 start = pos;
+	int i = 0;
+	while(i < numLightingSteps)
 	{
+		pos = start + float(i) * step;
+		int skip = EmptySpaceSteps(pos, step);
+		if(skip > 0)
+		{
+			i += skip;
+			continue;
+		}
 		float rho = texture(densityMap, pos).x ;
 		densitySum += rho;
-		pos += step;
+		++i;
 	}
 	vec3 T = exp(factor * densitySum);
 	return T;	
@@ -0,0 +1,21 @@
+// full resolution depth
+uniform sampler2D depthMap;
+// size of the target
+uniform vec2 targetSize;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#ifdef FRAGMENT_P
+void main()
+{
+	// the full resolution texel under the middle of this one
+	vec2 scale = vec2(textureSize(depthMap, 0)) / targetSize;
+	gl_FragDepth = texelFetch(depthMap, ivec2(gl_FragCoord.xy * scale), 0).r;
+}
+#endif
@@ -0,0 +1,38 @@
+
+// Max density pyramid built by shaders/maxdensity.glsl. Level 0 cells cover 4^3 density 
+// texels plus the neighbours linear filtering reads, so a cell with a max of 0 can't return 
+// anything but 0 anywhere inside it. maxDensityLevels is 0 when skipping is disabled.
+uniform sampler3D maxDensityMap;
+uniform int maxDensityLevels = 0;
+
+// Cells are looked up with texelFetch so the bounds used for skipping are exactly the ones of
+// the cell that was tested. The size comes from level 0 because textureSize with a lod that 
+// varies per fragment isn't reliable everywhere.
+ivec3 MaxDensityCell(vec3 pos, int level, out vec3 cellSize)
+{
+	ivec3 size = max(textureSize(maxDensityMap, 0) >> level, ivec3(1));
+	cellSize = 1.0 / vec3(size);
+	return clamp(ivec3(floor(pos * vec3(size))), ivec3(0), size - ivec3(1));
+}
+
+// Returns how many steps from pos stay inside the coarsest empty cell containing it, or 0 if 
+// pos isn't in an empty cell. The samples that are skipped would have all read 0.
+int EmptySpaceSteps(vec3 pos, vec3 step)
+{
+	int level = -1;
+	vec3 cellSize;
+	for(int i = 0; i < maxDensityLevels; ++i)
+	{
+		if(texelFetch(maxDensityMap, MaxDensityCell(pos, i, cellSize), i).r > 0.0)
+			break;
+		level = i;
+	}
+	if(level < 0)
+		return 0;
+
+	vec3 cellMin = vec3(MaxDensityCell(pos, level, cellSize)) * cellSize;
+	vec3 dist = mix(pos - cellMin, cellMin + cellSize - pos, greaterThan(step, vec3(0)));
+	vec3 t = dist / max(abs(step), vec3(1e-6));
+	float tExit = min(min(t.x, t.y), t.z);
+	return max(1, int(ceil(min(tExit, 1e6))));
+}
@@ -1,4 +1,7 @@
+#extension GL_ARB_explicit_attrib_location : require
+
 uniform mat4 mvp;
+uniform mat4 modelView;
 uniform sampler3D densityMap;
 uniform sampler3D transMap;
 uniform vec3 eyePosInModel;
@@ -23,7 +26,11 @@ void main()
 }
 #endif
 
-#define NUM_STEPS 64
+uniform int numSteps = 64;
+// Blue noise to offset the start of the march by, as a fraction of a step. It's shifted by
+// jitterOffset every frame, negative starts at the box.
+uniform sampler2D jitterMap;
+uniform float jitterOffset = -1.0;
 
 uniform vec3 phaseConstants;
 // x = (3.0/2.0) * (1.f - g2) / (2.f + g2)
@@ -47,18 +54,21 @@ vec3 GetLight(vec3 pos, vec3 V)
 }
 
 #include "shaders/raymarch_common.glsl"
+#include "shaders/emptyspace.glsl"
 
 #ifdef FRAGMENT_P
 in vec3 vCoord;
 in vec3 vRay;
-out vec4 outColor;
+layout(location = 0) out vec4 outColor;
+// where the volume is seen, for reprojecting it into another frame
+layout(location = 1) out vec4 outDistance;
 
 void main()
 {
 	vec3 ray = normalize(vRay);
 	vec3 position = vCoord;
 	vec3 exitPt = GetExitPoint(position, ray);
-	vec3 step = (exitPt - position)/NUM_STEPS;
+	vec3 step = (exitPt - position)/float(numSteps);
 	float len = length(step);
 
 	vec3 curColor = vec3(0);
@@ -66,18 +76,41 @@ void main()
 	vec3 Tfactor = -absorption * len * absorptionColor * densityMult;
 	vec3 colorFactor = color * len * densityMult;
 
-	for(int i = 0; i < NUM_STEPS; ++i)
+	vec3 start = position;
+	if(jitterOffset >= 0.0)
 	{
-		float sample = texture(densityMap, position).r;
-		vec3 Tlocal = exp(Tfactor * sample);
-		T *= Tlocal;
+		ivec2 jitterTexel = ivec2(gl_FragCoord.xy) % textureSize(jitterMap, 0);
+		start += fract(texelFetch(jitterMap, jitterTexel, 0).r + jitterOffset) * step;
+	}
+	vec3 seenSum = vec3(0);
+	int i = 0;
+	while(i < numSteps)
+	{
+		position = start + float(i) * step;
+		int skip = EmptySpaceSteps(position, step);
+		if(skip > 0)
+		{
+			i += skip;
+			continue;
+		}
 
-		vec3 colorIn = T * GetLight(position, -ray) * colorFactor * sample;
+		float sample = texture(densityMap, position).r;
+		vec3 opticalDepth = -Tfactor * sample;
+		vec3 Tlocal = exp(-opticalDepth);
+		// What's seen of the whole step, the transmittance integrated over it. Just taking the
+		// transmittance at the end of it gets darker the fewer steps there are.
+		vec3 Tstep = mix((1.0 - Tlocal) / max(opticalDepth, vec3(1e-4)), vec3(1.0), 
+			lessThan(opticalDepth, vec3(1e-4)));
+
+		vec3 colorIn = T * Tstep * GetLight(position, -ray) * colorFactor * sample;
 		curColor += colorIn;
 
+		seenSum += dot(T - T * Tlocal, vec3(1.0/3.0)) * position;
+		T *= Tlocal;
+
 		if(all(lessThan(T,vec3(0.001))))
 			break;
-		position += step;
+		++i;
 	}
 
 	// alpha is just 1-T for the final transmittance value
@@ -85,6 +118,11 @@ void main()
 	float alpha = 1 - avgT;
 
 	outColor = vec4(curColor, alpha);
+
+	// the samples weighted by how much they hide, those add up to alpha
+	vec3 seenPos = alpha > 0.0 ? seenSum / alpha : vCoord;
+	float dist = -(modelView * vec4(seenPos * 2.0 - 1.0, 1.0)).z;
+	outDistance = vec4(dist, 0, 0, alpha);
 }
 #endif
 
@@ -0,0 +1,32 @@
+uniform float absorption;
+uniform float densityMult = 1.0;
+uniform vec3 scatteringColor = vec3(1,1,1);
+// depths from shaders/lightingsweep.glsl, layer s is the s'th slice swept
+uniform sampler3D depthMap;
+uniform int layer;
+// the slice, texel and row axes of the sweep
+uniform ivec3 sweepAxes;
+// 1 if the sun is toward the higher slices, so they were swept from the top down
+uniform int sliceDir;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#ifdef FRAGMENT_P
+out vec3 outT;
+void main()
+{
+	ivec3 texel = ivec3(ivec2(gl_FragCoord.xy), layer);
+	int numCells = textureSize(depthMap, 0).z;
+	int slice = texel[sweepAxes.x];
+	int sweepSlice = sliceDir > 0 ? numCells - 1 - slice : slice;
+	float depth = texelFetch(depthMap,
+		ivec3(texel[sweepAxes.y], texel[sweepAxes.z], sweepSlice), 0).x;
+	outT = exp(-absorption * scatteringColor * densityMult * depth);
+}
+#endif
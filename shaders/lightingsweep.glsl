@@ -0,0 +1,63 @@
+uniform vec3 sundir;
+uniform sampler3D densityMap;
+// depth through the density toward the sun of the slice swept before this one
+uniform sampler2D prevDepthMap;
+// texture coordinates of texel (0,0) of this slice, and the step to the next texel and row
+uniform vec3 sliceOrigin;
+uniform vec3 texelStep;
+uniform vec3 rowStep;
+// where the ray toward the sun crosses the previous slice, in texels
+uniform vec2 shift;
+// how far the outermost texels are from the faces, in texels
+uniform vec2 edgeOffsets;
+// distance along the ray between slices, in texture space
+uniform float sliceLength;
+uniform int firstSlice;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#include "shaders/raymarch_common.glsl"
+
+// Between the outermost texels and the face of the volume the ray leaves through, the depth
+// goes down to 0 at the face instead of staying the same.
+float EdgeFalloff(float pos, float shift, float offset, float numCells)
+{
+	if(shift > 0.0 && pos > numCells - 1.0)
+		return (numCells - offset - pos) / (1.0 - offset);
+	if(shift < 0.0 && pos < 0.0)
+		return (pos + offset) / offset;
+	return 1.0;
+}
+
+#ifdef FRAGMENT_P
+out float outDepth;
+void main()
+{
+	vec2 texel = floor(gl_FragCoord.xy);
+	vec3 pos = sliceOrigin + texel.x * texelStep + texel.y * rowStep;
+	float rho = texture(densityMap, pos).x;
+
+	float exitFraction = length(GetExitPoint(pos, sundir) - pos) / sliceLength;
+	if(firstSlice != 0 || exitFraction < 1.0)
+	{
+		// leaves the volume before the previous slice, take the density as constant until then
+		outDepth = exitFraction * sliceLength * rho;
+		return;
+	}
+
+	// trapezoid from here to where the ray crosses the previous slice, plus its depth
+	float numCells = float(textureSize(prevDepthMap, 0).x);
+	vec2 prevTexel = texel + shift;
+	float prevDepth = texture(prevDepthMap, (prevTexel + 0.5) / numCells).x *
+		EdgeFalloff(prevTexel.x, shift.x, edgeOffsets.x, numCells) *
+		EdgeFalloff(prevTexel.y, shift.y, edgeOffsets.y, numCells);
+	float prevRho = texture(densityMap, pos + sliceLength * sundir).x;
+	outDepth = prevDepth + 0.5 * sliceLength * (rho + prevRho);
+}
+#endif
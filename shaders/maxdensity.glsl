@@ -0,0 +1,32 @@
+uniform sampler3D srcMap;
+uniform int layer;
+uniform int cellSize;
+uniform int border;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#ifdef FRAGMENT_P
+out float outMax;
+void main()
+{
+	// max of the cellSize^3 block of srcMap under this texel, widened by border texels
+	ivec3 cell = ivec3(ivec2(gl_FragCoord.xy), layer);
+	ivec3 srcMax = textureSize(srcMap, 0) - ivec3(1);
+	ivec3 lo = max(cell * cellSize - ivec3(border), ivec3(0));
+	ivec3 hi = min(cell * cellSize + ivec3(cellSize - 1 + border), srcMax);
+
+	float result = 0.0;
+	for(int z = lo.z; z <= hi.z; ++z)
+		for(int y = lo.y; y <= hi.y; ++y)
+			for(int x = lo.x; x <= hi.x; ++x)
+				result = max(result, texelFetch(srcMap, ivec3(x,y,z), 0).r);
+	outMax = result;
+}
+#endif
+
@@ -0,0 +1,64 @@
+// this frame's volumes and where they're seen, both premultiplied by alpha
+uniform sampler2D colorMap;
+uniform sampler2D distanceMap;
+// the accumulated volumes of the frames before
+uniform sampler2D historyMap;
+// from this frame's view space to the last frame's clip space
+uniform mat4 reproject;
+// 1/[0] and 1/[5] of the projection, to get view space back from distance
+uniform vec2 projScale;
+// how much of the history to keep, 0 when there isn't any
+uniform float historyWeight;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#ifdef FRAGMENT_P
+out vec4 outColor;
+
+void main()
+{
+	ivec2 size = textureSize(colorMap, 0);
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	vec4 cur = texelFetch(colorMap, texel, 0);
+
+	// The history is only trusted as far as it's within the range of this frame's neighbors.
+	// Anything that was uncovered or changed since is pulled back to what's here now.
+	vec4 lo = cur;
+	vec4 hi = cur;
+	for(int y = -1; y <= 1; ++y)
+	{
+		for(int x = -1; x <= 1; ++x)
+		{
+			vec4 neighbor = texelFetch(colorMap, clamp(texel + ivec2(x, y), ivec2(0), size - 1), 0);
+			lo = min(lo, neighbor);
+			hi = max(hi, neighbor);
+		}
+	}
+
+	// where this texel was last frame, pixels without any volume just stay put
+	vec2 uv = gl_FragCoord.xy / vec2(size);
+	vec2 prevUv = uv;
+	vec4 distance = texelFetch(distanceMap, texel, 0);
+	if(distance.a > 1e-3)
+	{
+		float dist = distance.r / distance.a;
+		vec3 viewPos = vec3((uv * 2.0 - 1.0) * projScale * dist, -dist);
+		vec4 prevClip = reproject * vec4(viewPos, 1.0);
+		prevUv = prevClip.xy / prevClip.w * 0.5 + 0.5;
+	}
+
+	float weight = historyWeight;
+	if(any(lessThan(prevUv, vec2(0.0))) || any(greaterThan(prevUv, vec2(1.0))))
+		weight = 0.0;
+	if(weight > 0.0)
+		outColor = mix(cur, clamp(texture(historyMap, prevUv), lo, hi), weight);
+	else
+		outColor = cur;
+}
+#endif
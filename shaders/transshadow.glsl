@@ -0,0 +1,44 @@
+uniform mat4 mvp;
+uniform vec3 sundir;
+// transmittance toward the sun from shaders/lightingsweep.glsl or computelighting.glsl
+uniform sampler3D transMap;
+uniform vec3 scatteringColor = vec3(1);
+uniform vec3 absorptionColor = vec3(1);
+
+#ifdef VERTEX_P
+in vec3 pos;
+in vec3 uv;
+out vec3 vCoord;
+void main()
+{
+	gl_Position = mvp * vec4(pos, 1);
+	vCoord = uv;
+}
+#endif
+
+#include "shaders/raymarch_common.glsl"
+
+#ifdef FRAGMENT_P
+in vec3 vCoord;
+out float outShadow;
+
+void main()
+{
+	// what's left of the sun where the ray leaves the volume is already in the transmittance,
+	// whose layers are at z / numCells instead of the texel centers
+	vec3 exitPt = GetExitPoint(vCoord, -sundir);
+	float numCells = float(textureSize(transMap, 0).z);
+	vec3 T = texture(transMap, exitPt + vec3(0, 0, 0.5 / numCells)).rgb;
+
+	// it's for the scattering color, get the optical depth back from the channel that scatters
+	// the most and scale it to the absorption color
+	float maxScattering = max(max(scatteringColor.r, scatteringColor.g), scatteringColor.b);
+	float Tmax = scatteringColor.r == maxScattering ? T.r :
+		(scatteringColor.g == maxScattering ? T.g : T.b);
+	vec3 Tshadow = pow(vec3(max(Tmax, 0.5 / 255.0)), 
+		absorptionColor / max(maxScattering, 1e-4));
+	float avgT = (Tshadow.x + Tshadow.y + Tshadow.z) / 3.0;
+
+	outShadow = 1.0 - avgT;
+}
+#endif
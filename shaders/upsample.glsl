@@ -0,0 +1,49 @@
+// reduced resolution volumes, premultiplied by alpha, and the depth they were tested against
+uniform sampler2D colorMap;
+uniform sampler2D lowDepthMap;
+// full resolution depth
+uniform sampler2D depthMap;
+// [10] and [14] of the projection, to get the distance back from depth
+uniform vec2 depthParams;
+
+#ifdef VERTEX_P
+in vec3 pos;
+void main()
+{
+	gl_Position = vec4(pos.xy,0,1);
+}
+#endif
+
+#ifdef FRAGMENT_P
+out vec4 outColor;
+
+float ViewDistance(float depth)
+{
+	return depthParams.y / (2.0 * depth - 1.0 + depthParams.x);
+}
+
+void main()
+{
+	ivec2 lowSize = textureSize(colorMap, 0);
+	vec2 lowPos = gl_FragCoord.xy * vec2(lowSize) / vec2(textureSize(depthMap, 0)) - 0.5;
+	ivec2 base = ivec2(floor(lowPos));
+	vec2 f = lowPos - floor(lowPos);
+	float dist = ViewDistance(texelFetch(depthMap, ivec2(gl_FragCoord.xy), 0).r);
+
+	// bilinear, except the texels whose depth is far from this pixel's hardly count. The color
+	// is premultiplied so the alpha is filtered along with it.
+	vec4 sum = vec4(0);
+	float weightSum = 0.0;
+	for(int i = 0; i < 4; ++i)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 texel = clamp(base + offset, ivec2(0), lowSize - 1);
+		vec2 bilinear = mix(1.0 - f, f, vec2(offset));
+		float lowDist = ViewDistance(texelFetch(lowDepthMap, texel, 0).r);
+		float weight = bilinear.x * bilinear.y / (1e-3 + abs(lowDist - dist) / dist);
+		sum += weight * texelFetch(colorMap, texel, 0);
+		weightSum += weight;
+	}
+	outColor = sum / max(weightSum, 1e-6);
+}
+#endif
@@ -1,8 +1,13 @@
+#include <atomic>
+#include <cstdint>
 #include <vector>
 #include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <iostream>
 #include "task.hh"
 #include "common.hh"
+#include "mathhelpers.hh"
 #include "ui.hh"
 #include "camera.hh"
 #include "render.hh"
@@ -12,179 +17,463 @@ using namespace std;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Types
+
+// Each worker has its own deque of tasks that are ready to run. A worker runs the newest task of
+// its own deque, then the oldest in the submit queue, then takes the oldest one of another
+// worker's, so workers keep going without waiting for the main thread. Tasks a worker appends go
+// on its own deque. Tasks are still initialized and joined on the main thread.
+class QueuedTask
+{
+public:
+	std::shared_ptr<Task> m_task;
+	bool m_joined; // false for the helpers of task_ParallelFor, which nobody waits on
+};
+
+// Where tasks from outside the workers go, and where idle workers look before stealing. It's
+// Dmitry Vyukov's bounded MPMC queue: a fixed ring of cells, each with a sequence number saying
+// which lap's producer may fill it or which lap's consumer may empty it, so any thread can push
+// and pop with a compare and swap on the position and nothing is ever allocated.
+class SubmitQueue
+{
+public:
+	static constexpr size_t kNumCells = 1024; // a power of two
+
+	SubmitQueue();
+	// false if it's full
+	bool Push(const QueuedTask& task);
+	bool Pop(QueuedTask& task);
+private:
+	class Cell
+	{
+	public:
+		std::atomic<size_t> m_sequence;
+		QueuedTask m_task;
+	};
+
+	Cell m_cells[kNumCells];
+	// apart so producers and consumers don't fight over the cache line
+	alignas(64) std::atomic<size_t> m_pushPos;
+	alignas(64) std::atomic<size_t> m_popPos;
+};
+
 class Worker
 {
 public:
-	Worker();
-	~Worker();
-
-	void RequestJoin();
-	void JoinThread();
-	void Signal();
-	bool Ready() const { return !m_task && bool(m_ready); }
-	bool Finished() const;
-	void StartTask(const std::shared_ptr<Task>& task);
-	void OnJoin() ;
+	Worker(int index) : m_index(index) {}
+
+	void Push(const QueuedTask& task);
+	bool Pop(QueuedTask& task);
+	bool Steal(QueuedTask& task);
+
+	void Start() { m_thread = std::thread(RunWorker, std::ref(*this)); }
+	void JoinThread() { m_thread.join(); }
 private:
 	static void RunWorker(Worker& worker);
-	std::condition_variable m_cond;
+	bool TakeTask(QueuedTask& task);
+
+	int m_index;
 	std::mutex m_mutex;
-	std::shared_ptr<Task> m_task;
-	int m_ready;						// 1 if the worker is ready to go
-	int m_joinRequested;				// true if main thread wants this worker to stop
+	std::deque<QueuedTask> m_tasks;
 	std::thread m_thread;
 } ;
 
-Worker::Worker()
-	: m_ready(0)
-	, m_joinRequested(0)
-	, m_thread(RunWorker, std::ref(*this))
+////////////////////////////////////////////////////////////////////////////////
+// File-scope globals
+static std::vector<std::shared_ptr<Worker>> g_workers;
+static SubmitQueue g_submitQueue;
+static std::atomic<unsigned> g_nextWorker; // where tasks go when g_submitQueue is full
+static std::thread::id g_mainThread;
+static thread_local Worker* t_worker; // the worker running on this thread
+
+// released on a worker, waiting for task_Update to call their init
+static std::mutex g_releasedMutex;
+static std::vector<std::shared_ptr<Task>> g_releasedTasks;
+
+// workers sleep on this when there's nothing to take
+static std::mutex g_wakeMutex;
+static std::condition_variable g_wakeCond;
+static std::atomic<int> g_numQueued; // in the worker deques and g_submitQueue
+static std::atomic<bool> g_quit;
+
+// run, waiting to be joined by task_Update
+static std::mutex g_completeMutex;
+static std::vector<std::shared_ptr<Task>> g_completeTasks;
+
+static std::atomic<int> g_curTotalJobs; // appended from any thread
+static int g_curCompletedJobs;
+
+////////////////////////////////////////////////////////////////////////////////
+bool Task::AddSuccessor(const std::shared_ptr<Task>& next)
 {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if(m_complete)
+		return false;
+	m_successors.push_back(next);
+	++next->m_numWaiting;
+	return true;
 }
-	
-Worker::~Worker()
+
+std::vector<std::shared_ptr<Task>> Task::Complete()
 {
-	if(m_thread.joinable()) {
-		m_thread.join();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_complete = true;
+	return std::move(m_successors);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void task_Release(const std::shared_ptr<Task>& task, bool mainThread);
+
+static void task_SignalQueued()
+{
+	std::unique_lock<std::mutex> lock(g_wakeMutex);
+	++g_numQueued;
+	g_wakeCond.notify_one();
+}
+
+// runs the task and releases what was waiting for it
+static void task_Run(QueuedTask& queued)
+{
+	if(queued.m_task->m_run)
+		queued.m_task->m_run();
+	for(auto& next: queued.m_task->Complete())
+		if(next->Release())
+			task_Release(next, std::this_thread::get_id() == g_mainThread);
+	if(queued.m_joined)
+	{
+		std::unique_lock<std::mutex> lock(g_completeMutex);
+		g_completeTasks.push_back(std::move(queued.m_task));
 	}
 }
 
-void Worker::RunWorker(Worker& worker)
+// work from a worker stays on it, the rest goes to whichever worker gets to it first. Without
+// any workers it's run right away.
+static void task_Push(const QueuedTask& task)
 {
-	while(!worker.m_joinRequested)
+	if(g_workers.empty())
 	{
-		if(worker.m_task && !worker.m_task->IsComplete())
-		{
-			worker.m_task->m_run();
-			worker.m_task->SetComplete();
-		}
-	
-		if(!worker.m_joinRequested) 
+		QueuedTask queued = task;
+		task_Run(queued);
+	}
+	else if(t_worker)
+		t_worker->Push(task);
+	else if(g_submitQueue.Push(task))
+		task_SignalQueued();
+	else
+		g_workers[g_nextWorker++ % g_workers.size()]->Push(task);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+constexpr size_t SubmitQueue::kNumCells;
+
+SubmitQueue::SubmitQueue()
+	: m_pushPos(0)
+	, m_popPos(0)
+{
+	for(size_t i = 0; i < kNumCells; ++i)
+		m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+}
+
+bool SubmitQueue::Push(const QueuedTask& task)
+{
+	Cell* cell;
+	size_t pos = m_pushPos.load(std::memory_order_relaxed);
+	for(;;)
+	{
+		cell = &m_cells[pos & (kNumCells - 1)];
+		const size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+		const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+		if(diff == 0)
 		{
-			std::unique_lock<std::mutex> lk(worker.m_mutex);
-			worker.m_ready = 1;
-			worker.m_cond.wait(lk);
-			worker.m_ready = 0;
+			if(m_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
 		}
+		else if(diff < 0) // still holds last lap's task
+			return false;
+		else
+			pos = m_pushPos.load(std::memory_order_relaxed);
 	}
+	cell->m_task = task;
+	cell->m_sequence.store(pos + 1, std::memory_order_release);
+	return true;
 }
-	
-void Worker::RequestJoin()
+
+bool SubmitQueue::Pop(QueuedTask& task)
 {
-	m_joinRequested = 1;
-	Signal();
+	Cell* cell;
+	size_t pos = m_popPos.load(std::memory_order_relaxed);
+	for(;;)
+	{
+		cell = &m_cells[pos & (kNumCells - 1)];
+		const size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+		const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+		if(diff == 0)
+		{
+			if(m_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0) // not filled yet
+			return false;
+		else
+			pos = m_popPos.load(std::memory_order_relaxed);
+	}
+	task = std::move(cell->m_task);
+	cell->m_sequence.store(pos + kNumCells, std::memory_order_release);
+	return true;
 }
-	
-void Worker::JoinThread()
+
+////////////////////////////////////////////////////////////////////////////////
+void Worker::Push(const QueuedTask& task)
 {
-	m_thread.join();
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_tasks.push_back(task);
+	}
+	task_SignalQueued();
 }
-	
-bool Worker::Finished() const
+
+bool Worker::Pop(QueuedTask& task)
 {
-	return(m_task && m_task->IsComplete());
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if(m_tasks.empty())
+		return false;
+	task = std::move(m_tasks.back());
+	m_tasks.pop_back();
+	--g_numQueued;
+	return true;
 }
 
-void Worker::Signal()
+bool Worker::Steal(QueuedTask& task)
 {
 	std::unique_lock<std::mutex> lock(m_mutex);
-	m_cond.notify_one();
+	if(m_tasks.empty())
+		return false;
+	task = std::move(m_tasks.front());
+	m_tasks.pop_front();
+	--g_numQueued;
+	return true;
 }
 
-void Worker::StartTask(const std::shared_ptr<Task>& task)
+bool Worker::TakeTask(QueuedTask& task)
 {
-	ASSERT(!m_task);
-	ASSERT(m_ready);
-	m_task = task;
-	if(m_task->m_init) m_task->m_init();
-	Signal();
+	if(Pop(task))
+		return true;
+	if(g_submitQueue.Pop(task))
+	{
+		--g_numQueued;
+		return true;
+	}
+	const int numWorkers = g_workers.size();
+	for(int i = 1; i < numWorkers; ++i)
+		if(g_workers[(m_index + i) % numWorkers]->Steal(task))
+			return true;
+	return false;
 }
 
-void Worker::OnJoin()
+void Worker::RunWorker(Worker& worker)
 {
-	if(m_task) {
-		if(m_task->m_join) m_task->m_join();
-		m_task.reset();
+	t_worker = &worker;
+	for(;;)
+	{
+		// what's still queued is dropped on shutdown
+		if(g_quit)
+			return;
+		QueuedTask queued;
+		if(!worker.TakeTask(queued))
+		{
+			std::unique_lock<std::mutex> lock(g_wakeMutex);
+			g_wakeCond.wait(lock, [](){ return g_quit || g_numQueued > 0; });
+			if(g_quit)
+				return;
+			continue;
+		}
+
+		task_Run(queued);
 	}
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// File-scope globals
-static std::vector<std::shared_ptr<Worker>> g_workers;
-static std::deque<std::shared_ptr<Task>> g_taskQueue;
-static int g_curTotalJobs;
-static int g_curCompletedJobs;
-
 ////////////////////////////////////////////////////////////////////////////////
 void task_Startup(int numWorkers)
 {
+	g_mainThread = std::this_thread::get_id();
+	g_quit = false;
 	for(int i = 0; i < numWorkers; ++i)
-		g_workers.push_back(std::make_shared<Worker>());
+		g_workers.push_back(std::make_shared<Worker>(i));
+	// started once they're all there, they steal from each other
+	for(auto worker: g_workers)
+		worker->Start();
 }
 
-void task_Shutdown()
+// joins what's been run
+static void task_JoinComplete()
 {
-	for(auto worker: g_workers)
-		worker->RequestJoin();
-	for(auto worker: g_workers)
+	std::vector<std::shared_ptr<Task>> complete;
 	{
-		worker->JoinThread();
-		worker->OnJoin();
+		std::unique_lock<std::mutex> lock(g_completeMutex);
+		complete.swap(g_completeTasks);
+	}
+	for(auto& task: complete)
+	{
+		if(task->m_join) task->m_join();
+		++g_curCompletedJobs;
 	}
-	g_workers.clear();
 }
 
-static std::shared_ptr<Task> task_PopNext()
+void task_Shutdown()
 {
-	int numAttempts = g_taskQueue.size();
-	while(numAttempts--> 0)
 	{
-		std::shared_ptr<Task> nextTask = g_taskQueue.front();
-		g_taskQueue.pop_front();
-
-		if(nextTask->CanStart())
-			return nextTask;
-		
-		g_taskQueue.push_back(nextTask);
-	}	
-	return nullptr;
+		std::unique_lock<std::mutex> lock(g_wakeMutex);
+		g_quit = true;
+		g_wakeCond.notify_all();
+	}
+	// tasks that were running are finished and joined, the rest are dropped
+	for(auto worker: g_workers)
+		worker->JoinThread();
+	task_JoinComplete();
+	g_workers.clear();
+	g_releasedTasks.clear();
+	QueuedTask dropped;
+	while(g_submitQueue.Pop(dropped)) {}
+	g_numQueued = 0;
+	g_curTotalJobs = 0;
+	g_curCompletedJobs = 0;
 }
 
-void task_Update()
+// Hands a task that isn't waiting for anything to the workers. init is called on the main
+// thread right before the workers can take it.
+static void task_Release(const std::shared_ptr<Task>& task, bool mainThread)
 {
-	for(auto worker: g_workers)
+	if(task->m_init)
 	{
-		if(worker->Finished()) { 
-			worker->OnJoin();
-			++g_curCompletedJobs;
-		}
-
-		if(worker->Ready() && !g_taskQueue.empty())
+		if(!mainThread)
 		{
-			std::shared_ptr<Task> nextTask = task_PopNext();
-			if(nextTask) // if no tasks can be started, this can be null
-				worker->StartTask(nextTask);
+			std::unique_lock<std::mutex> lock(g_releasedMutex);
+			g_releasedTasks.push_back(task);
+			return;
 		}
+		task->m_init();
 	}
+	task_Push({task, true});
+}
+
+void task_Update()
+{
+	task_JoinComplete();
 
-	if(g_curTotalJobs == g_curCompletedJobs)
+	std::vector<std::shared_ptr<Task>> released;
 	{
-		g_curTotalJobs = 0;
-		g_curCompletedJobs = 0;
+		std::unique_lock<std::mutex> lock(g_releasedMutex);
+		released.swap(g_releasedTasks);
 	}
+	for(auto& task: released)
+		task_Release(task, true);
+
+	// tasks can be appended meanwhile, only start over if none were
+	int numJobs = g_curCompletedJobs;
+	if(g_curTotalJobs.compare_exchange_strong(numJobs, 0))
+		g_curCompletedJobs = 0;
 }
 
 void task_AppendTask(const std::shared_ptr<Task>& task)
 {
-	g_taskQueue.push_back(task);
 	++g_curTotalJobs;
+	if(task->Release())
+		task_Release(task, std::this_thread::get_id() == g_mainThread);
+}
+
+void task_AddDependency(const std::shared_ptr<Task>& task, const std::shared_ptr<Task>& before)
+{
+	before->AddSuccessor(task);
+}
+
+std::shared_ptr<Task> task_AppendContinuation(const std::vector<std::shared_ptr<Task>>& before,
+	std::function<void()> run, std::function<void()> join)
+{
+	auto task = std::make_shared<Task>(nullptr, join, run);
+	for(auto& prev: before)
+		task_AddDependency(task, prev);
+	task_AppendTask(task);
+	return task;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Chunks are handed out from a shared cursor, big ones while there's a lot left and down to
+// the grain toward the end, so the threads finish at about the same time.
+class ParallelFor
+{
+public:
+	ParallelFor(int begin, int end, int grain, int numThreads,
+		const std::function<void(int, int)>& func)
+		: m_next(begin), m_end(end), m_grain(Max(1, grain)), m_numThreads(numThreads)
+		, m_numLeft(end - begin), m_func(&func) {}
+
+	// false once everything's been handed out
+	bool RunChunk();
+	void Wait();
+private:
+	std::atomic<int> m_next;
+	int m_end;
+	int m_grain;
+	int m_numThreads;
+	std::atomic<int> m_numLeft; // not done yet
+	const std::function<void(int, int)>* m_func; // only used while m_numLeft > 0
+	std::mutex m_mutex;
+	std::condition_variable m_doneCond;
+};
+
+bool ParallelFor::RunChunk()
+{
+	int begin = m_next.load(), end;
+	do
+	{
+		if(begin >= m_end)
+			return false;
+		end = begin + Max(m_grain, (m_end - begin) / (2 * m_numThreads));
+		end = Min(end, m_end);
+	} while(!m_next.compare_exchange_weak(begin, end));
+
+	(*m_func)(begin, end);
+	if(m_numLeft.fetch_sub(end - begin) == end - begin)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCond.notify_all();
+	}
+	return true;
+}
+
+void ParallelFor::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_doneCond.wait(lock, [this](){ return m_numLeft == 0; });
+}
+
+void task_ParallelFor(int begin, int end, int grain,
+	const std::function<void(int, int)>& func)
+{
+	if(begin >= end)
+		return;
+	const int numChunks = (end - begin + Max(1, grain) - 1) / Max(1, grain);
+	const int numHelpers = Min(int(g_workers.size()), numChunks - 1);
+	auto loop = std::make_shared<ParallelFor>(begin, end, grain, numHelpers + 1, func);
+
+	// helpers that start after the loop's done find nothing left and return
+	for(int i = 0; i < numHelpers; ++i)
+	{
+		auto helper = std::make_shared<Task>([loop]() {
+			while(loop->RunChunk()) {}
+		});
+		task_Push({helper, false});
+	}
+
+	while(loop->RunChunk()) {}
+	loop->Wait();
 }
 
 void task_RenderProgress()
 {
-	if(g_curTotalJobs == 0) return;
+	const int numJobs = g_curTotalJobs;
+	if(numJobs == 0) return;
 
-	float ratio = float(g_curCompletedJobs) / float(g_curTotalJobs);
+	float ratio = float(g_curCompletedJobs) / float(numJobs);
 	ui_DrawColoredQuad(0.f, g_screen.m_height - 20.f, g_screen.m_width, 20.f, 1.f,
 		Color(0,0,0), Color(1,1,1));
 	ui_DrawColoredQuad(1.f, g_screen.m_height - 19.f, (g_screen.m_width - 2.f) * ratio, 18.f, 0.f,
@@ -194,7 +483,7 @@ void task_RenderProgress()
 		char progressStr[32] = {};
 		static Color kWhite = {1};
 		static Color kBlack = {0};
-		snprintf(progressStr, sizeof(progressStr) - 1, "%d/%d", g_curCompletedJobs, g_curTotalJobs);
+		snprintf(progressStr, sizeof(progressStr) - 1, "%d/%d", g_curCompletedJobs, numJobs);
 		font_Print(10.f, g_screen.m_height - 5, progressStr, g_curCompletedJobs > 0 ? kBlack : kWhite, 16.f);
 	}
 
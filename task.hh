@@ -1,45 +1,70 @@
 #pragma once
 
+#include <atomic>
 #include <thread>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 class Task
 {
 public:
-	Task(std::function<void()> run, std::function<bool()> canStart = nullptr)
+	Task(std::function<void()> run)
 		: m_init()
 		, m_join()
 		, m_run(run)
-		, m_canStart(canStart)
-		, m_complete(0) {}
+		, m_numWaiting(1)
+		, m_complete(false) {}
 
 	Task(std::function<void()> init, 
 		std::function<void()> join,
-		std::function<void()> run,
-		std::function<bool()> canStart = nullptr) 
+		std::function<void()> run) 
 		: m_init(init)
 		, m_join(join)
 		, m_run(run)
-		, m_canStart(canStart)
-		, m_complete(0) {}
+		, m_numWaiting(1)
+		, m_complete(false) {}
+
+	bool IsComplete() const { std::unique_lock<std::mutex> lock(m_mutex); return m_complete; }
+	// next waits for this to run. False if it already has.
+	bool AddSuccessor(const std::shared_ptr<Task>& next);
+	// marks it as run and hands back the successors
+	std::vector<std::shared_ptr<Task>> Complete();
+	// true when the last thing it was waiting for is done
+	bool Release() { return --m_numWaiting == 0; }
 
-	bool IsComplete() const { return m_complete; }
-	void SetComplete() { m_complete = 1; }
-	
-	bool CanStart() const { return m_canStart == nullptr || m_canStart(); }
 	std::function<void()> m_init;
 	std::function<void()> m_join;
 	std::function<void()> m_run;
-	std::function<bool()> m_canStart;
 private:
-
-	int m_complete;
+	mutable std::mutex m_mutex;
+	std::vector<std::shared_ptr<Task>> m_successors;
+	std::atomic<int> m_numWaiting; // predecessors that haven't run, plus one until it's appended
+	bool m_complete;
 } ;
 
+// Tasks run on the worker threads as soon as one is free. They can be appended from any thread,
+// including from another task's run. init and join are called on the main thread, init when the
+// task is handed to the workers (from task_Update if it's appended elsewhere) and join from
+// task_Update once it's run.
+// A task can be made to wait for other tasks with task_AddDependency. It's handed to the workers
+// as soon as the last of them has run, without waiting for their joins or the next task_Update.
+// One with an init still waits for task_Update to call it.
 void task_Startup(int numWorkers);
 void task_Shutdown();
 void task_Update();
 void task_AppendTask(const std::shared_ptr<Task>& task);
+// Makes task wait for before to run. task can't have been appended yet, before can have been
+// and may even be done already.
+void task_AddDependency(const std::shared_ptr<Task>& task, const std::shared_ptr<Task>& before);
+// Appends a task that runs run once all of before have run. With just a join it's a fan-in,
+// join is called from task_Update once all of before are done.
+std::shared_ptr<Task> task_AppendContinuation(const std::vector<std::shared_ptr<Task>>& before,
+	std::function<void()> run, std::function<void()> join = nullptr);
+// Calls func(chunkBegin, chunkEnd) over begin to end in chunks of at least grain, on the workers
+// and the calling thread, and returns once it's all done. Can be called from any thread,
+// including from a task's run.
+void task_ParallelFor(int begin, int end, int grain, const std::function<void(int, int)>& func);
 void task_RenderProgress();
 
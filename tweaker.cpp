@@ -172,6 +172,24 @@ void TweakVector::Write(TokWriter& writer)
 	writer.Float(v.z);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TweakString::TweakString(const char* name, std::string* var, const char* def)
+	: TweakVarBase(name)
+	, m_var(var)
+	, m_default(def)
+{}
+
+void TweakString::Parse(TokParser& parser)
+{
+	char buffer[256];
+	parser.GetString(buffer, sizeof(buffer));
+	*m_var = buffer;
+}
+
+void TweakString::Write(TokWriter& writer)
+{
+	writer.String(m_var->c_str());
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 bool tweaker_LoadVars(const char* filename, const std::vector<std::shared_ptr<TweakVarBase>>& vars)
@@ -194,11 +212,14 @@ bool tweaker_LoadVars(const char* filename, const std::vector<std::shared_ptr<Tw
 
 	TokParser parser(&data[0], fileSize);
 	
-	// read in name = value pairs
+	// read in name = value pairs. The values of names that aren't in vars are skipped up to the
+	// next name, so a file can be read with only some of its vars.
 	while(parser)
 	{
 		char bufname[256];
-		parser.GetString(bufname, sizeof(bufname));
+		do
+			parser.GetString(bufname, sizeof(bufname));
+		while(parser && !parser.IsTok("="));
 		parser.ExpectTok("=");
 		if(!parser) break;
 		for(auto var: vars)
@@ -118,6 +118,19 @@ private:
 	vec3 m_default;
 };
 
+class TweakString : public TweakVarBase
+{
+public:
+	TweakString(const char* name, std::string* var, const char* def = "");
+
+	void Parse(TokParser& parser);
+	void Write(TokWriter& writer);
+	void Reset() { *m_var = m_default; }
+private:
+	std::string* m_var;
+	std::string m_default;
+};
+
 bool tweaker_LoadVars(const char* filename, const std::vector<std::shared_ptr<TweakVarBase>>& vars);
 bool tweaker_SaveVars(const char* filename, const std::vector<std::shared_ptr<TweakVarBase>>& vars);
 
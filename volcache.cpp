@@ -0,0 +1,257 @@
+#include "volcache.hh"
+#include "hyper.hh"
+#include "commonmath.hh"
+#include "htvfile.hh"
+#include <algorithm>
+#include <cstdio>
+#include <list>
+#include <unordered_map>
+#include <sys/stat.h>
+
+////////////////////////////////////////////////////////////////////////////////
+class VolumeCacheEntry
+{
+public:
+	VolumeKey m_key;
+	std::shared_ptr<HypertextureVolume> m_volume;
+	size_t m_size;
+};
+
+typedef std::list<VolumeCacheEntry> VolumeCacheList;
+
+static VolumeCacheList g_entries; // most recently used first
+static std::unordered_map<unsigned long long, VolumeCacheList::iterator> g_entryLookup;
+static std::list<std::shared_ptr<HypertextureVolume>> g_pool; // most recently released first
+static size_t g_budget = size_t(512) << 20;
+static size_t g_used;
+static size_t g_pooled;
+static int g_hits;
+static int g_misses;
+static int g_reuses;
+static bool g_diskEnabled;
+static bool g_diskCompressEnabled = true;
+
+const char* const kVolumeCacheDir = "volcache";
+
+////////////////////////////////////////////////////////////////////////////////
+void VolumeKey::AddBytes(const void* data, size_t len)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	m_data.insert(m_data.end(), p, p + len);
+	m_hash = MakeHash64(data, len, m_hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Drops the least recently used cached volume that nothing else has, and returns it. Evicting
+// the ones in use wouldn't free anything.
+static std::shared_ptr<HypertextureVolume> EvictOldestUnused()
+{
+	for(auto it = g_entries.end(); it != g_entries.begin(); )
+	{
+		--it;
+		if(it->m_volume.use_count() > 1)
+			continue;
+		std::shared_ptr<HypertextureVolume> volume = std::move(it->m_volume);
+		g_used -= it->m_size;
+		g_entryLookup.erase(it->m_key.m_hash);
+		g_entries.erase(it);
+		return volume;
+	}
+	return nullptr;
+}
+
+static std::shared_ptr<HypertextureVolume> PopOldestPooled()
+{
+	std::shared_ptr<HypertextureVolume> volume = std::move(g_pool.back());
+	g_pool.pop_back();
+	g_pooled -= volume->GetMemorySize();
+	return volume;
+}
+
+static bool SameSize(const HypertextureVolume& volume, int numCells, int shadowDim)
+{
+	return volume.m_numCells == numCells && volume.m_shadowDim == shadowDim;
+}
+
+// Frees pooled and then cached volumes until reserve more bytes fit in the budget or there's
+// nothing left that can be freed. Returns one of them if it's the size asked for.
+static std::shared_ptr<HypertextureVolume> TrimToBudget(size_t reserve, int numCells = 0,
+	int shadowDim = 0)
+{
+	while(HypertextureVolume::GetTotalMemory() + reserve > g_budget)
+	{
+		std::shared_ptr<HypertextureVolume> volume = 
+			!g_pool.empty() ? PopOldestPooled() : EvictOldestUnused();
+		if(!volume)
+			break;
+		if(SameSize(*volume, numCells, shadowDim))
+			return volume;
+	}
+	return nullptr;
+}
+
+void volcache_SetBudget(int megabytes)
+{
+	g_budget = size_t(Max(0, megabytes)) << 20;
+	TrimToBudget(0);
+}
+
+int volcache_GetBudget()
+{
+	return int(g_budget >> 20);
+}
+
+size_t volcache_GetMemoryUsed()
+{
+	return g_used;
+}
+
+size_t volcache_GetResidentMemory()
+{
+	return HypertextureVolume::GetTotalMemory();
+}
+
+size_t volcache_GetPooledMemory()
+{
+	return g_pooled;
+}
+
+int volcache_GetCount()
+{
+	return g_entries.size();
+}
+
+int volcache_GetPooledCount()
+{
+	return g_pool.size();
+}
+
+int volcache_GetReuses()
+{
+	return g_reuses;
+}
+
+int volcache_GetHits()
+{
+	return g_hits;
+}
+
+int volcache_GetMisses()
+{
+	return g_misses;
+}
+
+void volcache_Clear()
+{
+	g_entries.clear();
+	g_entryLookup.clear();
+	g_used = 0;
+	g_pool.clear();
+	g_pooled = 0;
+}
+
+std::shared_ptr<HypertextureVolume> volcache_Find(const VolumeKey& key)
+{
+	auto found = g_entryLookup.find(key.m_hash);
+	if(found == g_entryLookup.end() || !(found->second->m_key == key))
+	{
+		++g_misses;
+		return nullptr;
+	}
+	++g_hits;
+	g_entries.splice(g_entries.begin(), g_entries, found->second);
+	return found->second->m_volume;
+}
+
+void volcache_Insert(const VolumeKey& key, const std::shared_ptr<HypertextureVolume>& volume)
+{
+	auto found = g_entryLookup.find(key.m_hash);
+	if(found != g_entryLookup.end())
+	{
+		g_used -= found->second->m_size;
+		g_entries.erase(found->second);
+		g_entryLookup.erase(found);
+	}
+
+	const size_t size = HypertextureVolume::GetMemorySize(volume->m_numCells, 
+		volume->m_shadowDim);
+	g_entries.push_front(VolumeCacheEntry{key, volume, size});
+	g_entryLookup[key.m_hash] = g_entries.begin();
+	g_used += size;
+	TrimToBudget(0);
+}
+
+std::shared_ptr<HypertextureVolume> volcache_Acquire(int numCells, int shadowDim)
+{
+	for(auto it = g_pool.begin(); it != g_pool.end(); ++it)
+	{
+		if(SameSize(**it, numCells, shadowDim))
+		{
+			std::shared_ptr<HypertextureVolume> volume = std::move(*it);
+			g_pool.erase(it);
+			g_pooled -= volume->GetMemorySize();
+			++g_reuses;
+			return volume;
+		}
+	}
+
+	const size_t size = HypertextureVolume::GetMemorySize(numCells, shadowDim);
+	if(std::shared_ptr<HypertextureVolume> volume = TrimToBudget(size, numCells, shadowDim))
+	{
+		++g_reuses;
+		return volume;
+	}
+	return std::make_shared<HypertextureVolume>(numCells, shadowDim);
+}
+
+void volcache_Release(std::shared_ptr<HypertextureVolume>&& volume)
+{
+	std::shared_ptr<HypertextureVolume> released = std::move(volume);
+	if(!released || released.use_count() > 1)
+		return;
+	g_pooled += released->GetMemorySize();
+	g_pool.push_front(std::move(released));
+	TrimToBudget(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void volcache_SetDiskEnabled(bool enabled)
+{
+	g_diskEnabled = enabled;
+}
+
+bool volcache_IsDiskEnabled()
+{
+	return g_diskEnabled;
+}
+
+void volcache_SetDiskCompressEnabled(bool enabled)
+{
+	g_diskCompressEnabled = enabled;
+}
+
+bool volcache_IsDiskCompressEnabled()
+{
+	return g_diskCompressEnabled;
+}
+
+std::string volcache_GetDiskPath(const VolumeKey& key)
+{
+	mkdir(kVolumeCacheDir, S_IRWXU);
+	char filename[64] = {};
+	snprintf(filename, sizeof(filename) - 1, "/%016llx.htv", key.m_hash);
+	return kVolumeCacheDir + std::string(filename);
+}
+
+std::shared_ptr<HtvFile> volcache_OpenFile(const VolumeKey& key)
+{
+	std::shared_ptr<HtvFile> file = HtvFile::Open(volcache_GetDiskPath(key).c_str());
+	if(!file)
+		return nullptr;
+
+	const HtvHeader& header = file->GetHeader();
+	if(header.m_keyHash != key.m_hash || header.m_keySize != key.m_data.size() ||
+		!std::equal(key.m_data.begin(), key.m_data.end(), file->GetKey()))
+		return nullptr;
+	return file;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "hashmap.hh"
+
+class HypertextureVolume;
+class HtvFile;
+
+// Identifies a generated volume by everything that went into it. The bytes are kept along
+// with the hash so a collision can't hand back the wrong volume.
+class VolumeKey
+{
+public:
+	VolumeKey() : m_hash(kHash64Seed), m_data() {}
+
+	template< class T >
+	void Add(const T& value) { AddBytes(&value, sizeof(T)); }
+	void Add(const std::string& str) { AddBytes(str.data(), str.size()); Add(str.size()); }
+
+	bool operator==(const VolumeKey& other) const
+		{ return m_hash == other.m_hash && m_data == other.m_data; }
+
+	unsigned long long m_hash;
+	std::vector<unsigned char> m_data;
+private:
+	void AddBytes(const void* data, size_t len);
+};
+
+// LRU cache of finished volumes, shared by every GpuHypertexture. It also pools volumes nobody
+// uses anymore so their textures are reused instead of allocated again. The budget is for all
+// of the volumes there are, and unused pooled and cached ones are freed, least recently used
+// first, to stay under it. Volumes still in use elsewhere are only dropped from the cache, the
+// memory goes away with the last reference.
+void volcache_SetBudget(int megabytes);
+int volcache_GetBudget();
+// of the cached volumes
+size_t volcache_GetMemoryUsed();
+// of every volume, cached, pooled or in use
+size_t volcache_GetResidentMemory();
+size_t volcache_GetPooledMemory();
+int volcache_GetCount();
+int volcache_GetPooledCount();
+int volcache_GetReuses();
+int volcache_GetHits();
+int volcache_GetMisses();
+void volcache_Clear();
+
+// Returns the volume and makes it the most recently used, or null.
+std::shared_ptr<HypertextureVolume> volcache_Find(const VolumeKey& key);
+void volcache_Insert(const VolumeKey& key, const std::shared_ptr<HypertextureVolume>& volume);
+// A volume to overwrite. A pooled one with the same sizes is reused first, then the budget
+// is made room for and one of the evicted volumes is taken over if it's the right size.
+// Otherwise a new one is made.
+std::shared_ptr<HypertextureVolume> volcache_Acquire(int numCells, int shadowDim);
+// Gives a volume up. If nothing else has it, it's pooled for volcache_Acquire.
+void volcache_Release(std::shared_ptr<HypertextureVolume>&& volume);
+
+// Finished volumes can also be kept as .htv files in kVolumeCacheDir, named by the key hash,
+// and mapped back in when they aren't in memory. Off by default.
+extern const char* const kVolumeCacheDir;
+void volcache_SetDiskEnabled(bool enabled);
+bool volcache_IsDiskEnabled();
+// Write the files with the empty bricks left out and the rest compressed, on by default
+void volcache_SetDiskCompressEnabled(bool enabled);
+bool volcache_IsDiskCompressEnabled();
+// Where the volume for key goes, makes the directory if needed.
+std::string volcache_GetDiskPath(const VolumeKey& key);
+// Returns the file with the volume for key or null. 
+std::shared_ptr<HtvFile> volcache_OpenFile(const VolumeKey& key);